@@ -13,12 +13,35 @@ I have also added the Branch and Link (BL) operation for executing function call
 Added functionality to pause execution each instruction, and print the stack contents, if any, based on the
 current stack pointer.
 
+Since then the emulator has moved to 64-bit registers and a paged, byte-addressable memory, and programs are
+assembled in one pass with optional addresses and labels. They are decoded once into a stream of ops run
+with threaded dispatch (or out of a basic block cache with "--engine=blocks"), with the original switch
+interpreter kept as the reference. On top of that come headless and batch runs, a profiler, cache, pipeline
+and branch predictor models, program images, snapshots, execution traces, lanes, breakpoints and
+watchpoints, a static optimizer and a benchmark driver. The usage message lists the options and README.md
+says what each one does.
+
 */
 
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include <time.h>
+#include <limits.h>
+#include <stdint.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
 
 // MACRO CONSTANTS
 
@@ -30,6 +53,43 @@ current stack pointer.
 #define DOUBLEWORD 8
 #define STACKUPPERBOUND MEMSIZE -1
 #define REGISTERSPACE 32
+#define OUTBUFSIZE (1 << 20)
+#define PAGEBITS 12
+#define PAGESIZE (1 << PAGEBITS)
+#define MAXPAGES (1 << 18)        // 1 GB of guest data per machine
+#define MAXTEXTSLOTS (1 << 24)
+#define MAXFUSE 32                // longest run of instructions one fused op covers
+#define MAXBLOCKOPS 64            // longest basic block translated as one
+#define MAXBLOCKS 65536           // translated blocks kept before the cache is flushed
+#define BLOCKBUCKETS (1 << 12)
+#define MAXCACHELEVELS 4
+#define MAXBREAKS 16
+#define MAXWATCHES 16
+#define MAXOPTROUNDS 32           // rounds of the static optimizer's passes before it stops looking
+#define BRANCHPENALTY 2           // cycles lost when a branch resolved in EX redirects fetch
+#define JUMPPENALTY 1             // cycles lost to B/BL, whose target is known in ID
+#define PREDICTORBITS 12          // default log2 of the branch predictor table sizes
+#define RASDEPTH 16
+#define IMAGEMAGIC "LEGv8IMG"
+#define IMAGEVERSION 1
+#define SNAPSHOTMAGIC "LEGv8SNP"
+#define SNAPSHOTVERSION 1
+#define CHECKPOINTSLICE (1LL << 22)  // instructions run between checks for a checkpoint signal
+#define TRACEMAGIC "LEGv8TRC"
+#define TRACEVERSION 1
+#define RINGSIZE (1 << 24)        // bytes of trace buffered between the interpreter and the writer
+#define RECORDCHUNK (1 << 16)     // bytes of trace encoded before they go into the ring
+#define MAXRECORD 64              // longest encoding of one step
+#define LANEWIDTH 16              // lanes run side by side in one group
+#if defined(__GNUC__) && !defined(__clang__) && defined(__x86_64__) && defined(__linux__)
+#define LANECLONES __attribute__((target_clones("arch=x86-64-v4", "avx2", "default")))
+#else
+#define LANECLONES                // lane kernels built for the baseline instruction set only
+#endif
+#define BENCHSTACKTOP (1LL << 30) // where --bench puts the stack unless told otherwise,
+#define BENCHSTACKSIZE (1LL << 24)  // with room for deep recursion
+#define BENCHREPEATS 3
+#define MAXASMERRORS 20           // errors reported per program before the rest are only counted
 #define SP 28
 #define PC 29
 #define LR 30
@@ -50,390 +110,5897 @@ current stack pointer.
 #define BL 31
 #define B 5
 
+// 64-bit guest arithmetic wraps around like the hardware instead of overflowing
+
+#define ADDWRAP(a, b) ((long long) ((unsigned long long) (a) + (unsigned long long) (b)))
+#define SUBWRAP(a, b) ((long long) ((unsigned long long) (a) - (unsigned long long) (b)))
+#define SHLWRAP(a, n) ((long long) ((unsigned long long) (a) << ((n) & 63)))
+
+// TRACE LEVELS
+
+enum TraceLevel { TRACE_NONE, TRACE_DUMP, TRACE_FULL };
+
+enum Engine { ENGINE_THREADED, ENGINE_BLOCKS };
+
+// PIPELINE MODELS
+
+enum PipelineMode { PIPELINE_OFF, PIPELINE_FORWARDING, PIPELINE_NOFORWARDING };
+
+// BRANCH PREDICTION SCHEMES
+
+enum PredictScheme { PREDICT_NOTTAKEN, PREDICT_BIMODAL, PREDICT_GSHARE, NUMSCHEMES };
+
+// Execution trace record tags: the low bits hold the opcode's index in TRACEOPCODES, or TAGEND
+// for the record that closes the trace, and the flags say which fields follow.
+
+enum TraceTag { TAG_OPCODE = 0x0f, TAGEND = 0x0f, TAG_REGISTER = 0x10, TAG_MEMORY = 0x20, TAG_JUMP = 0x40 };
+
+// Buffered console output. Text is formatted straight into data and only written to sink
+// when the buffer fills or is flushed.
+
+typedef struct {
+    char *data;
+    size_t length, capacity;
+    FILE *sink;                   // NULL keeps everything in memory, growing as needed
+} OutBuf;
+
+// Data cache parameters for one level: size and line size in bytes, ways per set, and the
+// replacement policy.
+
+enum CachePolicy { CACHE_LRU, CACHE_RANDOM };
+
+typedef struct {
+    long long size;
+    int assoc, line, policy;
+} CacheConfig;
+
+// A breakpoint stops the program before the instruction at pc runs, if its condition holds:
+// register reg compared with register other, or with value when other is -1. A reg of -1
+// means there is no condition.
+
+enum Comparison { CMP_EQ, CMP_NE, CMP_LT, CMP_LE, CMP_GT, CMP_GE };
+
+typedef struct {
+    long long pc;
+    int reg, comparison, other;
+    long long value;
+} Breakpoint;
+
+// A watchpoint stops the program after any access of the kinds in access to a byte of the
+// doubleword at address.
+
+enum WatchAccess { WATCH_READ = 1, WATCH_WRITE = 2 };
+
+typedef struct {
+    long long address;
+    int access;
+} Watchpoint;
+
+// The watchpoint an access has just hit and what the access did, for the debugger to report.
+
+typedef struct {
+    int number;                   // 1 + the watchpoint's index, 0 until one is hit
+    int access;
+    long long address, old, value;
+} WatchHit;
+
+// Settings shared by every machine a run creates.
+
+typedef struct {
+    int trace;
+    long long limit;
+    long long stackTop, stackSize;
+    int profile;
+    char *profileDir;             // where folded stacks go, NULL for next to the program
+    CacheConfig cache[MAXCACHELEVELS];
+    int cacheLevels;              // 0 runs without a cache model
+    int pipeline;
+    int predict, primaryScheme;   // bit mask of PredictScheme values, and the first one listed
+    int predictBits, rasDepth;    // rasDepth 0 predicts no returns
+    int fuse;
+    int engine;
+    char *checkpointPath;         // NULL unless checkpointing
+    long long checkpointAt;       // instruction count to checkpoint at, or -1
+    long long checkpointPc;       // instruction address to checkpoint at, or -1
+    char *recordPath;             // NULL unless recording an execution trace
+    char *lanesPath;              // NULL unless running one program over many inputs
+    Breakpoint breaks[MAXBREAKS];
+    int breakCount;
+    Watchpoint watches[MAXWATCHES];
+    int watchCount;
+} RunOptions;
+
+// One instruction of the packed text segment. rd and rn hold the first and second register
+// operands and imm the last operand: the third register, the immediate or offset, or the
+// branch address.
+
+typedef struct {
+    short opcode;                 // operation label, 0 for an empty slot
+    unsigned char rd, rn;
+    int imm;
+} TextInstr;
+
+// An instruction read from the program file, held until the text segment is laid out.
+
+typedef struct {
+    int address;
+    TextInstr instr;
+} LoadedInstr;
+
+// Program images start with this header, followed by textSlots packed instructions. Images
+// hold host byte order; one written on a machine of the other order fails the version check.
+
+typedef struct {
+    char magic[8];                // IMAGEMAGIC, without a terminator
+    int version;                  // IMAGEVERSION
+    int textBase, textSlots;
+    int entry;                    // starting PC
+    int reserved[2];              // zero; keeps the instructions 8-byte aligned
+} ImageHeader;
+
+// Snapshots start with this header, padded out to a page. The text segment follows at
+// textOffset, the page numbers of the data memory at indexOffset, and the pages themselves,
+// in the same order and each on its own page of the file, at pageOffset.
+
+typedef struct {
+    char magic[8];                // SNAPSHOTMAGIC, without a terminator
+    int version;                  // SNAPSHOTVERSION
+    int textBase, textSlots;
+    int pageCount;
+    long long stackTop, stackSize;
+    long long executed;           // instructions the program had run when the snapshot was taken
+    long long registers[REGISTERSPACE];
+    long long textOffset, indexOffset, pageOffset;
+} SnapshotHeader;
+
+#define PAGEROUND(n) (((n) + PAGESIZE - 1) & ~(long long) (PAGESIZE - 1))
+
+// Guest data memory. Pages are found through an open-addressing hash of their page numbers,
+// with the most recently used page checked first. Pages are allocated on the first store to
+// them; reading a page that was never stored to gives zeros.
+
+typedef struct {
+    unsigned long long number;
+    unsigned char *data;          // NULL marks an empty entry
+} PageEntry;
+
+typedef struct {
+    PageEntry *entries;
+    int capacity, count;          // capacity is zero or a power of two
+    unsigned long long lastNumber;    // NOPAGE until a page has been used
+    unsigned char *lastData;
+    unsigned char *mapped;        // pages in here belong to a mapped snapshot, not the heap
+    size_t mappedSize;
+} PageTable;
+
+#define NOPAGE (~0ULL)            // above any page number a 64-bit address can have
+
+// True when the doubleword at address a lies wholly inside the machine's most recently used
+// page and clear of the text segment, so it can be accessed directly through lastData.
+
+#define FASTPAGE(m, a) (((unsigned long long) (a) >> PAGEBITS) == (m)->pages.lastNumber \
+                     && ((a) & (PAGESIZE - 1)) <= PAGESIZE - DOUBLEWORD \
+                     && (unsigned long long) ((a) - (m)->textBase) >= (unsigned long long) (m)->textSlots * WORD)
+
+// DECODED OPERATION KINDS
+
+enum OpKind { K_HALT, K_ADD, K_ADDI, K_ADDSP, K_SUB, K_SUBI, K_SUBSP, K_LDUR, K_STUR,
+              K_LSL, K_CBZ, K_CBNZ, K_BR, K_BL, K_B, K_SLOW, K_PUSH, K_POP, K_LOOP, NUMKINDS };
+
+// One decoded instruction. rd doubles as Rt for LDUR/STUR/CBZ/CBNZ, rn holds the register
+// for BR, and imm holds the immediate, memory offset or branch address.
+
+typedef struct DecodedOp {
+    const void *handler;          // threaded dispatch target inside runDecoded()
+    struct DecodedOp *target;     // pre-resolved branch target, NULL if outside the stream
+    int kind;
+    int rd, rn, rm;
+    int imm;
+    int pc;                       // address of this instruction
+    int length;                   // instructions covered by a fused op
+} DecodedOp;
+
+// TRANSLATED BLOCK OPERATION KINDS, the branches last
+
+enum BlockKind { B_ADD, B_ADDI, B_ADDSP, B_SUB, B_SUBI, B_SUBSP, B_LDUR, B_STUR, B_LSL,
+                 B_CBZ, B_CBNZ, B_BR, B_BL, B_B, B_NEXT, NUMBLOCKKINDS };
+
+// One op of a translated block. d, n and m point straight at the registers the instruction
+// names (d doubles as Rt, n holds BR's register), and imm holds the immediate, memory offset
+// or branch address.
+
+typedef struct {
+    const void *handler;          // threaded dispatch target inside runBlocks()
+    long long *d, *n, *m;
+    int kind;
+    int imm;
+    int pc;
+} BlockOp;
+
+// A basic block: the straight-line run of instructions from start up to and including a
+// branch, translated once. taken and notTaken chain it to the blocks it went to last.
+
+typedef struct Block {
+    long long start;
+    int length;                   // instructions, not counting a closing B_NEXT
+    struct Block *taken, *notTaken;
+    struct Block *hashNext;
+    BlockOp ops[];
+} Block;
+
+typedef struct BlockCache {
+    Block *buckets[BLOCKBUCKETS]; // hashed on the start address
+    int count;
+    int stale;                    // set when a store changes the text segment
+    long long translated, flushes, chained;
+} BlockCache;
+
+// Everything one emulated machine owns, so several can run side by side.
+
+typedef struct Machine {
+    long long registers[REGISTERSPACE];
+    PageTable pages;              // data memory
+    TextInstr *text;              // packed text segment, one entry per WORD from textBase
+    DecodedOp *ops;               // decoded stream, parallel to text, and a halting op past it
+    int textBase, textSlots;
+    void *image;                  // mapped program image holding text, or NULL if text is allocated
+    size_t imageSize;
+    long long stackTop, stackSize;
+    LoadedInstr *loaded;          // program file contents while loading
+    int loadedCount, loadedCapacity;
+    char *name;                   // program file the machine was loaded from
+    struct Profile *profile;      // NULL unless profiling
+    struct Cache *cache;          // NULL unless simulating a data cache
+    struct Pipeline *pipeline;    // NULL unless timing the pipeline
+    struct Predictor *predictor;  // NULL unless simulating branch prediction
+    struct Recorder *recorder;    // NULL unless recording an execution trace
+    int fuse;                     // combine common instruction sequences when decoding
+    long long fusedAway;          // dispatches the fused ops have saved so far
+    long long restoredAt;         // instructions run before the snapshot this was restored from
+    int engine;                   // what runMachine() runs the decoded stream with
+    struct BlockCache *blocks;    // translated blocks, NULL until the block engine first runs
+    const Watchpoint *watches;    // memory the debugger is watching, NULL for none
+    int watchCount;
+    WatchHit watchHit;
+    OutBuf out;
+} Machine;
+
+// One executed instruction as seen by the instrumented step loop.
+
+typedef struct {
+    long long pc, next;           // where it ran and where execution went afterwards
+    int opcode, op1, op2, op3;
+    long long address;            // data address of LDUR/STUR
+} StepEvent;
+
+// Profiling. Call paths form a tree rooted at the program's entry: BL moves down to a child
+// for its target and BR LR moves back up, and each node counts the instructions executed
+// while it was current.
+
+typedef struct {
+    int function;                 // entry address of the function
+    int parent, firstChild, nextSibling;
+    long long self;
+} CallNode;
+
+typedef struct Profile {
+    long long *counts;            // executions per text slot
+    long long *taken, *notTaken;  // CBZ/CBNZ outcomes per text slot
+    long long *calls;             // BL calls per target slot
+    long long total, outside;     // all instructions, and those outside the text segment
+    CallNode *nodes;
+    int nodeCount, nodeCapacity, current;
+} Profile;
+
+// Data cache simulation. Each level is set-associative, holding the line number of every
+// line it caches and when each way was last used. LDUR/STUR traffic goes to the first level,
+// and a line that misses one level is fetched through the next. Stores allocate lines just
+// like loads.
+
+typedef struct {
+    CacheConfig config;
+    int sets, lineBits;
+    unsigned long long *tags;     // sets * assoc line numbers, NOLINE for an empty way
+    unsigned long long *used;     // clock value of each way's last use, for LRU
+    unsigned long long clock, seed;
+    long long hits, misses;
+    long long *slotHits, *slotMisses; // per text slot of the instruction that caused them
+} CacheLevel;
+
+typedef struct Cache {
+    CacheLevel levels[MAXCACHELEVELS];
+    int count;
+} Cache;
+
+#define NOLINE (~0ULL)            // lines are at least WORD bytes, so no line has this number
+
+// Timing model of the classic five-stage pipeline. Instructions are timed by the cycle they
+// enter EX; ready holds, per register, the first EX cycle that can use its newest value.
+
+typedef struct Pipeline {
+    int forwarding;
+    long long nextEx;
+    long long ready[REGISTERSPACE];
+    int fromLoad[REGISTERSPACE];  // the newest value comes from an LDUR
+    long long instructions, loadUse, dataStalls, branchStalls, jumpStalls;
+    long long *slotCount, *slotData, *slotControl;  // per text slot
+} Pipeline;
+
+// Branch prediction. Every enabled scheme sees the same branches side by side: static not
+// taken, a table of 2-bit counters indexed by PC ("2bit"), and 2-bit counters indexed by PC
+// xor the global taken/not-taken history ("gshare"). Returns may also be predicted by a
+// circular return-address stack, shared by all of them.
+
+typedef struct Predictor {
+    int enabled, primary, bits;
+    unsigned char *bimodal, *gshare;
+    unsigned long long history;
+    long long *stack;
+    int depth, top, size;
+    long long branches, conditional, taken, returns, returnsCorrect;
+    long long correct[NUMSCHEMES], conditionalCorrect[NUMSCHEMES];
+    int guessTaken, guessRight;   // the primary scheme's call on the latest branch
+    long long *slotCount, *slotTaken, *slotCorrect;  // per text slot, NUMSCHEMES per slot
+} Predictor;
+
+// Execution trace recording. Each step is encoded into a chunk on the interpreter's thread, and
+// full chunks go through a ring buffer to a writer thread that does all the file I/O. head and
+// tail count every byte ever put into and taken out of the ring.
+
+typedef struct Recorder {
+    FILE *file;
+    pthread_t writer;
+    pthread_mutex_t lock;
+    pthread_cond_t ready, space;  // data for the writer, room for the interpreter
+    unsigned char *ring;
+    size_t head, tail;
+    int closed, failed;
+    unsigned char chunk[RECORDCHUNK];
+    int length;                   // bytes in chunk
+    long long shadow[REGISTERSPACE];  // register values as of the records so far
+    long long lastAddress, lastValue;
+    long long steps, bytes, stalls;   // stalls: times the ring was full
+} Recorder;
+
+// Lane-parallel execution: one program over many sets of starting registers. Lanes run in
+// groups of LANEWIDTH, with registers in structure-of-arrays form so each instruction becomes
+// one loop across the group that the compiler vectorizes. Each lane has its own PC, count,
+// state and data memory; the text segment is shared.
+
+enum LaneState { LANE_RUNNING, LANE_HALTED, LANE_STOPPED, LANE_OVERFLOW, LANE_NOMEMORY, LANE_TEXTSTORE,
+                 LANE_PCOPERAND, NUMLANESTATES };
+
+typedef struct {
+    long long r[REGISTERSPACE][LANEWIDTH];
+    long long pc[LANEWIDTH], count[LANEWIDTH];
+    long long live[LANEWIDTH];    // all ones while the lane is running, else zero
+    int state[LANEWIDTH];
+    PageTable pages[LANEWIDTH];
+} LaneGroup;
+
+typedef struct {
+    long long registers[REGISTERSPACE];   // the PC included
+    long long count;
+    int state;
+} LaneResult;
+
+// Static optimization. Passes work on a copy of the text segment split into basic blocks,
+// marking the instructions they remove as dead, until none of them finds anything more to do.
+// What is known about a register is tracked per block entry: a constant, a return address put
+// there by BL, or nothing. Register sets are masks with one bit per register.
+
+enum ValueKind { VALUE_UNSEEN, VALUE_CONSTANT, VALUE_RETURN, VALUE_VARIES };
+
+#define REGBIT(r) (1u << ((r) & (REGISTERSPACE - 1)))
+#define ALLREGS 0xffffffffu
+#define ENDSBLOCK(t) ((t)->opcode == CBZ || (t)->opcode == CBNZ || (t)->opcode == B || (t)->opcode == BL \
+                   || (t)->opcode == BR || (t)->opcode == 0)
+
+typedef struct {
+    int kind;
+    long long value;              // for VALUE_CONSTANT
+} KnownValue;
+
+typedef struct {
+    int first, last;              // slots of its first and last instruction
+    int succ[2], succCount;
+    int returns;                  // ends in BR LR, so goes on to every return point
+    int exits;                    // may leave the program, with everything it computed observable
+    int reachable;
+    KnownValue in[REGISTERSPACE];
+    unsigned liveIn;
+} OptBlock;
+
+typedef struct {
+    Machine *m;
+    TextInstr *text;              // working copy of the text segment
+    unsigned char *dead;          // per slot: removed
+    int *blockOf;                 // per slot: block holding it, -1 if none
+    OptBlock *blocks;
+    int blockCount, entry;        // entry: the block execution starts in
+    int *returnPoints;            // blocks just after a reachable BL
+    int returnCount;
+    const char *unsafe;           // why the program cannot be optimized, NULL if it can
+    long long folded, reduced, resolved, deadWrites, deadStores, unreachable;
+} Optimizer;
+
+// Assembler. Mnemonics are found with a perfect hash of their length and first and last
+// letters (see MNEMONICHASH), so each is recognised with one table probe and one compare.
+
+enum OperandForm { FORM_RRR, FORM_RRI, FORM_MEM, FORM_RL, FORM_R, FORM_L };
+
+typedef struct {
+    const char *name;
+    int opcode, form;
+} Mnemonic;
+
+#define MNEMONICHASH(s, n) (((n) + ((s)[0] & ~0x20) + 3 * ((s)[(n) - 1] & ~0x20)) & 31)
+
+// Labels and the branches waiting for them point into the program source, which outlives them.
+
+typedef struct {
+    const char *name;             // NULL marks an empty entry
+    int length;
+    unsigned long long hash;
+    int address;                  // -1 until defined
+    int line;
+} Label;
+
+typedef struct {
+    int entry;                    // index of the branch in the machine's loaded instructions
+    const char *name;
+    int length, line;
+} Fixup;
+
+typedef struct {
+    Machine *m;
+    char *file;
+    int line, errors;
+    const char *lineEnd;          // the newline, or end of source, ending the current line
+    int address;                  // where the next instruction goes
+    Label *labels;                // open-addressing table, capacity a power of two
+    int labelCount, labelCapacity;
+    Fixup *fixups;
+    int fixupCount, fixupCapacity;
+} Assembler;
+
+// Batch mode. Each worker owns a deque of task indices: it takes work from the back of its own
+// and, once that is empty, steals from the front of the others'.
+
+typedef struct {
+    int *tasks;
+    int front, back;
+    pthread_mutex_t lock;
+} TaskDeque;
+
+typedef struct {
+    char *path;
+    OutBuf out;                   // everything the program printed, kept until all tasks finish
+    int status;
+    Predictor *predictor;         // kept for the corpus totals, if predicting
+} BatchTask;
+
+typedef struct {
+    BatchTask *tasks;
+    TaskDeque *deques;
+    int workers;
+    const RunOptions *options;
+} BatchPool;
+
+typedef struct {
+    BatchPool *pool;
+    int id;
+} BatchWorker;
+
+// Benchmark mode. Each program runs in a child process, so its peak memory is its own, and
+// sends back what it measured through a pipe.
+
+typedef struct {
+    long long instructions;
+    double seconds;               // the fastest of the repeated runs
+    int status;                   // as runHeadless() returns it
+} BenchResult;
+
 // PROTOTYPES
 
-void parseBuffer(char *string);
-int getOperand(char *string);
-int getInstruct(char *string);
-int executeInstruction(int);
+const Mnemonic *findMnemonic(const char *s, int n);
+void asmError(Assembler *a, const char *format, ...);
+const char *skipBlanks(Assembler *a, const char *p);
+int identLength(Assembler *a, const char *p);
+int tokenLength(Assembler *a, const char *p);
+const char *parseNumber(Assembler *a, const char *p, int hash, long long *value);
+const char *parseRegister(Assembler *a, const char *p, int *reg);
+const char *parseImmediate(Assembler *a, const char *p, int *imm);
+const char *parseComma(Assembler *a, const char *p);
+Label *findLabel(Assembler *a, const char *name, int length);
+const char *parseTarget(Assembler *a, const char *p, int *target);
+void assembleLine(Assembler *a, const char *p);
+int assembleProgram(Machine *m, char *file, const char *source, size_t length);
+void packInstr(TextInstr *t, int opcode, int op1, int op2, int op3);
+void unpackInstr(const TextInstr *t, int *op1, int *op2, int *op3);
+int executeInstruction(Machine *m, long long);
+void outputResult(Machine *m, long long);
 void ungetOperand(int, char*);
-void printMemory(char, int, int);
-void printStack();
-void waitForAdvance();
+void printMemory(Machine *m, char, long long, long long);
+void printStack(Machine *m);
+void printRegisters(Machine *m);
+int waitForAdvance(Machine *m);
+void outPrintf(OutBuf *out, const char *format, ...);
+void outFlush(OutBuf *out);
+int runHeadless(Machine *m, const RunOptions *options);
+unsigned char *findPage(PageTable *table, unsigned long long number);
+unsigned char *addPage(PageTable *table, unsigned long long number);
+void placePage(PageTable *table, unsigned long long number, unsigned char *data);
+void freePages(PageTable *table);
+TextInstr *textAt(Machine *m, long long address);
+long long loadDouble(Machine *m, long long address);
+long long loadData(PageTable *pages, long long address);
+int storeDouble(Machine *m, long long address, long long value);
+int storeData(PageTable *pages, long long address, long long value);
+void watchAccess(Machine *m, long long address, int access, long long old, long long value);
+int validInstr(const TextInstr *t);
+int writeImage(Machine *m, char *path);
+int loadImage(Machine *m, char *file);
+void releaseText(Machine *m);
+int writeSnapshot(Machine *m, char *path, long long executed);
+void putSnapshot(Machine *m, FILE *file, long long executed);
+int loadSnapshot(Machine *m, char *file);
+long long useSnapshot(Machine *m, unsigned char *image, long long size, int trailing, char *file);
+void takeCheckpoint(Machine *m, const RunOptions *options, long long executed);
+void requestCheckpoint(int signal);
+int registerName(const char *p, int *length);
+int parseBreakpoint(char *text, Breakpoint *b);
+int parseWatchpoint(char *text, Watchpoint *w);
+int breakHolds(Machine *m, const Breakpoint *b);
+void describeBreakpoint(const Breakpoint *b, char *text);
+int runToBreak(Machine *m, const RunOptions *options, long long *executed);
+void layoutText(Machine *m);
+void decodeProgram(Machine *m);
+void decodeSlot(Machine *m, DecodedOp *op, int address);
+void fuseSlot(Machine *m, int slot);
+void trapSlot(Machine *m, DecodedOp *op);
+void restoreSlot(Machine *m, DecodedOp *op);
+DecodedOp *pcToOp(Machine *m, long long pc);
+int runDecoded(Machine *m, DecodedOp *op, long long limit, long long *executed);
+Block *findBlock(Machine *m, long long address);
+Block *translateBlock(Machine *m, long long address);
+void flushBlocks(Machine *m);
+int runBlocks(Machine *m, long long limit, long long *executed);
+int stepMachine(Machine *m);
+int runMachine(Machine *m, long long limit, long long *executed);
+int isObserved(Machine *m);
+int stepObserved(Machine *m);
+int runObserved(Machine *m, long long limit, long long *executed);
+void observeStep(Machine *m, StepEvent *event);
+void formatInstr(const TextInstr *t, char *text);
+Profile *newProfile(Machine *m);
+void freeProfile(Profile *profile);
+void profileStep(Machine *m, Profile *profile, StepEvent *event);
+void reportProfile(Machine *m);
+int writeFolded(Machine *m, char *path);
+int parseCacheConfig(char *text, CacheConfig *config);
+Cache *newCache(Machine *m, const RunOptions *options);
+void freeCache(Cache *cache);
+int cacheLookup(CacheLevel *level, unsigned long long line);
+void cacheTouch(Cache *cache, int level, unsigned long long address, int length, long long slot);
+void cacheStep(Machine *m, Cache *cache, StepEvent *event);
+void reportCache(Machine *m);
+Pipeline *newPipeline(Machine *m, int forwarding);
+void freePipeline(Pipeline *pipe);
+int pipelineOperands(StepEvent *event, int *sources, int *late, int *dest);
+void pipelineStep(Machine *m, Pipeline *pipe, StepEvent *event);
+void reportPipeline(Machine *m);
+int parsePredictors(char *text, RunOptions *options);
+Predictor *newPredictor(Machine *m, const RunOptions *options);
+void freePredictor(Predictor *p);
+void trainCounter(unsigned char *counter, int taken);
+void predictStep(Machine *m, Predictor *p, StepEvent *event);
+void reportPredictor(Machine *m);
+Recorder *newRecorder(Machine *m, char *path);
+void *recordWriter(void *arg);
+void flushChunk(Recorder *r);
+void putDelta(Recorder *r, long long value);
+long long getDelta(const unsigned char **p, const unsigned char *end);
+int traceOpcode(int opcode);
+void recordStep(Machine *m, Recorder *r, StepEvent *event);
+int closeRecorder(Recorder *r, int exec);
+int replayTrace(Machine *m, char *file, const RunOptions *options);
+void reportEnd(Machine *m, int trace, int exec, long long executed);
+int parseLanes(Machine *m, char *path, long long (**inputs)[REGISTERSPACE]);
+int plainKind(int kind);
+void runLaneGroup(Machine *m, LaneGroup *g, long long limit);
+int runLanes(Machine *m, const RunOptions *options, int compareRuns);
+int optNext(Optimizer *o, int slot);
+int optTarget(Optimizer *o, long long address);
+unsigned optUses(const TextInstr *t);
+int optDefines(const TextInstr *t);
+const char *optCheck(Optimizer *o);
+void optBlocks(Optimizer *o);
+void optValues(const TextInstr *t, KnownValue *v);
+void optConstants(Optimizer *o);
+void optRewrite(Optimizer *o, OptBlock *b);
+void optJumps(Optimizer *o);
+void optLiveness(Optimizer *o);
+void optDeadStores(Optimizer *o, OptBlock *b);
+unsigned optLiveOut(Optimizer *o, OptBlock *b);
+long long movedAddress(Machine *a, long long address, long long *newAddress);
+int sameAfterOptimizing(Machine *a, Machine *b, long long *newAddress);
+int optimizeProgram(Machine *m, char *outPath, const RunOptions *options);
+void copyPages(PageTable *to, PageTable *from);
+void copyMachine(Machine *to, Machine *from);
+int sameState(Machine *a, Machine *b);
+int compareEngines(Machine *m, int runs);
+Machine *newMachine(const RunOptions *options);
+int loadProgram(Machine *m, char *file);
+void freeMachine(Machine *m);
+int collectPrograms(char *path, char ***files, int *count);
+int takeTask(BatchPool *pool, int id);
+void *batchWorker(void *arg);
+int runBatch(char **paths, int count, int jobs, const RunOptions *options);
+void reportCorpusPrediction(BatchTask *tasks, int count);
+void benchProgram(char *path, int repeats, const RunOptions *options, BenchResult *result);
+int runBench(char **paths, int count, int repeats, const RunOptions *options);
 
 // GLOBAL VARIABLES
 
-int memory[MEMSIZE][WORD];
-int registers[REGISTERSPACE];  
-const int maxStack = STACKUPPERBOUND - STACKSIZE;
 const char OVERFLOW_MSG[] = "WARNING: STACK OVER FLOW. Your program will now crash. Thank you.\n";
+const char MEMORY_MSG[] = "WARNING: OUT OF GUEST MEMORY. Your program will now crash.\n";
+
+const void **dispatchTable;               // handler labels exported by runDecoded()
+const void **blockTable;                  // and by runBlocks()
+
+volatile sig_atomic_t checkpointRequested;  // set by SIGUSR1
+
+const char *SCHEME_NAMES[NUMSCHEMES] = { "nottaken", "2bit", "gshare" };
+
+const int TRACEOPCODES[TAGEND] = { 0, ADD, ADDI, SUB, SUBI, LDUR, STUR, LSL, CBZ, CBNZ, BR, BL, B };
+
+const Mnemonic MNEMONICS[32] = {          // indexed by MNEMONICHASH
+    [16] = { "ADD", ADD, FORM_RRR },   [0] = { "ADDI", ADDI, FORM_RRI },  [28] = { "SUB", SUB, FORM_RRR },
+    [18] = { "SUBI", SUBI, FORM_RRI }, [6] = { "LDUR", LDUR, FORM_MEM },  [13] = { "STUR", STUR, FORM_MEM },
+    [19] = { "LSL", LSL, FORM_RRI },   [20] = { "CBZ", CBZ, FORM_RL },    [21] = { "CBNZ", CBNZ, FORM_RL },
+    [26] = { "BR", BR, FORM_R },       [8] = { "BL", BL, FORM_L },        [9] = { "B", B, FORM_L }
+};
 
 // FUNCTIONS 
 
-// Accepts a String buffer and index to write to in the Text Segment, writes the given
-// instruction into the Text Segment as integer psuedo-machine code.
+// Looks up a mnemonic of n characters, in any case. Returns its entry, or NULL if it is not
+// an instruction this emulator knows.
 
-void parseBuffer(char *buffer){
+const Mnemonic *findMnemonic(const char *s, int n) {
+    if(n == 0) {
+        return NULL;
+    }
 
-    char inst[5][10];
-    int machineCode, i = 0;
-    int segments = 4; // decrements based on instruction type
-    
-    // split the buffer into substrings delimited by spaces
-    sscanf(buffer,"%s %s %s %s %s", inst[0], inst[1], inst[2], inst[3], inst[4]);
-
-    int index = atoi(inst[i]);
-
-    i++;
-    for(int wipe = 0; wipe < 4; wipe++) {
-        memory[index][wipe] = 0;            // clears the previous contents of the instruction
-    }                                      // at this memory location 
-
-    // convert substring to integers to store in memory
-    while(i < 5 && segments) {
-
-        if(i == 1) {
-            machineCode = getInstruct(inst[i]);
-            if(machineCode == CBZ || machineCode == CBNZ) {
-                segments--;  // only accepts 2 operands
-            } else if (machineCode == B || machineCode == BR || machineCode == BL) {
-                segments-=2; // only accepts 1 operand
-            }
-
-        } else { 
-            machineCode = getOperand(inst[i]);    
-        }
-
-        // write to memory
-        memory[index][i-1] = machineCode;
-        i++;
-        segments--;
-    }
-}
-
-// Converts the given instruction String into an integer to be held in the memory array
-
-int getInstruct(char *instruction) {
-
-        if((strcmp(instruction, "ADD") == 0)) {
-            return ADD;
-        } else if(strcmp(instruction, "ADDI") == 0) {
-            return ADDI;
-        } else if(strcmp(instruction, "SUB") == 0) {
-            return SUB;
-        } else if(strcmp(instruction, "SUBI") == 0) {
-            return SUBI;
-        } else if(strcmp(instruction, "LDUR") == 0) {
-            return LDUR;
-        } else if(strcmp(instruction, "STUR") == 0) {
-            return STUR;
-        } else if(strcmp(instruction, "LSL") == 0) {
-            return LSL;
-        } else if(strcmp(instruction, "CBZ") == 0) {
-            return CBZ;
-        } else if(strcmp(instruction, "CBNZ") == 0) {
-            return CBNZ;
-        } else if(strcmp(instruction, "BR") == 0) {
-            return BR;
-        } else if(strcmp(instruction, "B") == 0) {
-            return B;
-        } else if(strcmp(instruction, "BL") == 0) {
-            return BL; 
+    const Mnemonic *entry = &MNEMONICS[MNEMONICHASH(s, n)];
+    if(entry->name == NULL || strlen(entry->name) != (size_t) n) {
+        return NULL;
+    }
+    for(int i = 0; i < n; i++) {
+        if((s[i] & ~0x20) != entry->name[i]) {             // mnemonics are all letters
+            return NULL;
+        }
+    }
+    return entry;
+}
+
+// Reports an error against the line being assembled.
+
+void asmError(Assembler *a, const char *format, ...) {
+    va_list args;
+    char message[LINESIZE];
+
+    if(++a->errors > MAXASMERRORS) {
+        return;
+    }
+    va_start(args, format);
+    vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+    outPrintf(&a->m->out, "%s:%i: error: %s\n", a->file, a->line, message);
+}
+
+// Skips blanks, and stops at the end of the line or at a comment ("//" or ";").
+
+const char *skipBlanks(Assembler *a, const char *p) {
+    while(p < a->lineEnd && (*p == ' ' || *p == '\t' || *p == '\r')) {
+        p++;
+    }
+    if(p < a->lineEnd && (*p == ';' || (*p == '/' && p + 1 < a->lineEnd && p[1] == '/'))) {
+        p = a->lineEnd;
+    }
+    return p;
+}
+
+// Returns the length of the identifier at p, 0 if there is none.
+
+int identLength(Assembler *a, const char *p) {
+    const char *start = p;
+
+    if(p < a->lineEnd && (isalpha((unsigned char) *p) || *p == '_' || *p == '.')) {
+        while(p < a->lineEnd && (isalnum((unsigned char) *p) || *p == '_' || *p == '.')) {
+            p++;
+        }
+    }
+    return p - start;
+}
+
+// Length of the token at p for error messages: everything up to the next blank or comma.
+
+int tokenLength(Assembler *a, const char *p) {
+    const char *start = p;
+
+    while(p < a->lineEnd && *p != ' ' && *p != '\t' && *p != '\r' && *p != ',') {
+        p++;
+    }
+    return (p == start && p < a->lineEnd) ? 1 : p - start;
+}
+
+// Reads a decimal or 0x hex number that fits an int, with an optional '#' and sign. Returns
+// the position after it, or NULL if there is no number there. Hand-rolled, since strtoll()
+// was most of the time spent assembling.
+
+const char *parseNumber(Assembler *a, const char *p, int hash, long long *value) {
+    int negative = 0, base = 10;
+    long long number = 0;
+
+    if(hash && p < a->lineEnd && *p == '#') {
+        p++;
+    }
+    if(p < a->lineEnd && (*p == '-' || *p == '+')) {
+        negative = (*p++ == '-');
+    }
+    if(p + 1 < a->lineEnd && p[0] == '0' && (p[1] | 0x20) == 'x') {
+        base = 16;
+        p += 2;
+    }
+
+    const char *start = p;
+    for(; p < a->lineEnd; p++) {
+        int digit = (*p >= '0' && *p <= '9') ? *p - '0'
+                  : (base == 16 && (*p | 0x20) >= 'a' && (*p | 0x20) <= 'f') ? (*p | 0x20) - 'a' + 10 : -1;
+        if(digit < 0) {
+            break;
+        }
+        number = number * base + digit;
+        if(number > (long long) INT_MAX + 1) {
+            return NULL;
+        }
+    }
+    if(p == start || (p < a->lineEnd && (isalnum((unsigned char) *p) || *p == '_'))) {
+        return NULL;
+    }
+    *value = negative ? -number : number;
+    return (*value > INT_MAX) ? NULL : p;
+}
+
+// Reads a register: X0 to X31, XZR, SP or LR in any case. Returns the position after it, or
+// NULL after reporting an error.
+
+const char *parseRegister(Assembler *a, const char *p, int *reg) {
+    int n = identLength(a, p);
+    char first = (n > 0) ? (p[0] & ~0x20) : 0, second = (n > 1) ? (p[1] & ~0x20) : 0;
+
+    if(n == 3 && first == 'X' && second == 'Z' && (p[2] & ~0x20) == 'R') {
+        *reg = XZR;
+    } else if(n == 2 && first == 'S' && second == 'P') {
+        *reg = SP;
+    } else if(n == 2 && first == 'L' && second == 'R') {
+        *reg = LR;
+    } else if(first == 'X' && (n == 2 || n == 3) && isdigit((unsigned char) p[1])
+              && (n == 2 || isdigit((unsigned char) p[2]))
+              && (*reg = (n == 2) ? p[1] - '0' : (p[1] - '0') * 10 + p[2] - '0') < REGISTERSPACE) {
+        // Xn
+    } else {
+        asmError(a, "expected a register, found '%.*s'", tokenLength(a, p), p);
+        return NULL;
+    }
+    return p + n;
+}
+
+// Reads an immediate such as #16. Returns the position after it, or NULL after reporting an error.
+
+const char *parseImmediate(Assembler *a, const char *p, int *imm) {
+    long long value;
+    const char *end = parseNumber(a, p, 1, &value);
+
+    if(end == NULL) {
+        asmError(a, "expected an immediate, found '%.*s'", tokenLength(a, p), p);
+        return NULL;
+    }
+    *imm = value;
+    return end;
+}
+
+// Expects a comma between operands. Returns the position after it, or NULL after reporting an error.
+
+const char *parseComma(Assembler *a, const char *p) {
+    p = skipBlanks(a, p);
+    if(p >= a->lineEnd || *p != ',') {
+        asmError(a, (p >= a->lineEnd) ? "missing operand" : "expected ',' before '%.*s'", tokenLength(a, p), p);
+        return NULL;
+    }
+    return skipBlanks(a, p + 1);
+}
+
+// Finds a label by name, adding an undefined one (address -1) if it is not there yet.
+
+Label *findLabel(Assembler *a, const char *name, int length) {
+    unsigned long long hash = 14695981039346656037ULL;       // FNV-1a
+
+    for(int i = 0; i < length; i++) {
+        hash = (hash ^ (unsigned char) name[i]) * 1099511628211ULL;
+    }
+    if(2 * (a->labelCount + 1) > a->labelCapacity) {         // keep the table at most half full
+        Label *old = a->labels;
+        int capacity = a->labelCapacity;
+        a->labelCapacity = capacity ? 2 * capacity : 256;
+        a->labels = calloc(a->labelCapacity, sizeof(Label));
+        for(int i = 0; i < capacity; i++) {
+            if(old[i].name != NULL) {
+                int j = old[i].hash & (a->labelCapacity - 1);
+                while(a->labels[j].name != NULL) {
+                    j = (j + 1) & (a->labelCapacity - 1);
+                }
+                a->labels[j] = old[i];
+            }
+        }
+        free(old);
+    }
+    for(int i = hash & (a->labelCapacity - 1); ; i = (i + 1) & (a->labelCapacity - 1)) {
+        Label *label = &a->labels[i];
+        if(label->name == NULL) {
+            label->name = name;
+            label->length = length;
+            label->hash = hash;
+            label->address = -1;
+            a->labelCount++;
+            return label;
+        }
+        if(label->hash == hash && label->length == length && memcmp(label->name, name, length) == 0) {
+            return label;
+        }
+    }
+}
+
+// Reads a branch target, either an address or a label. A label that is not defined yet leaves
+// a fixup for the instruction about to be added. Returns the position after it, or NULL after
+// reporting an error.
+
+const char *parseTarget(Assembler *a, const char *p, int *target) {
+    long long value;
+    const char *end = parseNumber(a, p, 0, &value);
+    int n = identLength(a, p);
+
+    if(end != NULL) {
+        *target = value;
+        return end;
+    }
+    if(n == 0) {
+        asmError(a, "expected an address or label, found '%.*s'", tokenLength(a, p), p);
+        return NULL;
+    }
+
+    Label *label = findLabel(a, p, n);
+    *target = label->address;
+    if(label->address < 0) {
+        if(a->fixupCount == a->fixupCapacity) {
+            a->fixupCapacity = a->fixupCapacity ? 2 * a->fixupCapacity : 256;
+            a->fixups = realloc(a->fixups, a->fixupCapacity * sizeof(Fixup));
+        }
+        Fixup *fixup = &a->fixups[a->fixupCount++];
+        fixup->entry = a->m->loadedCount;
+        fixup->name = p;
+        fixup->length = n;
+        fixup->line = a->line;
+    }
+    return p + n;
+}
+
+// Assembles one source line: an optional address, any number of "label:" definitions and an
+// optional instruction. Lines without an address go to the word after the previous instruction.
+
+void assembleLine(Assembler *a, const char *p) {
+    long long value;
+    int op[3] = { 0, 0, 0 };
+
+    p = skipBlanks(a, p);
+    if(p < a->lineEnd && isdigit((unsigned char) *p)) {
+        const char *end = parseNumber(a, p, 0, &value);
+        if(end == NULL || value < 0 || value > INT_MAX - 2 * WORD) {
+            asmError(a, "address '%.*s' is outside of the text segment", tokenLength(a, p), p);
+            return;
+        }
+        if((value - STARTMEM) % WORD != 0) {
+            asmError(a, "address %lli is off the %i-byte instruction grid", value, WORD);
+            return;
+        }
+        a->address = value;
+        p = skipBlanks(a, end);
+    }
+
+    int n = identLength(a, p);
+    while(n > 0 && skipBlanks(a, p + n) < a->lineEnd && *skipBlanks(a, p + n) == ':') {
+        Label *label = findLabel(a, p, n);
+        if(label->address >= 0) {
+            asmError(a, "label '%.*s' is already defined on line %i", n, p, label->line);
+        } else {
+            label->address = a->address;
+            label->line = a->line;
+        }
+        p = skipBlanks(a, skipBlanks(a, p + n) + 1);
+        n = identLength(a, p);
+    }
+    if(p >= a->lineEnd) {
+        return;
+    }
+
+    const Mnemonic *mnemonic = findMnemonic(p, n);
+    if(mnemonic == NULL) {
+        asmError(a, "unknown instruction '%.*s'", tokenLength(a, p), p);
+        return;
+    }
+    p = skipBlanks(a, p + n);
+
+    switch(mnemonic->form) {
+        case FORM_RRR :
+            if((p = parseRegister(a, p, &op[0])) && (p = parseComma(a, p)) && (p = parseRegister(a, p, &op[1]))
+               && (p = parseComma(a, p))) {
+                p = parseRegister(a, p, &op[2]);
+            }
+            break;
+        case FORM_RRI :
+            if((p = parseRegister(a, p, &op[0])) && (p = parseComma(a, p)) && (p = parseRegister(a, p, &op[1]))
+               && (p = parseComma(a, p))) {
+                p = parseImmediate(a, p, &op[2]);
+            }
+            break;
+        case FORM_MEM :                             // Rt, [Rn, #offset] or Rt, [Rn]
+            if((p = parseRegister(a, p, &op[0])) && (p = parseComma(a, p))) {
+                if(*p != '[') {
+                    asmError(a, "expected '[', found '%.*s'", tokenLength(a, p), p);
+                    return;
+                }
+                if((p = parseRegister(a, skipBlanks(a, p + 1), &op[1])) != NULL) {
+                    p = skipBlanks(a, p);
+                    if(p < a->lineEnd && *p == ',') {
+                        p = parseImmediate(a, skipBlanks(a, p + 1), &op[2]);
+                    }
+                    if(p != NULL && (p = skipBlanks(a, p)) < a->lineEnd && *p == ']') {
+                        p++;
+                    } else if(p != NULL) {
+                        asmError(a, "expected ']'");
+                        return;
+                    }
+                }
+            }
+            break;
+        case FORM_RL :
+            if((p = parseRegister(a, p, &op[0])) && (p = parseComma(a, p))) {
+                p = parseTarget(a, p, &op[1]);
+            }
+            break;
+        case FORM_R :
+            p = parseRegister(a, p, &op[0]);
+            break;
+        case FORM_L :
+            p = parseTarget(a, p, &op[0]);
+            break;
+    }
+    if(p == NULL) {
+        if(a->fixupCount > 0 && a->fixups[a->fixupCount - 1].entry == a->m->loadedCount) {
+            a->fixupCount--;                        // the instruction is not being added
+        }
+        return;
+    }
+    if((p = skipBlanks(a, p)) < a->lineEnd) {
+        asmError(a, "unexpected '%.*s' after the operands", tokenLength(a, p), p);
+        return;
+    }
+
+    // later lines for the same address replace earlier ones when the text is laid out
+    Machine *m = a->m;
+    if(m->loadedCount == m->loadedCapacity) {
+        m->loadedCapacity = m->loadedCapacity ? 2 * m->loadedCapacity : 1024;
+        m->loaded = realloc(m->loaded, m->loadedCapacity * sizeof(LoadedInstr));
+    }
+    LoadedInstr *entry = &m->loaded[m->loadedCount++];
+    entry->address = a->address;
+    packInstr(&entry->instr, mnemonic->opcode, op[0], op[1], op[2]);
+    a->address += WORD;
+}
+
+// Assembles a whole program source in one pass, then fills in the branches to labels that
+// were defined after them. Errors are reported with their line numbers; returns -1 if there
+// were any.
+
+int assembleProgram(Machine *m, char *file, const char *source, size_t length) {
+    Assembler a;
+    const char *end = source + length;
+
+    memset(&a, 0, sizeof(Assembler));
+    a.m = m;
+    a.file = file;
+    a.address = STARTMEM;
+
+    for(const char *p = source; p < end; p = a.lineEnd + 1) {
+        a.lineEnd = memchr(p, '\n', end - p);
+        if(a.lineEnd == NULL) {
+            a.lineEnd = end;
+        }
+        a.line++;
+        assembleLine(&a, p);
+    }
+
+    for(int i = 0; i < a.fixupCount; i++) {
+        Fixup *fixup = &a.fixups[i];
+        Label *label = findLabel(&a, fixup->name, fixup->length);
+        if(label->address < 0) {
+            a.line = fixup->line;
+            asmError(&a, "undefined label '%.*s'", fixup->length, fixup->name);
         } else {
-            return atoi(instruction);
+            m->loaded[fixup->entry].instr.imm = label->address;   // where CBZ, CBNZ, B and BL keep it
         }
+    }
+    if(a.errors > MAXASMERRORS) {
+        outPrintf(&m->out, "%s: %i errors in all.\n", file, a.errors);
+    }
+
+    free(a.labels);
+    free(a.fixups);
+    return a.errors ? -1 : 0;
+}
+
+// Packs an instruction's opcode label and operands into a text segment entry. Which operands
+// are registers depends on the instruction format; a register outside X0-XZR does not survive
+// packing, which lets the caller detect it by unpacking again.
+
+void packInstr(TextInstr *t, int opcode, int op1, int op2, int op3) {
+    memset(t, 0, sizeof(TextInstr));
+    t->opcode = (opcode == ADD || opcode == ADDI || opcode == SUB || opcode == SUBI || opcode == LDUR
+              || opcode == STUR || opcode == LSL || opcode == CBZ || opcode == CBNZ || opcode == BR
+              || opcode == BL || opcode == B) ? opcode : 0;
+    int reg1 = (op1 >= 0 && op1 < REGISTERSPACE) ? op1 : REGISTERSPACE;
+    int reg2 = (op2 >= 0 && op2 < REGISTERSPACE) ? op2 : REGISTERSPACE;
+
+    switch(t->opcode) {
+        case CBZ :
+        case CBNZ : t->rd = reg1; t->imm = op2; break;
+        case BR :   t->rd = reg1; break;
+        case BL :
+        case B :    t->imm = op1; break;
+        case 0 :    break;
+        default :   t->rd = reg1; t->rn = reg2; t->imm = op3; break;
+    }
+    if(t->opcode == ADD || t->opcode == SUB) {
+        t->imm = (op3 >= 0 && op3 < REGISTERSPACE) ? op3 : REGISTERSPACE;
+    }
+}
+
+// Recovers the three operands of a text segment entry, in the order they were written.
+
+void unpackInstr(const TextInstr *t, int *op1, int *op2, int *op3) {
+    *op1 = *op2 = *op3 = 0;
+
+    switch(t->opcode) {
+        case CBZ :
+        case CBNZ : *op1 = t->rd; *op2 = t->imm; break;
+        case BR :   *op1 = t->rd; break;
+        case BL :
+        case B :    *op1 = t->imm; break;
+        case 0 :    break;
+        default :   *op1 = t->rd; *op2 = t->rn; *op3 = t->imm; break;
+    }
 }
 
 // Executes the correct operation based on the given instruction.
 
-int executeInstruction(int instr) {
-    int op1 = memory[instr][1];
-    int op2 = memory[instr][2];      // variables for readability
-    int op3 = memory[instr][3];
+int executeInstruction(Machine *m, long long instr) {
+    TextInstr *t = textAt(m, instr);
+    int op1, op2, op3;
+
+    if(t == NULL) {
+        return 0;
+    }
+    unpackInstr(t, &op1, &op2, &op3);      // variables for readability
 
-    switch(memory[instr][0]) {
+    switch(t->opcode) {
         case ADD : 
-            registers[op1] = registers[op2] + registers[op3];
+            m->registers[op1] = ADDWRAP(m->registers[op2], m->registers[op3]);
             break;
         case ADDI :      
-            registers[op1] = registers[op2] + op3;
+            m->registers[op1] = ADDWRAP(m->registers[op2], op3);
             if(op2 == SP) {
-                if(registers[op1] > (STACKUPPERBOUND)) {
-                    printf("%s\n", OVERFLOW_MSG);             // check for overflow beyond upper bounds of memory when popping
+                if(m->registers[op1] > m->stackTop) {
+                    outPrintf(&m->out, "%s\n", OVERFLOW_MSG);             // check for overflow beyond upper bounds of memory when popping
                     return -1;                                // from the stack and increasing the SP
                 }
             } 
             break;
         case SUB : 
-            registers[op1] = registers[op2] - registers[op3];
+            m->registers[op1] = SUBWRAP(m->registers[op2], m->registers[op3]);
             break;
         case SUBI : 
-            registers[op1] = registers[op2] - op3;
+            m->registers[op1] = SUBWRAP(m->registers[op2], op3);
             if(op2 == SP) {
-                if(registers[op1] < maxStack) {
-                    printf("%s\n", OVERFLOW_MSG);              // check for overflow beyond lower bounds when pushing to stack
+                if(m->registers[op1] < m->stackTop - m->stackSize) {
+                    outPrintf(&m->out, "%s\n", OVERFLOW_MSG);              // check for overflow beyond lower bounds when pushing to stack
                     return -1;
                 }
             } 
             break;
         case LDUR : 
-            registers[op1] = memory[registers[op2] + op3][0];
+            m->registers[op1] = loadDouble(m, ADDWRAP(m->registers[op2], op3));
             break;
         case STUR : 
-            memory[registers[op2] + op3][0] = registers[op1];
+            if(storeDouble(m, ADDWRAP(m->registers[op2], op3), m->registers[op1]) < 0) {
+                outPrintf(&m->out, "%s\n", MEMORY_MSG);
+                return -1;
+            }
             break;
         case LSL :
-            registers[op1] = registers[op2] << op3;
+            m->registers[op1] = SHLWRAP(m->registers[op2], op3);
             break;
         case CBZ : 
-            registers[PC] = (registers[op1] - registers[XZR] == 0) ? op2 : (registers[PC] + WORD);
+            m->registers[PC] = (m->registers[op1] - m->registers[XZR] == 0) ? op2 : (m->registers[PC] + WORD);
             return 1;
         case CBNZ : 
-            registers[PC] = (registers[op1] - registers[XZR] != 0) ? op2 : (registers[PC] + WORD);
+            m->registers[PC] = (m->registers[op1] - m->registers[XZR] != 0) ? op2 : (m->registers[PC] + WORD);
             return 1;
         case BR : 
             if(op1 == XZR) {
                 return 0;
             } else {
-                registers[PC] = registers[op1];
+                m->registers[PC] = m->registers[op1];
                 return 1;
             }
         case BL : 
-            registers[LR] = registers[PC] + WORD; 
-            registers[PC] = op1;
+            m->registers[LR] = m->registers[PC] + WORD; 
+            m->registers[PC] = op1;
             return 1;
         case B : 
-            registers[PC] = op1;
+            m->registers[PC] = op1;
             return 1;
         default:
             return 0;
     }
-    registers[PC] = registers[PC] + WORD; // incremements PC for non branch operations
+    m->registers[PC] = m->registers[PC] + WORD; // incremements PC for non branch operations
     return 1;
 }
 
-// Formats output based on given instruction
-
-void outputResult(int inst) {
+// Returns the page holding the given page number, or NULL if it was never stored to.
 
-    int opcode = memory[inst][0], op1 = memory[inst][1], op2 = memory[inst][2], op3 = memory[inst][3];
-    char opStr1[32], opStr2[32], opStr3[32];
-    ungetOperand(op1, opStr1); 
-    ungetOperand(op2, opStr2);                          // Variables for readability
-    ungetOperand(op3, opStr3);                          // "op" for operand
+unsigned char *findPage(PageTable *table, unsigned long long number) {
+    if(number == table->lastNumber) {
+        return table->lastData;
+    }
+    if(table->capacity == 0) {
+        return NULL;
+    }
+    unsigned mask = table->capacity - 1;
+    unsigned slot = (unsigned) ((number * 0x9E3779B97F4A7C15ULL) >> 40) & mask;
 
-    if(memory[inst][0] == ADD) {
-        printf("PC = %i, Instruction: ADD ", inst); 
-        printf("%s, %s, %s\n", opStr1, opStr2, opStr3);
-        printf("Registers: %s: %i | %s: %i | %s: %i\n", opStr1, registers[op1], opStr2, registers[op2], opStr3, registers[op3]);
-    } else if(memory[inst][0] == ADDI) {
-        printf("PC = %i, Instruction: ADDI ", inst); 
-        printf("%s, %s, #%i\n", opStr1, opStr2, op3);
-        printf("Registers: %s: %i | %s: %i | immediate: #%i\n", opStr1, registers[op1], opStr2, registers[op2], op3);
-    } else if(memory[inst][0] == SUB) {
-        printf("PC = %i, Instruction: SUB ", inst); 
-        printf("%s, %s, %s\n", opStr1, opStr2, opStr3);
-        printf("Registers: %s: %i | %s: %i | %s: %i\n", opStr1, registers[op1], opStr2, registers[op2], opStr3, registers[op3]);
-    } else if(memory[inst][0] == SUBI) {
-        printf("PC = %i, Instruction: SUBI ", inst); 
-        printf("%s, %s, #%i\n", opStr1, opStr2, op3);
-        printf("Registers: %s: %i | %s: %i | immediate: #%i\n", opStr1, registers[op1], opStr2, registers[op2], op3);
-    } else if(memory[inst][0] == LDUR) {
-        printf("PC = %i, Instruction: LDUR ", inst); 
-        printf("%s, [%s, #%i]\n", opStr1, opStr2, op3);
-        if(op2 == SP) {
-            int differenceForPrintingStack = STACKUPPERBOUND - STACKSIZE;
-            printf("Popped %i from stack memory address %x into register %s\n", registers[op1], 
-            (registers[op2] + op3) - differenceForPrintingStack, opStr1);
-        } else {
-            printf("Register %s now contains %i from memory address %x\n", opStr1, registers[op1], registers[op2]);
-        }
-    } else if(memory[inst][0] == STUR) {
-        printf("PC = %i, Instruction: STUR ", inst); 
-        printf("%s, [%s, #%i]\n", opStr1, opStr2, op3);
-        if(op2 == SP) {
-            int differenceForPrintingStack = STACKUPPERBOUND - STACKSIZE;
-            printf("Pushed %i to the stack at memory address %x\n", registers[op1], 
-            (registers[op2] + op3) - differenceForPrintingStack);
-        } else {
-            printf("Memory address %x now contains %i\n", registers[op2] + op3, registers[op1]);
-        }
-    } else if(memory[inst][0] == LSL) {
-        printf("PC = %i, Instruction: LSL ", inst); 
-        printf("%s, %s, #%i\n", opStr1, opStr2, op3);
-        printf("Registers: %s: %i | %s: %i | %s: %i\n", opStr1, registers[op1], opStr2, registers[op2], opStr3, registers[op3]);
-    } else if(memory[inst][0] == CBZ) {
-        printf("PC = %i, Instruction: CBZ X%i, %i\n", inst, op1, op2); 
-        printf("Conditional branch on zero for register %s, containing %i\n", 
-            opStr1, registers[op1]);
-        printf(">>\tPC is now %i \n", registers[PC]);
-    } else if(memory[inst][0]== CBNZ) {
-        printf("PC = %i, Instruction: CBNZ X%i, %i\n", inst, op1, op2); 
-        printf("Conditional branch on not zero for register %s, containing %i\n", 
-            opStr1, registers[op1]);
-        printf(">> \tPC is now %i \n", registers[PC]);
-    } else if(memory[inst][0] == BR) {
-        printf("PC = %i, Instruction: BR %s\n", inst, opStr1); 
-        printf("Branching to instruction %i from register %s\n", registers[op1],  opStr1);
-        printf(">>\tPC is now %i \n", registers[PC]);
-    } else if(memory[inst][0] == BL) {
-        printf("PC = %i, Instruction: BL %i\n", inst, op1); 
-        printf("Branching to function at %i. Storing Instruction at %i in LR.\n", op1, inst+WORD);
-        printf(">>\tPC is now %i. LR is %i \n", registers[PC], registers[LR]);
-    }else if(memory[inst][0] == B) {
-        printf("PC = %i, Instruction: B %i ", inst, op1); 
-        printf("Branching to instruction %i\n", op1);
-        printf(">>\tPC is now %i \n", registers[PC]);
-    }
-
-    printStack();
-    printf("\n");
-}
-
-// Extracts the register/immediate number as an integer from the given String
-
-int getOperand(char *operandStr) {
-
-    // shifts index for STUR/LDUR commands where operand 2 starts with "[".
-    int bracket = (operandStr[0] != '[') ? 0 : 1;
-    if(operandStr[1 + bracket] == 'Z') { // check if XZR
-        return XZR;
-    } else if(operandStr[0 + bracket] == 'S') {
-        return SP;
-    } else if(operandStr[0 + bracket] == 'L') {
-        return LR;
-    }
-
-    int i = 0, j = 0;
-    char temp[32];
-
-    while(operandStr[i] != ',' && operandStr[i] != '\0' ) {  
-        
-        if(operandStr[i] != 'X' && operandStr[i] != '#' 
-        && operandStr[i] != '[' && operandStr[i] != ']') { 
-            
-            temp[j] = operandStr[i];
-            j++;
+    while(table->entries[slot].data != NULL) {
+        if(table->entries[slot].number == number) {
+            table->lastNumber = number;
+            table->lastData = table->entries[slot].data;
+            return table->lastData;
         }
-        i++;
+        slot = (slot + 1) & mask;
     }
-    temp[j] = '\0';
+    return NULL;
+}
 
-    return atoi(temp);
+// Returns the page for the given page number, allocating a zeroed one if needed. Returns
+// NULL once the machine already holds MAXPAGES pages.
+
+unsigned char *addPage(PageTable *table, unsigned long long number) {
+    unsigned char *page = findPage(table, number);
+
+    if(page != NULL) {
+        return page;
+    }
+    if(table->count >= MAXPAGES) {
+        return NULL;
+    }
+    page = calloc(1, PAGESIZE);
+    placePage(table, number, page);
+    return page;
 }
 
-// Converts the given register back into a String and stores it in the String passed to it
+// Adds the given page of data to the table under number, which must not be there already.
 
-void ungetOperand(int reg, char * registerStr) {
-    
-    if(reg == XZR) {
+void placePage(PageTable *table, unsigned long long number, unsigned char *data) {
+    if((table->count + 1) * 2 > table->capacity) {       // keep the table at most half full
+        PageTable grown = { calloc(table->capacity ? table->capacity * 2 : 16, sizeof(PageEntry)),
+                            table->capacity ? table->capacity * 2 : 16, 0, table->lastNumber, table->lastData,
+                            table->mapped, table->mappedSize };
+        for(int i = 0; i < table->capacity; i++) {
+            if(table->entries[i].data != NULL) {
+                unsigned slot = (unsigned) ((table->entries[i].number * 0x9E3779B97F4A7C15ULL) >> 40) & (grown.capacity - 1);
+                while(grown.entries[slot].data != NULL) {
+                    slot = (slot + 1) & (grown.capacity - 1);
+                }
+                grown.entries[slot] = table->entries[i];
+                grown.count++;
+            }
+        }
+        free(table->entries);
+        *table = grown;
+    }
+    unsigned mask = table->capacity - 1;
+    unsigned slot = (unsigned) ((number * 0x9E3779B97F4A7C15ULL) >> 40) & mask;
+    while(table->entries[slot].data != NULL) {
+        slot = (slot + 1) & mask;
+    }
+    table->entries[slot].number = number;
+    table->entries[slot].data = data;
+    table->count++;
+    table->lastNumber = number;
+    table->lastData = data;
+}
+
+// Releases every page of a machine's data memory. Pages inside a mapped snapshot go when the
+// snapshot is unmapped.
+
+void freePages(PageTable *table) {
+    for(int i = 0; i < table->capacity; i++) {
+        if((uintptr_t) table->entries[i].data - (uintptr_t) table->mapped >= table->mappedSize) {
+            free(table->entries[i].data);
+        }
+    }
+    free(table->entries);
+    memset(table, 0, sizeof(PageTable));
+    table->lastNumber = NOPAGE;
+}
+
+// Returns the text segment entry at the given address, or NULL if the address is not an
+// instruction slot.
+
+TextInstr *textAt(Machine *m, long long address) {
+    unsigned long long offset = (unsigned long long) (address - m->textBase);
+
+    if(m->text == NULL || offset % WORD || offset / WORD >= (unsigned long long) m->textSlots) {
+        return NULL;
+    }
+    return &m->text[offset / WORD];
+}
+
+// Reads the doubleword at the given byte address. A load from an instruction's address reads
+// its opcode label.
+
+long long loadDouble(Machine *m, long long address) {
+    TextInstr *t = ((unsigned long long) (address - m->textBase) < (unsigned long long) m->textSlots * WORD)
+                 ? textAt(m, address) : NULL;
+    long long value = (t != NULL) ? t->opcode : loadData(&m->pages, address);
+
+    if(m->watchCount) {
+        watchAccess(m, address, WATCH_READ, value, value);
+    }
+    return value;
+}
+
+// Reads the doubleword at the given byte address of a data memory. A doubleword may straddle
+// two pages.
+
+long long loadData(PageTable *pages, long long address) {
+    unsigned long long a = address;
+    unsigned offset = a & (PAGESIZE - 1);
+    unsigned char bytes[DOUBLEWORD];
+    long long value;
+
+    unsigned char *page = findPage(pages, a >> PAGEBITS);
+    if(offset <= PAGESIZE - DOUBLEWORD) {
+        if(page == NULL) {
+            return 0;
+        }
+        memcpy(&value, page + offset, DOUBLEWORD);
+        return value;
+    }
+
+    unsigned char *next = findPage(pages, (a >> PAGEBITS) + 1);
+    unsigned first = PAGESIZE - offset;
+    memset(bytes, 0, DOUBLEWORD);
+    if(page != NULL) {
+        memcpy(bytes, page + offset, first);
+    }
+    if(next != NULL) {
+        memcpy(bytes + first, next, DOUBLEWORD - first);
+    }
+    memcpy(&value, bytes, DOUBLEWORD);
+    return value;
+}
+
+// Writes the doubleword at the given byte address, allocating pages as needed. A store to an
+// instruction's address replaces its opcode label and redecodes it. Returns 0, or -1 if the
+// machine is out of pages.
+
+int storeDouble(Machine *m, long long address, long long value) {
+    TextInstr *t = ((unsigned long long) (address - m->textBase) < (unsigned long long) m->textSlots * WORD)
+                 ? textAt(m, address) : NULL;
+    long long old = (m->watchCount == 0) ? 0 : (t != NULL) ? t->opcode : loadData(&m->pages, address);
+    int status = 0;
+
+    if(t != NULL) {
+        int op1, op2, op3;
+        unpackInstr(t, &op1, &op2, &op3);
+        packInstr(t, (value == (int) value) ? (int) value : 0, op1, op2, op3);
+        decodeSlot(m, &m->ops[t - m->text], address);
+        if(m->blocks != NULL) {
+            m->blocks->stale = 1;
+        }
+    } else {
+        status = storeData(&m->pages, address, value);
+    }
+    if(m->watchCount) {
+        watchAccess(m, address, WATCH_WRITE, old, value);
+    }
+    return status;
+}
+
+// Writes the doubleword at the given byte address of a data memory, allocating pages as
+// needed. Returns 0, or -1 if the memory is out of pages.
+
+int storeData(PageTable *pages, long long address, long long value) {
+    unsigned long long a = address;
+    unsigned offset = a & (PAGESIZE - 1);
+    unsigned char bytes[DOUBLEWORD];
+
+    unsigned char *page = addPage(pages, a >> PAGEBITS);
+    if(page == NULL) {
+        return -1;
+    }
+    if(offset <= PAGESIZE - DOUBLEWORD) {
+        memcpy(page + offset, &value, DOUBLEWORD);
+        return 0;
+    }
+
+    unsigned char *next = addPage(pages, (a >> PAGEBITS) + 1);
+    page = findPage(pages, a >> PAGEBITS);       // the table may have grown
+    if(next == NULL) {
+        return -1;
+    }
+    unsigned first = PAGESIZE - offset;
+    memcpy(bytes, &value, DOUBLEWORD);
+    memcpy(page + offset, bytes, first);
+    memcpy(next, bytes + first, DOUBLEWORD - first);
+    return 0;
+}
+
+// Checks a load or store of the doubleword at address against the machine's watchpoints, and
+// records the first one it hits in watchHit. A page holding watched memory is also dropped
+// as the most recently used page, so the engines' FASTPAGE path never touches it and every
+// access to it comes through here. Accesses to other pages run as fast as ever.
+
+void watchAccess(Machine *m, long long address, int access, long long old, long long value) {
+    for(int i = 0; i < m->watchCount; i++) {
+        const Watchpoint *w = &m->watches[i];
+
+        if(m->watchHit.number == 0 && (w->access & access)
+           && (unsigned long long) (address - w->address + DOUBLEWORD - 1) < 2 * DOUBLEWORD - 1) {
+            WatchHit hit = { i + 1, access, address, old, value };
+            m->watchHit = hit;
+        }
+        if((unsigned long long) w->address >> PAGEBITS == m->pages.lastNumber
+           || (unsigned long long) (w->address + DOUBLEWORD - 1) >> PAGEBITS == m->pages.lastNumber) {
+            m->pages.lastNumber = NOPAGE;
+        }
+    }
+}
+
+// Returns 1 if a text segment entry is one the loader could have produced: a known opcode
+// or an empty slot, with every register operand in range.
+
+int validInstr(const TextInstr *t) {
+    TextInstr check;
+    int op1, op2, op3;
+
+    unpackInstr(t, &op1, &op2, &op3);
+    packInstr(&check, t->opcode, op1, op2, op3);
+    return memcmp(&check, t, sizeof(TextInstr)) == 0 && check.rd < REGISTERSPACE
+        && check.rn < REGISTERSPACE && ((check.opcode != ADD && check.opcode != SUB) || check.imm < REGISTERSPACE);
+}
+
+// Writes the machine's text segment out as a program image. Returns -1 if the file cannot be
+// written.
+
+int writeImage(Machine *m, char *path) {
+    ImageHeader header;
+    FILE *file = fopen(path, "wb");
+
+    if(file == NULL) {
+        return -1;
+    }
+    memset(&header, 0, sizeof(ImageHeader));
+    memcpy(header.magic, IMAGEMAGIC, sizeof(header.magic));
+    header.version = IMAGEVERSION;
+    header.textBase = m->textBase;
+    header.textSlots = m->textSlots;
+    header.entry = STARTMEM;
+
+    size_t written = fwrite(&header, sizeof(ImageHeader), 1, file);
+    written += fwrite(m->text, sizeof(TextInstr), m->textSlots, file);
+    if(fclose(file) != 0 || written != (size_t) m->textSlots + 1) {
+        return -1;
+    }
+    return 0;
+}
+
+// Maps a program image straight in as the machine's text segment. The mapping is private, so
+// stores into the text change this machine's copy only. Images end with the empty slot
+// layoutText() leaves, and one that does not is taken as damaged. Returns -1, after saying
+// why, if the image cannot be used.
+
+int loadImage(Machine *m, char *file) {
+    ImageHeader *header;
+    struct stat info;
+    int fd = open(file, O_RDONLY);
+
+    if(fd < 0) {
+        return -1;
+    }
+    if(fstat(fd, &info) < 0 || info.st_size < (off_t) sizeof(ImageHeader)) {
+        close(fd);
+        return -1;
+    }
+    void *image = mmap(NULL, info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(image == MAP_FAILED) {
+        return -1;
+    }
+
+    header = image;
+    if(header->version != IMAGEVERSION) {
+        printf("%s is a version %i program image; this emulator reads version %i.\n", file, header->version, IMAGEVERSION);
+    } else if(header->textSlots < 1 || header->textSlots > MAXTEXTSLOTS || header->textBase < 0
+              || header->textBase > INT_MAX - header->textSlots * WORD
+              || (off_t) (sizeof(ImageHeader) + (size_t) header->textSlots * sizeof(TextInstr)) != info.st_size) {
+        printf("%s is a damaged program image.\n", file);
+    } else {
+        m->image = image;
+        m->imageSize = info.st_size;
+        m->text = (TextInstr *) (header + 1);
+        m->textBase = header->textBase;
+        m->textSlots = header->textSlots;
+        for(int i = 0; i < m->textSlots; i++) {
+            if(!validInstr(&m->text[i]) || (i == m->textSlots - 1 && m->text[i].opcode != 0)) {
+                printf("%s is a damaged program image.\n", file);
+                releaseText(m);
+                return -1;
+            }
+        }
+        m->registers[PC] = header->entry;
+        return 0;
+    }
+    munmap(image, info.st_size);
+    return -1;
+}
+
+// Frees the text segment, or unmaps it if it came from a program image.
+
+void releaseText(Machine *m) {
+    if(m->image != NULL) {
+        munmap(m->image, m->imageSize);
+        m->image = NULL;
+        m->imageSize = 0;
+    } else {
+        free(m->text);
+    }
+    m->text = NULL;
+}
+
+// Writes the machine's complete state out as a snapshot file. The snapshot is written beside
+// path and renamed over it when complete, so a reader never sees half of one. Returns -1 if it
+// cannot be written.
+
+int writeSnapshot(Machine *m, char *path, long long executed) {
+    char *temporary = malloc(strlen(path) + 5);
+
+    sprintf(temporary, "%s.tmp", path);
+    FILE *file = fopen(temporary, "wb");
+    if(file == NULL) {
+        free(temporary);
+        return -1;
+    }
+    putSnapshot(m, file, executed);
+
+    int failed = ferror(file);
+    failed |= (fclose(file) != 0);
+    if(failed || rename(temporary, path) < 0) {
+        remove(temporary);
+        free(temporary);
+        return -1;
+    }
+    free(temporary);
+    return 0;
+}
+
+// Writes a snapshot of the machine to file: registers, text segment and every page of data
+// memory, along with the count of instructions executed so far. Errors are left on the file.
+
+void putSnapshot(Machine *m, FILE *file, long long executed) {
+    static const unsigned char zeros[PAGESIZE];
+    SnapshotHeader header;
+    long long textSize = (long long) m->textSlots * sizeof(TextInstr);
+    long long indexSize = (long long) m->pages.count * sizeof(unsigned long long);
+
+    memset(&header, 0, sizeof(SnapshotHeader));
+    memcpy(header.magic, SNAPSHOTMAGIC, sizeof(header.magic));
+    header.version = SNAPSHOTVERSION;
+    header.textBase = m->textBase;
+    header.textSlots = m->textSlots;
+    header.pageCount = m->pages.count;
+    header.stackTop = m->stackTop;
+    header.stackSize = m->stackSize;
+    header.executed = executed;
+    memcpy(header.registers, m->registers, sizeof(m->registers));
+    header.textOffset = PAGESIZE;
+    header.indexOffset = header.textOffset + PAGEROUND(textSize);
+    header.pageOffset = header.indexOffset + PAGEROUND(indexSize);
+
+    fwrite(&header, sizeof(SnapshotHeader), 1, file);
+    fwrite(zeros, 1, PAGESIZE - sizeof(SnapshotHeader), file);
+    fwrite(m->text, 1, textSize, file);
+    fwrite(zeros, 1, PAGEROUND(textSize) - textSize, file);
+    for(int i = 0; i < m->pages.capacity; i++) {
+        if(m->pages.entries[i].data != NULL) {
+            fwrite(&m->pages.entries[i].number, sizeof(unsigned long long), 1, file);
+        }
+    }
+    fwrite(zeros, 1, PAGEROUND(indexSize) - indexSize, file);
+    for(int i = 0; i < m->pages.capacity; i++) {
+        if(m->pages.entries[i].data != NULL) {
+            fwrite(m->pages.entries[i].data, 1, PAGESIZE, file);
+        }
+    }
+}
+
+// Restores a machine from a snapshot by mapping it in. The text segment and the data pages are
+// used where they lie in the mapping, which is private, so nothing is read or copied until the
+// program touches it and many machines can start from one snapshot. Unlike a program image,
+// the last slot may hold an opcode the program stored there before the snapshot was taken;
+// the halting op decodeProgram() puts past it ends a run that falls off the end. Returns -1,
+// after saying why, if the snapshot cannot be used.
+
+int loadSnapshot(Machine *m, char *file) {
+    struct stat info;
+    int fd = open(file, O_RDONLY);
+
+    if(fd < 0) {
+        return -1;
+    }
+    if(fstat(fd, &info) < 0 || info.st_size < PAGESIZE) {
+        close(fd);
+        return -1;
+    }
+    unsigned char *image = mmap(NULL, info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(image == MAP_FAILED) {
+        return -1;
+    }
+    if(useSnapshot(m, image, info.st_size, 0, file) < 0) {
+        munmap(image, info.st_size);
+        return -1;
+    }
+    m->image = image;
+    m->imageSize = info.st_size;
+    return 0;
+}
+
+// Points the machine's text segment and data pages at the snapshot mapped at image, and loads
+// its registers. The snapshot must take up all size bytes unless trailing data is allowed.
+// Unmapping image is left to the caller. Returns the length of the snapshot, or -1, after
+// saying why, if it cannot be used.
+
+long long useSnapshot(Machine *m, unsigned char *image, long long size, int trailing, char *file) {
+    SnapshotHeader *header = (SnapshotHeader *) image;
+    TextInstr *text = (TextInstr *) (image + PAGESIZE);
+
+    if(size < PAGESIZE || memcmp(header->magic, SNAPSHOTMAGIC, sizeof(header->magic)) != 0) {
+        printf("%s is a damaged snapshot.\n", file);
+        return -1;
+    }
+    if(header->version != SNAPSHOTVERSION) {
+        printf("%s is a version %i snapshot; this emulator reads version %i.\n", file, header->version, SNAPSHOTVERSION);
+        return -1;
+    }
+    long long length = header->pageOffset + (long long) header->pageCount * PAGESIZE;
+    if(header->textSlots < 1 || header->textSlots > MAXTEXTSLOTS || header->textBase < 0
+       || header->textBase > INT_MAX - header->textSlots * WORD
+       || header->pageCount < 0 || header->pageCount > MAXPAGES
+       || header->textOffset != PAGESIZE
+       || header->indexOffset != header->textOffset + (long long) PAGEROUND(header->textSlots * sizeof(TextInstr))
+       || header->pageOffset != header->indexOffset + (long long) PAGEROUND(header->pageCount * sizeof(unsigned long long))
+       || length > size || (!trailing && length != size)) {
+        printf("%s is a damaged snapshot.\n", file);
+        return -1;
+    }
+    for(int i = 0; i < header->textSlots; i++) {
+        if(!validInstr(&text[i])) {
+            printf("%s is a damaged snapshot.\n", file);
+            return -1;
+        }
+    }
+
+    unsigned long long *numbers = (unsigned long long *) (image + header->indexOffset);
+    m->text = text;
+    m->textBase = header->textBase;
+    m->textSlots = header->textSlots;
+    m->pages.mapped = image + header->pageOffset;
+    m->pages.mappedSize = (size_t) header->pageCount * PAGESIZE;
+    for(int i = 0; i < header->pageCount; i++) {
+        placePage(&m->pages, numbers[i], m->pages.mapped + (size_t) i * PAGESIZE);
+    }
+    memcpy(m->registers, header->registers, sizeof(m->registers));
+    m->stackTop = header->stackTop;
+    m->stackSize = header->stackSize;
+    m->restoredAt = header->executed;
+    return length;
+}
+
+// Lays out the instructions read from the program file as the packed text segment. The
+// segment starts on the STARTMEM grid at or below the lowest instruction and ends with one
+// empty (halting) slot past the highest, so falling off the end of the program halts.
+
+void layoutText(Machine *m) {
+    int low = STARTMEM, high = STARTMEM - WORD;
+
+    for(int i = 0; i < m->loadedCount; i++) {
+        low = (m->loaded[i].address < low) ? m->loaded[i].address : low;
+        high = (m->loaded[i].address > high) ? m->loaded[i].address : high;
+    }
+    m->textBase = STARTMEM - ((STARTMEM - low + WORD - 1) / WORD) * WORD;
+    m->textSlots = (high - m->textBase) / WORD + 2;
+    if(m->textSlots > MAXTEXTSLOTS) {
+        printf("Program spans more than %i instructions, keeping the first %i.\n", MAXTEXTSLOTS - 1, MAXTEXTSLOTS - 1);
+        m->textSlots = MAXTEXTSLOTS;
+    }
+
+    releaseText(m);
+    m->text = calloc(m->textSlots, sizeof(TextInstr));
+    for(int i = 0; i < m->loadedCount; i++) {
+        int offset = m->loaded[i].address - m->textBase;
+        if(offset % WORD == 0 && offset / WORD < m->textSlots - 1) {
+            m->text[offset / WORD] = m->loaded[i].instr;
+        } else {
+            printf("Ignoring instruction at address %i, off the %i-byte instruction grid.\n", m->loaded[i].address, WORD);
+        }
+    }
+    free(m->loaded);
+    m->loaded = NULL;
+    m->loadedCount = m->loadedCapacity = 0;
+}
+
+// Decodes the text segment into the machine's ops array, one op per instruction slot, and
+// drops any blocks translated from the old one. A K_HALT op past the last slot ends the
+// stream; it has no instruction, so no store can redecode it, and running off the end of the
+// text halts there even when a store has filled the last slot.
+
+void decodeProgram(Machine *m) {
+    flushBlocks(m);
+    free(m->ops);
+    m->ops = calloc(m->textSlots + 1, sizeof(DecodedOp));
+
+    for(int i = 0; i < m->textSlots; i++) {
+        decodeSlot(m, &m->ops[i], m->textBase + i * WORD);
+    }
+    m->ops[m->textSlots].kind = K_HALT;
+    m->ops[m->textSlots].pc = m->textBase + m->textSlots * WORD;
+    m->ops[m->textSlots].handler = dispatchTable ? dispatchTable[K_HALT] : NULL;
+    for(int i = 0; m->fuse && i < m->textSlots; i++) {
+        fuseSlot(m, i);
+    }
+}
+
+// Decodes the instruction held at the given address into op, resolving branch targets into
+// pointers within the stream. Anything the fast handlers cannot express exactly (operands
+// naming the PC register) is left to the switch interpreter as K_SLOW.
+
+void decodeSlot(Machine *m, DecodedOp *op, int address) {
+    TextInstr *t = textAt(m, address);
+    int opcode = 0, op1 = 0, op2 = 0, op3 = 0;
+
+    if(t != NULL) {
+        opcode = t->opcode;
+        unpackInstr(t, &op1, &op2, &op3);
+    }
+    memset(op, 0, sizeof(DecodedOp));
+    op->pc = address;
+
+    switch(opcode) {
+        case ADD :  op->kind = K_ADD;  op->rd = op1; op->rn = op2; op->rm = op3; break;
+        case SUB :  op->kind = K_SUB;  op->rd = op1; op->rn = op2; op->rm = op3; break;
+        case ADDI : op->kind = (op2 == SP) ? K_ADDSP : K_ADDI; op->rd = op1; op->rn = op2; op->imm = op3; break;
+        case SUBI : op->kind = (op2 == SP) ? K_SUBSP : K_SUBI; op->rd = op1; op->rn = op2; op->imm = op3; break;
+        case LDUR : op->kind = K_LDUR; op->rd = op1; op->rn = op2; op->imm = op3; break;
+        case STUR : op->kind = K_STUR; op->rd = op1; op->rn = op2; op->imm = op3; break;
+        case LSL :  op->kind = K_LSL;  op->rd = op1; op->rn = op2; op->imm = op3; break;
+        case CBZ :  op->kind = K_CBZ;  op->rd = op1; op->imm = op2; break;
+        case CBNZ : op->kind = K_CBNZ; op->rd = op1; op->imm = op2; break;
+        case BR :   op->kind = K_BR;   op->rn = op1; break;
+        case BL :   op->kind = K_BL;   op->imm = op1; break;
+        case B :    op->kind = K_B;    op->imm = op1; break;
+        default :   op->kind = K_HALT; break;
+    }
+
+    // the stream only keeps the PC register current on exit
+    if(op->kind != K_HALT && (op->rd == PC || op->rn == PC || op->rm == PC)) {
+        op->kind = K_SLOW;
+    }
+
+    if(op->kind == K_CBZ || op->kind == K_CBNZ || op->kind == K_BL || op->kind == K_B) {
+        op->target = pcToOp(m, op->imm);
+    }
+    op->handler = dispatchTable ? dispatchTable[op->kind] : NULL;
+}
+
+// Turns the op at slot into a fused op if it starts one of the common sequences:
+//   K_PUSH  SUBI SP, SP, #n followed by STUR Xt, [SP, #k]...   (function prologue)
+//   K_POP   LDUR Xt, [SP, #k]... followed by ADDI SP, SP, #n    (function epilogue)
+//   K_LOOP  B to a CBZ/CBNZ                                     (loop back edge and test)
+// Only the first op changes; the ones it covers stay as they are, so a branch into the middle
+// of a sequence, or a store that rewrites part of it, still runs correctly. The fused handlers
+// check each op they cover as they go and drop back to ordinary dispatch at the first that no
+// longer fits.
+
+void fuseSlot(Machine *m, int slot) {
+    DecodedOp *op = &m->ops[slot];
+    int length = 1, room = m->textSlots - slot;
+
+    room = (room < MAXFUSE) ? room : MAXFUSE;
+    if(op->kind == K_SUBSP && op->rd == SP) {
+        while(length < room && op[length].kind == K_STUR && op[length].rn == SP) {
+            length++;
+        }
+        if(length > 1) {
+            op->kind = K_PUSH;
+        }
+    } else if(op->kind == K_LDUR && op->rn == SP) {
+        while(length < room && op[length].kind == K_LDUR && op[length].rn == SP) {
+            length++;
+        }
+        if(length < room && op[length].kind == K_ADDSP && op[length].rd == SP) {
+            op->kind = K_POP;
+            length++;
+        }
+    } else if(op->kind == K_B && op->target != NULL && (op->target->kind == K_CBZ || op->target->kind == K_CBNZ)) {
+        op->kind = K_LOOP;
+    }
+    op->length = length;
+    op->handler = dispatchTable ? dispatchTable[op->kind] : NULL;
+}
+
+// Makes the op halt the decoded stream, with the PC left on it, until restoreSlot() puts the
+// instruction back. Fused ops check each op they cover, so they stop there too.
+
+void trapSlot(Machine *m, DecodedOp *op) {
+    op->kind = K_HALT;
+    op->handler = dispatchTable ? dispatchTable[K_HALT] : NULL;
+    if(m->blocks != NULL) {
+        m->blocks->stale = 1;
+    }
+}
+
+// Decodes the op's instruction again, undoing trapSlot().
+
+void restoreSlot(Machine *m, DecodedOp *op) {
+    decodeSlot(m, op, op->pc);
+    if(m->fuse) {
+        fuseSlot(m, op - m->ops);
+    }
+    if(m->blocks != NULL) {
+        m->blocks->stale = 1;
+    }
+}
+
+// Returns the decoded op for the given PC, or NULL if the PC is not in the stream.
+
+DecodedOp *pcToOp(Machine *m, long long pc) {
+    unsigned long long offset = (unsigned long long) (pc - m->textBase);
+
+    if(m->ops == NULL || offset % WORD || offset / WORD >= (unsigned long long) m->textSlots) {
+        return NULL;
+    }
+    return &m->ops[offset / WORD];
+}
+
+// Runs the decoded stream from op until the program halts, fails, leaves the stream or
+// executes limit instructions. Return values follow executeInstruction(): 1 to continue,
+// 0 when complete and -1 on a stack overflow or when guest memory runs out. registers[PC]
+// holds the next instruction on return, and the count of completed instructions goes to
+// executed. An access that hits a watchpoint ends the run after its instruction, which only
+// the slow memory paths need to check for.
+//
+// With GCC/Clang every op carries the address of its handler label and each handler jumps
+// straight to the next one (direct threading); other compilers fall back to a switch. The
+// labels are handed out through dispatchTable by one call with a NULL machine, made before
+// any program is decoded.
+
+#ifdef __GNUC__
+#define CASE(kind) L_##kind:
+#define DISPATCH() goto *op->handler
+#else
+#define CASE(kind) case kind:
+#define DISPATCH() goto dispatch
+#endif
+
+#define NEXT() do { if(++count >= limit) goto suspend; DISPATCH(); } while(0)
+#define BRANCH(to, address) do { if((op = (to)) == NULL) { m->registers[PC] = (address); goto leave; } NEXT(); } while(0)
+
+int runDecoded(Machine *m, DecodedOp *op, long long limit, long long *executed) {
+    long long count = 0, address;
+    long long *r;
+    DecodedOp *end;
+    int exec = 1;
+
+#ifdef __GNUC__
+    static const void *labels[NUMKINDS] = {
+        &&L_K_HALT, &&L_K_ADD, &&L_K_ADDI, &&L_K_ADDSP, &&L_K_SUB, &&L_K_SUBI, &&L_K_SUBSP, &&L_K_LDUR,
+        &&L_K_STUR, &&L_K_LSL, &&L_K_CBZ, &&L_K_CBNZ, &&L_K_BR, &&L_K_BL, &&L_K_B, &&L_K_SLOW,
+        &&L_K_PUSH, &&L_K_POP, &&L_K_LOOP
+    };
+    if(m == NULL) {
+        dispatchTable = labels;
+    }
+#endif
+    if(m == NULL) {
+        return 0;                                 // called once up front to export the handlers
+    }
+    r = m->registers;
+
+    if(limit <= 0) {
+        m->registers[PC] = op->pc;
+        goto done;
+    }
+    DISPATCH();
+
+#ifndef __GNUC__
+dispatch:
+    switch(op->kind) {
+#endif
+    CASE(K_ADD)
+        r[op->rd] = ADDWRAP(r[op->rn], r[op->rm]);
+        op++;
+        NEXT();
+    CASE(K_ADDI)
+        r[op->rd] = ADDWRAP(r[op->rn], op->imm);
+        op++;
+        NEXT();
+    CASE(K_ADDSP)
+        r[op->rd] = ADDWRAP(r[SP], op->imm);
+        if(r[op->rd] > m->stackTop) {
+            outPrintf(&m->out, "%s\n", OVERFLOW_MSG);
+            goto fail;
+        }
+        op++;
+        NEXT();
+    CASE(K_SUB)
+        r[op->rd] = SUBWRAP(r[op->rn], r[op->rm]);
+        op++;
+        NEXT();
+    CASE(K_SUBI)
+        r[op->rd] = SUBWRAP(r[op->rn], op->imm);
+        op++;
+        NEXT();
+    CASE(K_SUBSP)
+        r[op->rd] = SUBWRAP(r[SP], op->imm);
+        if(r[op->rd] < m->stackTop - m->stackSize) {
+            outPrintf(&m->out, "%s\n", OVERFLOW_MSG);
+            goto fail;
+        }
+        op++;
+        NEXT();
+    CASE(K_LDUR)
+        address = ADDWRAP(r[op->rn], op->imm);
+        if(FASTPAGE(m, address)) {
+            memcpy(&r[op->rd], m->pages.lastData + (address & (PAGESIZE - 1)), DOUBLEWORD);
+        } else {
+            r[op->rd] = loadDouble(m, address);
+            limit = m->watchHit.number ? count + 1 : limit;
+        }
+        op++;
+        NEXT();
+    CASE(K_STUR)
+        address = ADDWRAP(r[op->rn], op->imm);
+        if(FASTPAGE(m, address)) {
+            memcpy(m->pages.lastData + (address & (PAGESIZE - 1)), &r[op->rd], DOUBLEWORD);
+        } else if(storeDouble(m, address, r[op->rd]) < 0) {
+            outPrintf(&m->out, "%s\n", MEMORY_MSG);
+            goto fail;
+        } else {
+            limit = m->watchHit.number ? count + 1 : limit;
+        }
+        op++;
+        NEXT();
+    CASE(K_LSL)
+        r[op->rd] = SHLWRAP(r[op->rn], op->imm);
+        op++;
+        NEXT();
+    CASE(K_CBZ)
+        if(r[op->rd] - r[XZR] == 0) {
+            BRANCH(op->target, op->imm);
+        }
+        op++;
+        NEXT();
+    CASE(K_CBNZ)
+        if(r[op->rd] - r[XZR] != 0) {
+            BRANCH(op->target, op->imm);
+        }
+        op++;
+        NEXT();
+    CASE(K_BR)
+        if(op->rn == XZR) {
+            goto halt;
+        }
+        address = r[op->rn];
+        BRANCH(pcToOp(m, address), address);
+    CASE(K_BL)
+        r[LR] = op->pc + WORD;
+        BRANCH(op->target, op->imm);
+    CASE(K_B)
+        BRANCH(op->target, op->imm);
+    CASE(K_SLOW)
+        m->registers[PC] = op->pc;
+        exec = executeInstruction(m, op->pc);
+        if(exec != 1) {
+            goto done;
+        }
+        limit = m->watchHit.number ? count + 1 : limit;
+        address = m->registers[PC];
+        BRANCH(pcToOp(m, address), address);
+    CASE(K_PUSH)
+        r[SP] = SUBWRAP(r[SP], op->imm);
+        if(r[SP] < m->stackTop - m->stackSize) {
+            outPrintf(&m->out, "%s\n", OVERFLOW_MSG);
+            goto fail;
+        }
+        for(end = op + op->length, op++; op < end; op++) {
+            if(++count >= limit) {
+                goto suspend;
+            }
+            address = ADDWRAP(r[SP], op->imm);
+            if(op->kind != K_STUR || op->rn != SP || !FASTPAGE(m, address)) {
+                DISPATCH();                       // carry on one op at a time
+            }
+            memcpy(m->pages.lastData + (address & (PAGESIZE - 1)), &r[op->rd], DOUBLEWORD);
+            m->fusedAway++;
+        }
+        NEXT();
+    CASE(K_POP)
+        end = op + op->length - 1;                // the ADDI SP
+        for(;;) {
+            address = ADDWRAP(r[SP], op->imm);
+            if(FASTPAGE(m, address)) {
+                memcpy(&r[op->rd], m->pages.lastData + (address & (PAGESIZE - 1)), DOUBLEWORD);
+            } else {
+                r[op->rd] = loadDouble(m, address);
+                limit = m->watchHit.number ? count + 1 : limit;
+            }
+            op++;
+            if(++count >= limit) {
+                goto suspend;
+            }
+            if(op == end) {
+                break;
+            }
+            if((op->kind != K_LDUR && op->kind != K_POP) || op->rn != SP) {
+                DISPATCH();
+            }
+            m->fusedAway++;
+        }
+        if(op->kind != K_ADDSP || op->rd != SP) {
+            DISPATCH();
+        }
+        m->fusedAway++;
+        r[SP] = ADDWRAP(r[SP], op->imm);
+        if(r[SP] > m->stackTop) {
+            outPrintf(&m->out, "%s\n", OVERFLOW_MSG);
+            goto fail;
+        }
+        op++;
+        NEXT();
+    CASE(K_LOOP)
+        op = op->target;
+        if(++count >= limit) {
+            goto suspend;
+        }
+        if(op->kind != K_CBZ && op->kind != K_CBNZ) {
+            DISPATCH();
+        }
+        m->fusedAway++;
+        if((r[op->rd] - r[XZR] == 0) == (op->kind == K_CBZ)) {
+            BRANCH(op->target, op->imm);
+        }
+        op++;
+        NEXT();
+    CASE(K_HALT)
+        goto halt;
+#ifndef __GNUC__
+    }
+#endif
+
+suspend:
+    m->registers[PC] = op->pc;
+    goto done;
+leave:
+    count++;                                      // the branch that left the stream completed
+    goto done;
+halt:
+    m->registers[PC] = op->pc;
+    exec = 0;
+    goto done;
+fail:
+    m->registers[PC] = op->pc;
+    exec = -1;
+done:
+    if(executed != NULL) {
+        *executed = count;
+    }
+    return exec;
+}
+
+#undef CASE
+#undef DISPATCH
+#undef NEXT
+#undef BRANCH
+
+// Returns the cached block starting at address, translating it first if there is none. The
+// caller has checked that the op at address is one a block can start with.
+
+Block *findBlock(Machine *m, long long address) {
+    BlockCache *cache = m->blocks;
+    unsigned bucket = ((unsigned long long) address / WORD) & (BLOCKBUCKETS - 1);
+
+    for(Block *b = cache->buckets[bucket]; b != NULL; b = b->hashNext) {
+        if(b->start == address) {
+            return b;
+        }
+    }
+    if(cache->count >= MAXBLOCKS) {
+        flushBlocks(m);
+    }
+
+    Block *b = translateBlock(m, address);
+    b->hashNext = cache->buckets[bucket];
+    cache->buckets[bucket] = b;
+    cache->count++;
+    cache->translated++;
+    return b;
+}
+
+// Translates the straight-line run of decoded ops from address up to and including the next
+// branch into a block, with every register operand resolved to a pointer into the machine.
+// The run also stops before an op only the other engines can run (K_HALT, K_SLOW) and after
+// MAXBLOCKOPS ops, and a block that does not end in a branch gets a B_NEXT op to leave by.
+// Fused ops are translated as the first instruction they cover.
+
+Block *translateBlock(Machine *m, long long address) {
+    static const int kinds[NUMKINDS] = {
+        [K_ADD] = B_ADD, [K_ADDI] = B_ADDI, [K_ADDSP] = B_ADDSP, [K_SUB] = B_SUB, [K_SUBI] = B_SUBI,
+        [K_SUBSP] = B_SUBSP, [K_LDUR] = B_LDUR, [K_STUR] = B_STUR, [K_LSL] = B_LSL, [K_CBZ] = B_CBZ,
+        [K_CBNZ] = B_CBNZ, [K_BR] = B_BR, [K_BL] = B_BL, [K_B] = B_B,
+        [K_PUSH] = B_SUBSP, [K_POP] = B_LDUR, [K_LOOP] = B_B
+    };
+    DecodedOp *first = pcToOp(m, address);
+    int length = 0, room = m->ops + m->textSlots - first, kind = B_ADD;
+
+    room = (room < MAXBLOCKOPS) ? room : MAXBLOCKOPS;
+    while(length < room && first[length].kind != K_HALT && first[length].kind != K_SLOW) {
+        kind = kinds[first[length++].kind];
+        if(kind >= B_CBZ) {
+            break;                                // B_CBZ onwards are the branches
+        }
+    }
+    int exits = (kind >= B_CBZ) ? 0 : 1;
+
+    Block *b = calloc(1, sizeof(Block) + (length + exits) * sizeof(BlockOp));
+    b->start = address;
+    b->length = length;
+    for(int i = 0; i < length; i++) {
+        DecodedOp *d = &first[i];
+        BlockOp *op = &b->ops[i];
+        op->kind = kinds[d->kind];
+        op->d = &m->registers[d->rd];
+        op->n = &m->registers[d->rn];
+        op->m = &m->registers[d->rm];
+        op->imm = d->imm;
+        op->pc = d->pc;
+    }
+    if(exits) {
+        b->ops[length].kind = B_NEXT;
+        b->ops[length].pc = address + length * WORD;
+    }
+    for(int i = 0; i < length + exits; i++) {
+        b->ops[i].handler = blockTable ? blockTable[b->ops[i].kind] : NULL;
+    }
+    return b;
+}
+
+// Throws away every translated block, and with them the chains between blocks.
+
+void flushBlocks(Machine *m) {
+    BlockCache *cache = m->blocks;
+
+    if(cache == NULL) {
+        return;
+    }
+    for(int i = 0; i < BLOCKBUCKETS; i++) {
+        while(cache->buckets[i] != NULL) {
+            Block *next = cache->buckets[i]->hashNext;
+            free(cache->buckets[i]);
+            cache->buckets[i] = next;
+        }
+    }
+    cache->flushes += (cache->count > 0);
+    cache->count = 0;
+    cache->stale = 0;
+}
+
+// runMachine() a block at a time, out of the machine's block cache. A block checks the limit
+// once on entry and then runs its ops back to back, and at its end follows the pointer it keeps
+// to the successor it went to last time, only looking the next block up when that successor
+// has not been seen or (for BR) has changed. A block longer than what is left of the limit
+// runs through runDecoded() instead, as do the PCs no block can start at. A store into the
+// text segment marks the cache stale, so the block stops right after the store and the cache
+// is flushed before anything else runs.
+//
+// Handlers are exported through blockTable in the same way as runDecoded()'s.
+
+#ifdef __GNUC__
+#define CASE(kind) L_##kind:
+#define DISPATCH() goto *op->handler
+#else
+#define CASE(kind) case kind:
+#define DISPATCH() goto dispatch
+#endif
+
+#define NEXT() do { op++; DISPATCH(); } while(0)
+#define FOLLOW(which, address) do { link = &b->which; r[PC] = (address); goto chain; } while(0)
+
+int runBlocks(Machine *m, long long limit, long long *executed) {
+    long long count = 0, address, done, flushes;
+    long long *r;
+    Block *b, **link = NULL;
+    BlockOp *op;
+    DecodedOp *d;
+    int exec = 1;
+
+#ifdef __GNUC__
+    static const void *labels[NUMBLOCKKINDS] = {
+        &&L_B_ADD, &&L_B_ADDI, &&L_B_ADDSP, &&L_B_SUB, &&L_B_SUBI, &&L_B_SUBSP, &&L_B_LDUR, &&L_B_STUR,
+        &&L_B_LSL, &&L_B_CBZ, &&L_B_CBNZ, &&L_B_BR, &&L_B_BL, &&L_B_B, &&L_B_NEXT
+    };
+    if(m == NULL) {
+        blockTable = labels;
+    }
+#endif
+    if(m == NULL) {
+        return 0;                                 // called once up front to export the handlers
+    }
+    if(m->blocks == NULL) {
+        m->blocks = calloc(1, sizeof(BlockCache));
+    }
+    r = m->registers;
+
+lookup:
+    if(m->blocks->stale) {
+        flushBlocks(m);
+        link = NULL;
+    }
+    if(count >= limit) {
+        goto done;
+    }
+    d = pcToOp(m, r[PC]);
+    if(d == NULL || d->kind == K_HALT || d->kind == K_SLOW) {
+        if(d == NULL) {
+            exec = executeInstruction(m, r[PC]);
+            done = (exec == 1);
+        } else {
+            exec = runDecoded(m, d, 1, &done);
+        }
+        count += done;
+        link = NULL;
+        if(exec != 1 || m->watchHit.number) {
+            goto done;
+        }
+        goto lookup;
+    }
+    flushes = m->blocks->flushes;
+    b = findBlock(m, r[PC]);
+    if(link != NULL && m->blocks->flushes == flushes) {
+        *link = b;                                // chain the block we came from to this one
+    }
+
+enter:
+    if(limit - count < b->length) {
+        exec = runDecoded(m, pcToOp(m, b->start), limit - count, &done);
+        count += done;
+        goto done;
+    }
+    op = b->ops;
+    DISPATCH();
+
+#ifndef __GNUC__
+dispatch:
+    switch(op->kind) {
+#endif
+    CASE(B_ADD)
+        *op->d = ADDWRAP(*op->n, *op->m);
+        NEXT();
+    CASE(B_ADDI)
+        *op->d = ADDWRAP(*op->n, op->imm);
+        NEXT();
+    CASE(B_ADDSP)
+        *op->d = ADDWRAP(r[SP], op->imm);
+        if(*op->d > m->stackTop) {
+            outPrintf(&m->out, "%s\n", OVERFLOW_MSG);
+            goto fail;
+        }
+        NEXT();
+    CASE(B_SUB)
+        *op->d = SUBWRAP(*op->n, *op->m);
+        NEXT();
+    CASE(B_SUBI)
+        *op->d = SUBWRAP(*op->n, op->imm);
+        NEXT();
+    CASE(B_SUBSP)
+        *op->d = SUBWRAP(r[SP], op->imm);
+        if(*op->d < m->stackTop - m->stackSize) {
+            outPrintf(&m->out, "%s\n", OVERFLOW_MSG);
+            goto fail;
+        }
+        NEXT();
+    CASE(B_LDUR)
+        address = ADDWRAP(*op->n, op->imm);
+        if(FASTPAGE(m, address)) {
+            memcpy(op->d, m->pages.lastData + (address & (PAGESIZE - 1)), DOUBLEWORD);
+        } else {
+            *op->d = loadDouble(m, address);
+            if(m->watchHit.number) {
+                goto watched;
+            }
+        }
+        NEXT();
+    CASE(B_STUR)
+        address = ADDWRAP(*op->n, op->imm);
+        if(FASTPAGE(m, address)) {
+            memcpy(m->pages.lastData + (address & (PAGESIZE - 1)), op->d, DOUBLEWORD);
+        } else if(storeDouble(m, address, *op->d) < 0) {
+            outPrintf(&m->out, "%s\n", MEMORY_MSG);
+            goto fail;
+        } else if(m->watchHit.number) {
+            goto watched;
+        } else if(m->blocks->stale) {             // the program rewrote its own text
+            count += op - b->ops + 1;
+            r[PC] = op->pc + WORD;
+            link = NULL;
+            goto lookup;
+        }
+        NEXT();
+    CASE(B_LSL)
+        *op->d = SHLWRAP(*op->n, op->imm);
+        NEXT();
+    CASE(B_CBZ)
+        if(*op->d - r[XZR] == 0) {
+            FOLLOW(taken, op->imm);
+        }
+        FOLLOW(notTaken, op->pc + WORD);
+    CASE(B_CBNZ)
+        if(*op->d - r[XZR] != 0) {
+            FOLLOW(taken, op->imm);
+        }
+        FOLLOW(notTaken, op->pc + WORD);
+    CASE(B_BR)
+        if(op->n == &r[XZR]) {
+            count += op - b->ops;
+            r[PC] = op->pc;
+            exec = 0;
+            goto done;
+        }
+        FOLLOW(taken, *op->n);                    // the last target taken, a one-entry cache
+    CASE(B_BL)
+        r[LR] = op->pc + WORD;
+        FOLLOW(taken, op->imm);
+    CASE(B_B)
+        FOLLOW(taken, op->imm);
+    CASE(B_NEXT)
+        FOLLOW(notTaken, op->pc);
+#ifndef __GNUC__
+    }
+#endif
+
+chain:
+    count += b->length;
+    if(*link != NULL && (*link)->start == r[PC]) {
+        b = *link;
+        m->blocks->chained++;
+        goto enter;
+    }
+    goto lookup;
+watched:
+    count += op - b->ops + 1;                     // stop after the access, like runDecoded()
+    r[PC] = op->pc + WORD;
+    goto done;
+fail:
+    count += op - b->ops;
+    r[PC] = op->pc;
+    exec = -1;
+done:
+    if(executed != NULL) {
+        *executed = count;
+    }
+    return exec;
+}
+
+#undef CASE
+#undef DISPATCH
+#undef NEXT
+#undef FOLLOW
+
+// Executes the single instruction at the PC, through the decoded stream when the PC is in it.
+
+int stepMachine(Machine *m) {
+    DecodedOp *op = pcToOp(m, m->registers[PC]);
+
+    if(op == NULL) {
+        return executeInstruction(m, m->registers[PC]);
+    }
+    return runDecoded(m, op, 1, NULL);
+}
+
+// Runs until the program halts or fails, or limit instructions have executed, stepping through
+// the switch interpreter for any instruction outside the decoded stream.
+
+int runMachine(Machine *m, long long limit, long long *executed) {
+    long long count = 0, done;
+    int exec = 1;
+
+    if(m->engine == ENGINE_BLOCKS) {
+        return runBlocks(m, limit, executed);
+    }
+
+    while(exec == 1 && count < limit) {
+        DecodedOp *op = pcToOp(m, m->registers[PC]);
+        if(op != NULL) {
+            exec = runDecoded(m, op, limit - count, &done);
+            count += done;
+        } else {
+            exec = executeInstruction(m, m->registers[PC]);
+            count += (exec == 1);
+        }
+        if(m->watchHit.number) {
+            break;
+        }
+    }
+    if(executed != NULL) {
+        *executed = count;
+    }
+    return exec;
+}
+
+// Runs the loaded program the given number of times with the switch interpreter, the decoded
+// stream with and without fusion and the block cache, reporting instructions per second for
+// each and checking they all end in the same state. Returns 0 if the engines agree.
+
+int compareEngines(Machine *m, int runs) {
+    const char *names[4] = { "switch", "threaded", "fused", "blocks" };
+    Machine *saved = calloc(1, sizeof(Machine)), *reference = calloc(1, sizeof(Machine));
+    long long instructions[4] = {0, 0, 0, 0}, fusedAway = 0, executed;
+    long long translated = 0, chained = 0, flushes = 0;
+    double seconds[4] = {0, 0, 0, 0};
+    struct timespec start, end;
+    int exec, fuse = m->fuse, engineUsed = m->engine, agree = 1;
+
+    copyMachine(saved, m);
+
+    for(int engine = 0; engine < 4; engine++) {
+        m->fuse = (engine == 2);
+        m->engine = (engine == 3) ? ENGINE_BLOCKS : ENGINE_THREADED;
+        for(int run = 0; run < runs; run++) {
+            copyMachine(m, saved);
+            m->fusedAway = 0;
+            if(m->blocks != NULL) {
+                m->blocks->translated = m->blocks->chained = m->blocks->flushes = 0;
+            }
+
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            if(engine == 0) {
+                executed = 0;
+                while((exec = executeInstruction(m, m->registers[PC])) == 1) {
+                    executed++;
+                }
+            } else {
+                exec = runMachine(m, LLONG_MAX, &executed);
+            }
+            clock_gettime(CLOCK_MONOTONIC, &end);
+
+            instructions[engine] += executed;
+            seconds[engine] += (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+            fusedAway += (engine == 2) ? m->fusedAway : 0;
+            if(engine == 3) {
+                translated += m->blocks->translated;
+                chained += m->blocks->chained;
+                flushes += m->blocks->flushes;
+            }
+        }
+        if(engine == 0) {
+            copyMachine(reference, m);
+        } else {
+            agree = agree && instructions[engine] == instructions[0] && sameState(reference, m);
+        }
+    }
+    m->fuse = fuse;
+    m->engine = engineUsed;
+
+    printf("%-10s %14s %12s %16s\n", "engine", "instructions", "seconds", "instructions/s");
+    for(int engine = 0; engine < 4; engine++) {
+        printf("%-10s %14lli %12.6f %16.0f\n", names[engine], instructions[engine], seconds[engine],
+            instructions[engine] / seconds[engine]);
+    }
+    printf("speedup: %.2fx threaded, %.2fx fused, %.2fx blocks\n",
+        (instructions[1] / seconds[1]) / (instructions[0] / seconds[0]),
+        (instructions[2] / seconds[2]) / (instructions[0] / seconds[0]),
+        (instructions[3] / seconds[3]) / (instructions[0] / seconds[0]));
+    printf("fusion: %lli of %lli dispatches saved (%.1f%%)\n", fusedAway, instructions[2],
+        instructions[2] ? 100.0 * fusedAway / instructions[2] : 0.0);
+    printf("blocks: %lli translated, %lli entered through a chain, %lli cache flushes\n", translated, chained, flushes);
+
+    if(!agree) {
+        printf("WARNING: engines disagree on the final machine state.\n");
+    }
+    free(reference->out.data);
+    freeMachine(saved);
+    freeMachine(reference);
+    return agree ? 0 : -1;
+}
+
+// Returns 1 if anything is watching this machine's instructions, which means it has to run
+// through the instrumented step loop instead of the threaded stream.
+
+int isObserved(Machine *m) {
+    return m->profile != NULL || m->cache != NULL || m->pipeline != NULL || m->predictor != NULL
+        || m->recorder != NULL;
+}
+
+// Executes one instruction like stepMachine() and reports it to the machine's observers.
+
+int stepObserved(Machine *m) {
+    StepEvent event;
+    TextInstr *t = textAt(m, m->registers[PC]);
+
+    memset(&event, 0, sizeof(StepEvent));
+    event.pc = m->registers[PC];
+    if(t != NULL) {
+        event.opcode = t->opcode;
+        unpackInstr(t, &event.op1, &event.op2, &event.op3);
+        if(event.opcode == LDUR || event.opcode == STUR) {
+            event.address = ADDWRAP(m->registers[event.op2], event.op3);
+        }
+    }
+
+    int exec = stepMachine(m);
+    if(exec == 1) {
+        event.next = m->registers[PC];
+        observeStep(m, &event);
+    }
+    return exec;
+}
+
+// runMachine() for observed machines, one instruction at a time.
+
+int runObserved(Machine *m, long long limit, long long *executed) {
+    long long count = 0;
+    int exec = 1;
+
+    while(count < limit && (exec = stepObserved(m)) == 1) {
+        count++;
+    }
+    if(executed != NULL) {
+        *executed = count;
+    }
+    return exec;
+}
+
+// Hands an executed instruction to every observer attached to the machine.
+
+void observeStep(Machine *m, StepEvent *event) {
+    if(m->profile != NULL) {
+        profileStep(m, m->profile, event);
+    }
+    if(m->cache != NULL && (event->opcode == LDUR || event->opcode == STUR)) {
+        cacheStep(m, m->cache, event);
+    }
+    if(m->predictor != NULL) {
+        predictStep(m, m->predictor, event);       // before the pipeline, which uses its guess
+    }
+    if(m->pipeline != NULL) {
+        pipelineStep(m, m->pipeline, event);
+    }
+    if(m->recorder != NULL) {
+        recordStep(m, m->recorder, event);
+    }
+}
+
+// Writes an instruction back out in the program file's syntax.
+
+void formatInstr(const TextInstr *t, char *text) {
+    char reg1[32], reg2[32], reg3[32];
+    int op1, op2, op3;
+
+    unpackInstr(t, &op1, &op2, &op3);
+    ungetOperand(op1, reg1);
+    ungetOperand(op2, reg2);
+    ungetOperand(op3, reg3);
+
+    switch(t->opcode) {
+        case ADD :  sprintf(text, "ADD %s, %s, %s", reg1, reg2, reg3); break;
+        case SUB :  sprintf(text, "SUB %s, %s, %s", reg1, reg2, reg3); break;
+        case ADDI : sprintf(text, "ADDI %s, %s, #%i", reg1, reg2, op3); break;
+        case SUBI : sprintf(text, "SUBI %s, %s, #%i", reg1, reg2, op3); break;
+        case LSL :  sprintf(text, "LSL %s, %s, #%i", reg1, reg2, op3); break;
+        case LDUR : sprintf(text, "LDUR %s, [%s, #%i]", reg1, reg2, op3); break;
+        case STUR : sprintf(text, "STUR %s, [%s, #%i]", reg1, reg2, op3); break;
+        case CBZ :  sprintf(text, "CBZ %s, %i", reg1, op2); break;
+        case CBNZ : sprintf(text, "CBNZ %s, %i", reg1, op2); break;
+        case BR :   sprintf(text, "BR %s", reg1); break;
+        case BL :   sprintf(text, "BL %i", op1); break;
+        case B :    sprintf(text, "B %i", op1); break;
+        default :   strcpy(text, "(empty)"); break;
+    }
+}
+
+// Allocates an empty profile sized to the machine's text segment.
+
+Profile *newProfile(Machine *m) {
+    Profile *profile = calloc(1, sizeof(Profile));
+
+    profile->counts = calloc(m->textSlots, sizeof(long long));
+    profile->taken = calloc(m->textSlots, sizeof(long long));
+    profile->notTaken = calloc(m->textSlots, sizeof(long long));
+    profile->calls = calloc(m->textSlots, sizeof(long long));
+    profile->nodeCapacity = 64;
+    profile->nodes = calloc(profile->nodeCapacity, sizeof(CallNode));
+    profile->nodes[0].function = STARTMEM;
+    profile->nodes[0].parent = profile->nodes[0].firstChild = profile->nodes[0].nextSibling = -1;
+    profile->nodeCount = 1;
+    return profile;
+}
+
+// Releases a profile.
+
+void freeProfile(Profile *profile) {
+    if(profile == NULL) {
+        return;
+    }
+    free(profile->counts);
+    free(profile->taken);
+    free(profile->notTaken);
+    free(profile->calls);
+    free(profile->nodes);
+    free(profile);
+}
+
+// Records one executed instruction in the profile.
+
+void profileStep(Machine *m, Profile *profile, StepEvent *event) {
+    TextInstr *t = textAt(m, event->pc);
+    long long slot = (t != NULL) ? t - m->text : -1;
+    CallNode *node = &profile->nodes[profile->current];
+
+    profile->total++;
+    node->self++;
+    if(slot < 0) {
+        profile->outside++;
+        return;
+    }
+    profile->counts[slot]++;
+
+    if(event->opcode == CBZ || event->opcode == CBNZ) {
+        if(event->next != event->pc + WORD) {
+            profile->taken[slot]++;
+        } else {
+            profile->notTaken[slot]++;
+        }
+    } else if(event->opcode == BL) {
+        TextInstr *target = textAt(m, event->next);
+        if(target != NULL) {
+            profile->calls[target - m->text]++;
+        }
+
+        int child = node->firstChild;                  // descend to the callee's node
+        while(child >= 0 && profile->nodes[child].function != event->next) {
+            child = profile->nodes[child].nextSibling;
+        }
+        if(child < 0) {
+            if(profile->nodeCount == profile->nodeCapacity) {
+                profile->nodeCapacity *= 2;
+                profile->nodes = realloc(profile->nodes, profile->nodeCapacity * sizeof(CallNode));
+                node = &profile->nodes[profile->current];
+            }
+            child = profile->nodeCount++;
+            profile->nodes[child].function = event->next;
+            profile->nodes[child].parent = profile->current;
+            profile->nodes[child].firstChild = -1;
+            profile->nodes[child].self = 0;
+            profile->nodes[child].nextSibling = node->firstChild;
+            node->firstChild = child;
+        }
+        profile->current = child;
+    } else if(event->opcode == BR && event->op1 == LR && node->parent >= 0) {
+        profile->current = node->parent;               // return to the caller's node
+    }
+}
+
+// qsort() comparison putting the busiest text slots first. The counts come in through
+// sortCounts since qsort() has no context argument; it is only used under reportProfile().
+
+static const long long *sortCounts;
+
+int compareCounts(const void *a, const void *b) {
+    long long x = sortCounts[*(const int *) a], y = sortCounts[*(const int *) b];
+    return (x < y) - (x > y);
+}
+
+// Prints the profile: the most executed instructions, every conditional branch, every call
+// target, and the hottest loops (taken backward branches, with the work done inside them).
+
+void reportProfile(Machine *m) {
+    static pthread_mutex_t sortLock = PTHREAD_MUTEX_INITIALIZER;
+    Profile *profile = m->profile;
+    int *order = malloc(m->textSlots * sizeof(int)), shown;
+    char text[64];
+
+    for(int i = 0; i < m->textSlots; i++) {
+        order[i] = i;
+    }
+    pthread_mutex_lock(&sortLock);
+    sortCounts = profile->counts;
+    qsort(order, m->textSlots, sizeof(int), compareCounts);
+    pthread_mutex_unlock(&sortLock);
+
+    outPrintf(&m->out, "\nProfile: %lli instructions", profile->total);
+    if(profile->outside) {
+        outPrintf(&m->out, " (%lli outside the text segment)", profile->outside);
+    }
+    outPrintf(&m->out, "\n\nHot spots:\n%14s %7s %8s  %s\n", "count", "%", "PC", "instruction");
+    for(shown = 0; shown < 20 && shown < m->textSlots && profile->counts[order[shown]]; shown++) {
+        int slot = order[shown];
+        formatInstr(&m->text[slot], text);
+        outPrintf(&m->out, "%14lli %6.2f%% %8i  %s\n", profile->counts[slot],
+            100.0 * profile->counts[slot] / profile->total, m->textBase + slot * WORD, text);
+    }
+
+    outPrintf(&m->out, "\nConditional branches:\n%8s %14s %14s  %s\n", "PC", "taken", "not taken", "instruction");
+    for(int slot = 0; slot < m->textSlots; slot++) {
+        if(profile->taken[slot] || profile->notTaken[slot]) {
+            formatInstr(&m->text[slot], text);
+            outPrintf(&m->out, "%8i %14lli %14lli  %s\n", m->textBase + slot * WORD,
+                profile->taken[slot], profile->notTaken[slot], text);
+        }
+    }
+
+    outPrintf(&m->out, "\nCalls:\n%8s %14s\n", "target", "calls");
+    for(int slot = 0; slot < m->textSlots; slot++) {
+        if(profile->calls[slot]) {
+            outPrintf(&m->out, "%8i %14lli\n", m->textBase + slot * WORD, profile->calls[slot]);
+        }
+    }
+
+    // a loop is a branch back to an earlier address; its body runs from the target to the branch
+    outPrintf(&m->out, "\nHot loops:\n%8s %8s %14s %14s\n", "start", "end", "iterations", "instructions");
+    shown = 0;
+    for(int i = 0; i < m->textSlots && profile->counts[order[i]]; i++) {
+        int slot = order[i], opcode = m->text[slot].opcode, op1, op2, op3, target;
+        unpackInstr(&m->text[slot], &op1, &op2, &op3);
+        target = (opcode == B) ? op1 : (opcode == CBZ || opcode == CBNZ) ? op2 : INT_MAX;
+        long long iterations = (opcode == B) ? profile->counts[slot] : profile->taken[slot];
+        TextInstr *start = textAt(m, target);
+
+        if(start != NULL && start - m->text <= slot && iterations) {
+            long long work = 0;
+            for(int j = start - m->text; j <= slot; j++) {
+                work += profile->counts[j];
+            }
+            outPrintf(&m->out, "%8i %8i %14lli %14lli\n", target, m->textBase + slot * WORD, iterations, work);
+            if(++shown == 10) {
+                break;
+            }
+        }
+    }
+    free(order);
+}
+
+// Writes one folded-stack line per call path that executed instructions, naming each function
+// by its entry address. Returns -1 if the file cannot be written.
+
+int writeFolded(Machine *m, char *path) {
+    Profile *profile = m->profile;
+    FILE *file = fopen(path, "w");
+    int *chain = malloc(profile->nodeCount * sizeof(int));
+
+    if(file == NULL) {
+        free(chain);
+        return -1;
+    }
+    for(int n = 0; n < profile->nodeCount; n++) {
+        if(profile->nodes[n].self == 0) {
+            continue;
+        }
+        int depth = 0;
+        for(int up = n; up >= 0; up = profile->nodes[up].parent) {
+            chain[depth++] = up;
+        }
+        for(int d = depth - 1; d >= 0; d--) {
+            if(chain[d] == 0) {
+                fprintf(file, "main");
+            } else {
+                fprintf(file, ";f%i", profile->nodes[chain[d]].function);
+            }
+        }
+        fprintf(file, " %lli\n", profile->nodes[n].self);
+    }
+    free(chain);
+    return fclose(file);
+}
+
+// Reads one cache level from "SIZE:WAYS:LINE[:lru|random]", where SIZE may end in K or M.
+// The line size and the resulting number of sets must be powers of two. Returns -1 if the
+// text does not describe a usable cache.
+
+int parseCacheConfig(char *text, CacheConfig *config) {
+    char *end, policy[16] = "lru";
+
+    config->size = strtoll(text, &end, 0);
+    if(*end == 'K' || *end == 'k') {
+        config->size <<= 10;
+        end++;
+    } else if(*end == 'M' || *end == 'm') {
+        config->size <<= 20;
+        end++;
+    }
+    if(sscanf(end, ":%d:%d:%15s", &config->assoc, &config->line, policy) < 2) {
+        return -1;
+    }
+    config->policy = (strcmp(policy, "random") == 0) ? CACHE_RANDOM : CACHE_LRU;
+    if(strcmp(policy, "lru") != 0 && config->policy != CACHE_RANDOM) {
+        return -1;
+    }
+
+    if(config->assoc < 1 || config->line < WORD || (config->line & (config->line - 1))
+       || config->size < (long long) config->assoc * config->line || config->size > (1LL << 32)) {
+        return -1;
+    }
+    long long sets = config->size / ((long long) config->assoc * config->line);
+    if((sets & (sets - 1)) || sets * config->assoc * config->line != config->size) {
+        return -1;
+    }
+    return 0;
+}
+
+// Allocates the empty cache hierarchy described by the run options.
+
+Cache *newCache(Machine *m, const RunOptions *options) {
+    Cache *cache = calloc(1, sizeof(Cache));
+
+    cache->count = options->cacheLevels;
+    for(int i = 0; i < cache->count; i++) {
+        CacheLevel *level = &cache->levels[i];
+        long long ways;
+
+        level->config = options->cache[i];
+        level->sets = level->config.size / ((long long) level->config.assoc * level->config.line);
+        while((1 << level->lineBits) < level->config.line) {
+            level->lineBits++;
+        }
+        ways = (long long) level->sets * level->config.assoc;
+        level->tags = malloc(ways * sizeof(unsigned long long));
+        level->used = calloc(ways, sizeof(unsigned long long));
+        for(long long w = 0; w < ways; w++) {
+            level->tags[w] = NOLINE;
+        }
+        level->seed = 0x2545F4914F6CDD1DULL + i;     // fixed, so random replacement is repeatable
+        level->slotHits = calloc(m->textSlots, sizeof(long long));
+        level->slotMisses = calloc(m->textSlots, sizeof(long long));
+    }
+    return cache;
+}
+
+// Releases a cache hierarchy.
+
+void freeCache(Cache *cache) {
+    if(cache == NULL) {
+        return;
+    }
+    for(int i = 0; i < cache->count; i++) {
+        free(cache->levels[i].tags);
+        free(cache->levels[i].used);
+        free(cache->levels[i].slotHits);
+        free(cache->levels[i].slotMisses);
+    }
+    free(cache);
+}
+
+// Looks a line up in one level, filling it on a miss: into an empty way if the set has one,
+// otherwise over the least recently used or a random way. Returns 1 on a hit.
+
+int cacheLookup(CacheLevel *level, unsigned long long line) {
+    int assoc = level->config.assoc, victim = 0;
+    unsigned long long *tags = &level->tags[(line & (level->sets - 1)) * assoc];
+    unsigned long long *used = &level->used[(line & (level->sets - 1)) * assoc];
+
+    level->clock++;
+    for(int w = 0; w < assoc; w++) {
+        if(tags[w] == line) {
+            used[w] = level->clock;
+            return 1;
+        }
+    }
+
+    if(level->config.policy == CACHE_RANDOM) {
+        level->seed ^= level->seed << 13;             // xorshift64
+        level->seed ^= level->seed >> 7;
+        level->seed ^= level->seed << 17;
+        victim = level->seed % assoc;
+    }
+    for(int w = 0; w < assoc; w++) {
+        if(tags[w] == NOLINE) {
+            victim = w;
+            break;
+        }
+        if(level->config.policy == CACHE_LRU && used[w] < used[victim]) {
+            victim = w;
+        }
+    }
+    tags[victim] = line;
+    used[victim] = level->clock;
+    return 0;
+}
+
+// Sends length bytes at address to the given level, one line at a time, and fetches every
+// line that misses through the level below. slot is the accessing instruction's text slot,
+// or -1 if it ran outside the text segment.
+
+void cacheTouch(Cache *cache, int level, unsigned long long address, int length, long long slot) {
+    CacheLevel *c = &cache->levels[level];
+    unsigned long long first = address >> c->lineBits;
+    unsigned long long last = (address + length - 1) >> c->lineBits;
+
+    for(unsigned long long line = first; ; line++) {
+        if(cacheLookup(c, line)) {
+            c->hits++;
+            if(slot >= 0) {
+                c->slotHits[slot]++;
+            }
+        } else {
+            c->misses++;
+            if(slot >= 0) {
+                c->slotMisses[slot]++;
+            }
+            if(level + 1 < cache->count) {
+                cacheTouch(cache, level + 1, line << c->lineBits, c->config.line, slot);
+            }
+        }
+        if(line == last) {
+            break;
+        }
+    }
+}
+
+// Runs the doubleword an executed LDUR/STUR accessed through the cache.
+
+void cacheStep(Machine *m, Cache *cache, StepEvent *event) {
+    TextInstr *t = textAt(m, event->pc);
+
+    cacheTouch(cache, 0, event->address, DOUBLEWORD, (t != NULL) ? t - m->text : -1);
+}
+
+// Prints the hits, misses and miss rate of every cache level, in total and for each LDUR/STUR
+// that accessed memory. Miss rates are local: a level's misses over the accesses that reached it.
+
+void reportCache(Machine *m) {
+    Cache *cache = m->cache;
+    char text[64];
+
+    outPrintf(&m->out, "\nData cache:\n%5s %10s %5s %5s %7s %14s %14s %14s %10s\n",
+        "level", "size", "ways", "line", "policy", "accesses", "hits", "misses", "miss rate");
+    for(int i = 0; i < cache->count; i++) {
+        CacheLevel *c = &cache->levels[i];
+        long long accesses = c->hits + c->misses;
+        outPrintf(&m->out, "   L%i %10lli %5i %5i %7s %14lli %14lli %14lli %9.2f%%\n", i + 1,
+            c->config.size, c->config.assoc, c->config.line,
+            (c->config.policy == CACHE_LRU) ? "LRU" : "random", accesses, c->hits, c->misses,
+            accesses ? 100.0 * c->misses / accesses : 0.0);
+    }
+
+    outPrintf(&m->out, "\nPer instruction:\n%8s  %-24s", "PC", "instruction");
+    for(int i = 0; i < cache->count; i++) {
+        outPrintf(&m->out, " %11s%i %11s%i %7s%i", "hits L", i + 1, "misses L", i + 1, "miss% L", i + 1);
+    }
+    outPrintf(&m->out, "\n");
+    for(int slot = 0; slot < m->textSlots; slot++) {
+        if(cache->levels[0].slotHits[slot] + cache->levels[0].slotMisses[slot] == 0) {
+            continue;
+        }
+        formatInstr(&m->text[slot], text);
+        outPrintf(&m->out, "%8i  %-24s", m->textBase + slot * WORD, text);
+        for(int i = 0; i < cache->count; i++) {
+            long long hits = cache->levels[i].slotHits[slot], misses = cache->levels[i].slotMisses[slot];
+            outPrintf(&m->out, " %12lli %12lli %7.2f%%", hits, misses,
+                (hits + misses) ? 100.0 * misses / (hits + misses) : 0.0);
+        }
+        outPrintf(&m->out, "\n");
+    }
+}
+
+// Allocates an empty pipeline model for the machine's text segment.
+
+Pipeline *newPipeline(Machine *m, int forwarding) {
+    Pipeline *pipe = calloc(1, sizeof(Pipeline));
+
+    pipe->forwarding = forwarding;
+    pipe->nextEx = 3;                            // the first instruction is fetched in cycle 1
+    pipe->slotCount = calloc(m->textSlots, sizeof(long long));
+    pipe->slotData = calloc(m->textSlots, sizeof(long long));
+    pipe->slotControl = calloc(m->textSlots, sizeof(long long));
+    return pipe;
+}
+
+// Releases a pipeline model.
+
+void freePipeline(Pipeline *pipe) {
+    if(pipe == NULL) {
+        return;
+    }
+    free(pipe->slotCount);
+    free(pipe->slotData);
+    free(pipe->slotControl);
+    free(pipe);
+}
+
+// Lists the registers an instruction reads and the one it writes. Sources needed by the MEM
+// stage rather than EX (the data register of STUR) are flagged in late. Returns the number of
+// sources; *dest is -1 if nothing is written.
+
+int pipelineOperands(StepEvent *event, int *sources, int *late, int *dest) {
+    int count = 0;
+
+    *dest = -1;
+    switch(event->opcode) {
+        case ADD :
+        case SUB :
+            sources[count] = event->op2; late[count++] = 0;
+            sources[count] = event->op3; late[count++] = 0;
+            *dest = event->op1;
+            break;
+        case ADDI :
+        case SUBI :
+        case LSL :
+        case LDUR :
+            sources[count] = event->op2; late[count++] = 0;
+            *dest = event->op1;
+            break;
+        case STUR :
+            sources[count] = event->op2; late[count++] = 0;
+            sources[count] = event->op1; late[count++] = 1;
+            break;
+        case CBZ :
+        case CBNZ :
+        case BR :
+            sources[count] = event->op1; late[count++] = 0;
+            break;
+        case BL :
+            *dest = LR;
+            break;
+    }
+    if(*dest == XZR) {
+        *dest = -1;
+    }
+    return count;
+}
+
+// Times one executed instruction. Each instruction enters EX the cycle after the one before it
+// unless one of its sources is not ready yet (a stall) or the one before it redirected fetch
+// (a branch penalty). Stalls are charged to the instruction that waits, penalties to the branch.
+
+void pipelineStep(Machine *m, Pipeline *pipe, StepEvent *event) {
+    TextInstr *t = textAt(m, event->pc);
+    long long slot = (t != NULL) ? t - m->text : -1;
+    long long ex = pipe->nextEx, stall = 0, penalty = 0;
+    int sources[2], late[2], dest, loadStall = 0;
+    int count = pipelineOperands(event, sources, late, &dest);
+
+    for(int i = 0; i < count; i++) {
+        int r = sources[i];
+        long long need = pipe->ready[r] - late[i];  // EX cycle this source allows
+        if(r != XZR && need > ex + stall) {
+            stall = need - ex;
+            loadStall = pipe->fromLoad[r];
+        }
+    }
+    ex += stall;
+    if(loadStall && pipe->forwarding) {
+        pipe->loadUse += stall;
+    } else {
+        pipe->dataStalls += stall;
+    }
+
+    if(dest >= 0) {
+        if(pipe->forwarding) {              // ALU results forward from EX/MEM, loads from MEM/WB
+            pipe->ready[dest] = ex + ((event->opcode == LDUR) ? 2 : 1);
+        } else {                            // written in WB, read in ID the same cycle
+            pipe->ready[dest] = ex + 3;
+        }
+        pipe->fromLoad[dest] = (event->opcode == LDUR);
+    }
+
+    switch(event->opcode) {
+        case CBZ :
+        case CBNZ :                         // resolved in EX; a predicted taken branch jumps from ID
+            if(m->predictor == NULL) {
+                penalty = (event->next != event->pc + WORD) ? BRANCHPENALTY : 0;
+            } else {
+                penalty = !m->predictor->guessRight ? BRANCHPENALTY : m->predictor->guessTaken ? JUMPPENALTY : 0;
+            }
+            pipe->branchStalls += penalty;
+            break;
+        case B :
+        case BL :                           // target known once decoded
+            penalty = JUMPPENALTY;
+            pipe->jumpStalls += penalty;
+            break;
+        case BR :                           // target register read in EX, unless the return stack knew it
+            penalty = (m->predictor != NULL && m->predictor->guessRight) ? 0 : BRANCHPENALTY;
+            pipe->jumpStalls += penalty;
+            break;
+    }
+
+    pipe->instructions++;
+    pipe->nextEx = ex + 1 + penalty;
+    if(slot >= 0) {
+        pipe->slotCount[slot]++;
+        pipe->slotData[slot] += stall;
+        pipe->slotControl[slot] += penalty;
+    }
+}
+
+// Prints the cycle count, CPI and where the stall cycles went, overall and per instruction.
+
+void reportPipeline(Machine *m) {
+    Pipeline *pipe = m->pipeline;
+    long long cycles = pipe->instructions ? pipe->nextEx + 1 : 0;   // WB of the last one, after any redirect
+    char text[64];
+
+    outPrintf(&m->out, "\nPipeline (IF/ID/EX/MEM/WB, forwarding %s):\n", pipe->forwarding ? "on" : "off");
+    outPrintf(&m->out, "%14lli cycles\n%14lli instructions\n%14.3f CPI\n", cycles, pipe->instructions,
+        pipe->instructions ? (double) cycles / pipe->instructions : 0.0);
+    outPrintf(&m->out, "%14lli load-use stall cycles\n", pipe->loadUse);
+    outPrintf(&m->out, "%14lli data hazard stall cycles\n", pipe->dataStalls);
+    outPrintf(&m->out, "%14lli conditional branch penalty cycles (CBZ/CBNZ)\n", pipe->branchStalls);
+    outPrintf(&m->out, "%14lli jump penalty cycles (B/BL/BR)\n", pipe->jumpStalls);
+    outPrintf(&m->out, "%14i fill cycles\n", pipe->instructions ? 4 : 0);
+
+    outPrintf(&m->out, "\nPer instruction:\n%8s  %-24s %14s %12s %12s %8s\n", "PC", "instruction",
+        "executions", "data stalls", "control", "CPI");
+    for(int slot = 0; slot < m->textSlots; slot++) {
+        if(pipe->slotCount[slot] == 0) {
+            continue;
+        }
+        formatInstr(&m->text[slot], text);
+        outPrintf(&m->out, "%8i  %-24s %14lli %12lli %12lli %8.3f\n", m->textBase + slot * WORD, text,
+            pipe->slotCount[slot], pipe->slotData[slot], pipe->slotControl[slot],
+            1.0 + (double) (pipe->slotData[slot] + pipe->slotControl[slot]) / pipe->slotCount[slot]);
+    }
+}
+
+// Reads a comma-separated list of predictors ("nottaken", "2bit", "gshare", "ras" or "all") into
+// the run options. Returns -1 on an unknown name.
+
+int parsePredictors(char *text, RunOptions *options) {
+    char list[128], *name, *rest;
+
+    snprintf(list, sizeof(list), "%s", text);
+    for(name = strtok_r(list, ",", &rest); name != NULL; name = strtok_r(NULL, ",", &rest)) {
+        int scheme = -1;
+        for(int s = 0; s < NUMSCHEMES; s++) {
+            if(strcmp(name, SCHEME_NAMES[s]) == 0) {
+                scheme = s;
+            }
+        }
+        if(scheme >= 0) {
+            if(options->predict == 0) {
+                options->primaryScheme = scheme;
+            }
+            options->predict |= 1 << scheme;
+        } else if(strcmp(name, "ras") == 0 || strcmp(name, "all") == 0) {
+            options->rasDepth = options->rasDepth ? options->rasDepth : RASDEPTH;
+            options->predict |= (name[0] == 'a') ? (1 << NUMSCHEMES) - 1 : 0;
+        } else {
+            return -1;
+        }
+    }
+    if(options->predict == 0) {                  // only "ras": compare every direction scheme
+        options->predict = (1 << NUMSCHEMES) - 1;
+    }
+    return 0;
+}
+
+// Allocates the predictors chosen in the run options, with every counter weakly not taken.
+
+Predictor *newPredictor(Machine *m, const RunOptions *options) {
+    Predictor *p = calloc(1, sizeof(Predictor));
+    int entries = 1 << options->predictBits;
+
+    p->enabled = options->predict;
+    p->primary = options->primaryScheme;
+    p->bits = options->predictBits;
+    p->bimodal = malloc(entries);
+    p->gshare = malloc(entries);
+    memset(p->bimodal, 1, entries);
+    memset(p->gshare, 1, entries);
+    p->depth = options->rasDepth;
+    p->stack = calloc(p->depth + 1, sizeof(long long));
+    p->slotCount = calloc(m->textSlots, sizeof(long long));
+    p->slotTaken = calloc(m->textSlots, sizeof(long long));
+    p->slotCorrect = calloc((long long) m->textSlots * NUMSCHEMES, sizeof(long long));
+    return p;
+}
+
+// Releases a set of predictors.
+
+void freePredictor(Predictor *p) {
+    if(p == NULL) {
+        return;
+    }
+    free(p->bimodal);
+    free(p->gshare);
+    free(p->stack);
+    free(p->slotCount);
+    free(p->slotTaken);
+    free(p->slotCorrect);
+    free(p);
+}
+
+// Moves a 2-bit saturating counter towards the branch's outcome.
+
+void trainCounter(unsigned char *counter, int taken) {
+    if(taken && *counter < 3) {
+        (*counter)++;
+    } else if(!taken && *counter > 0) {
+        (*counter)--;
+    }
+}
+
+// Predicts one executed branch with every enabled scheme, scores the guesses against where
+// execution actually went, and trains the predictors. CBZ/CBNZ directions come from the
+// scheme; B and BL are direct and always right. BR LR is predicted by the return-address
+// stack when there is one, and any other BR is a miss.
+
+void predictStep(Machine *m, Predictor *p, StepEvent *event) {
+    TextInstr *t = textAt(m, event->pc);
+    long long slot = (t != NULL) ? t - m->text : -1;
+    int right[NUMSCHEMES], guess[NUMSCHEMES], taken = 1;
+
+    switch(event->opcode) {
+        case CBZ :
+        case CBNZ : {
+            unsigned long long mask = (1ULL << p->bits) - 1;
+            unsigned char *counter = &p->bimodal[((unsigned long long) event->pc >> 2) & mask];
+            unsigned char *global = &p->gshare[(((unsigned long long) event->pc >> 2) ^ p->history) & mask];
+
+            taken = (event->next != event->pc + WORD);
+            guess[PREDICT_NOTTAKEN] = 0;
+            guess[PREDICT_BIMODAL] = (*counter >= 2);
+            guess[PREDICT_GSHARE] = (*global >= 2);
+            for(int s = 0; s < NUMSCHEMES; s++) {
+                right[s] = (guess[s] == taken);
+                p->conditionalCorrect[s] += right[s];
+            }
+            trainCounter(counter, taken);
+            trainCounter(global, taken);
+            p->history = (p->history << 1) | taken;
+            p->conditional++;
+            p->taken += taken;
+            if(slot >= 0) {
+                p->slotTaken[slot] += taken;
+            }
+            p->guessTaken = guess[p->primary];
+            break;
+        }
+        case BL :
+            if(p->depth > 0) {                   // push the return address, dropping the oldest
+                p->stack[p->top] = event->pc + WORD;
+                p->top = (p->top + 1) % p->depth;
+                p->size += (p->size < p->depth);
+            }
+            // fall through
+        case B :
+            for(int s = 0; s < NUMSCHEMES; s++) {
+                right[s] = 1;
+            }
+            p->guessTaken = 1;
+            break;
+        case BR : {
+            int hit = 0;
+            if(event->op1 == LR && p->depth > 0) {
+                if(p->size > 0) {
+                    p->top = (p->top + p->depth - 1) % p->depth;
+                    p->size--;
+                    hit = (p->stack[p->top] == event->next);
+                }
+                p->returns++;
+                p->returnsCorrect += hit;
+            }
+            for(int s = 0; s < NUMSCHEMES; s++) {
+                right[s] = hit;
+            }
+            p->guessTaken = hit;
+            break;
+        }
+        default :
+            return;
+    }
+
+    p->branches++;
+    for(int s = 0; s < NUMSCHEMES; s++) {
+        p->correct[s] += right[s];
+        if(slot >= 0) {
+            p->slotCorrect[slot * NUMSCHEMES + s] += right[s];
+        }
+    }
+    if(slot >= 0) {
+        p->slotCount[slot]++;
+    }
+    p->guessRight = right[p->primary];
+}
+
+// Prints how often each enabled scheme predicted right, overall and for each branch.
+
+void reportPredictor(Machine *m) {
+    Predictor *p = m->predictor;
+    char text[64];
+
+    outPrintf(&m->out, "\nBranch prediction: %lli branches, %lli conditional (%.2f%% taken)",
+        p->branches, p->conditional, p->conditional ? 100.0 * p->taken / p->conditional : 0.0);
+    if(p->depth > 0) {
+        outPrintf(&m->out, ", %lli returns, %.2f%% predicted by a %i-entry return stack",
+            p->returns, p->returns ? 100.0 * p->returnsCorrect / p->returns : 0.0, p->depth);
+    }
+    outPrintf(&m->out, "\n%-10s %10s %12s\n", "scheme", "overall", "conditional");
+    for(int s = 0; s < NUMSCHEMES; s++) {
+        if(p->enabled & (1 << s)) {
+            outPrintf(&m->out, "%-10s %9.2f%% %11.2f%%\n", SCHEME_NAMES[s],
+                p->branches ? 100.0 * p->correct[s] / p->branches : 0.0,
+                p->conditional ? 100.0 * p->conditionalCorrect[s] / p->conditional : 0.0);
+        }
+    }
+
+    outPrintf(&m->out, "\nPer branch:\n%8s  %-24s %14s %8s", "PC", "instruction", "executions", "taken");
+    for(int s = 0; s < NUMSCHEMES; s++) {
+        if(p->enabled & (1 << s)) {
+            outPrintf(&m->out, " %9s", SCHEME_NAMES[s]);
+        }
+    }
+    outPrintf(&m->out, "\n");
+    for(int slot = 0; slot < m->textSlots; slot++) {
+        long long count = p->slotCount[slot];
+        if(count == 0) {
+            continue;
+        }
+        formatInstr(&m->text[slot], text);
+        outPrintf(&m->out, "%8i  %-24s %14lli", m->textBase + slot * WORD, text, count);
+        if(m->text[slot].opcode == CBZ || m->text[slot].opcode == CBNZ) {
+            outPrintf(&m->out, " %7.2f%%", 100.0 * p->slotTaken[slot] / count);
+        } else {
+            outPrintf(&m->out, " %8s", "-");
+        }
+        for(int s = 0; s < NUMSCHEMES; s++) {
+            if(p->enabled & (1 << s)) {
+                outPrintf(&m->out, " %8.2f%%", 100.0 * p->slotCorrect[slot * NUMSCHEMES + s] / count);
+            }
+        }
+        outPrintf(&m->out, "\n");
+    }
+}
+
+// Starts recording the machine's execution to the trace file at path. The trace opens with a
+// snapshot of the machine as it is now, written before the writer thread starts. Returns
+// NULL if the file cannot be written.
+
+Recorder *newRecorder(Machine *m, char *path) {
+    static const unsigned char zeros[PAGESIZE];
+    int version = TRACEVERSION;
+    FILE *file = fopen(path, "wb");
+
+    if(file == NULL) {
+        return NULL;
+    }
+    fwrite(TRACEMAGIC, 1, strlen(TRACEMAGIC), file);
+    fwrite(&version, sizeof(int), 1, file);
+    fwrite(zeros, 1, PAGESIZE - strlen(TRACEMAGIC) - sizeof(int), file);
+    putSnapshot(m, file, m->restoredAt);
+    if(ferror(file)) {
+        fclose(file);
+        return NULL;
+    }
+
+    Recorder *r = calloc(1, sizeof(Recorder));
+    r->file = file;
+    r->ring = malloc(RINGSIZE);
+    memcpy(r->shadow, m->registers, sizeof(m->registers));
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->ready, NULL);
+    pthread_cond_init(&r->space, NULL);
+    pthread_create(&r->writer, NULL, recordWriter, r);
+    return r;
+}
+
+// Writer thread: copies whatever the ring holds out to the file until the recorder is closed
+// and the ring is empty.
+
+void *recordWriter(void *arg) {
+    Recorder *r = arg;
+
+    pthread_mutex_lock(&r->lock);
+    for(;;) {
+        while(r->head == r->tail && !r->closed) {
+            pthread_cond_wait(&r->ready, &r->lock);
+        }
+        if(r->head == r->tail) {
+            break;
+        }
+        size_t at = r->tail % RINGSIZE, n = r->head - r->tail;
+        n = (n < RINGSIZE - at) ? n : RINGSIZE - at;
+        pthread_mutex_unlock(&r->lock);
+
+        r->failed |= (fwrite(r->ring + at, 1, n, r->file) != n);
+
+        pthread_mutex_lock(&r->lock);
+        r->tail += n;
+        pthread_cond_signal(&r->space);
+    }
+    pthread_mutex_unlock(&r->lock);
+    return NULL;
+}
+
+// Moves the recorder's chunk into the ring, waiting for the writer only if the ring is full.
+
+void flushChunk(Recorder *r) {
+    int done = 0;
+
+    pthread_mutex_lock(&r->lock);
+    while(done < r->length) {
+        while(r->head - r->tail == RINGSIZE) {
+            r->stalls++;
+            pthread_cond_wait(&r->space, &r->lock);
+        }
+        size_t at = r->head % RINGSIZE, n = r->length - done;
+        n = (n < RINGSIZE - (r->head - r->tail)) ? n : RINGSIZE - (r->head - r->tail);
+        n = (n < RINGSIZE - at) ? n : RINGSIZE - at;
+        pthread_mutex_unlock(&r->lock);
+
+        memcpy(r->ring + at, r->chunk + done, n);   // the writer keeps clear of [head, tail + RINGSIZE)
+        done += n;
+
+        pthread_mutex_lock(&r->lock);
+        r->head += n;
+        pthread_cond_signal(&r->ready);
+    }
+    pthread_mutex_unlock(&r->lock);
+    r->bytes += r->length;
+    r->length = 0;
+}
+
+// Appends value to the chunk as a zigzag varint, so small deltas of either sign take one byte.
+
+void putDelta(Recorder *r, long long value) {
+    unsigned long long v = ((unsigned long long) value << 1) ^ (unsigned long long) (value >> 63);
+
+    while(v >= 0x80) {
+        r->chunk[r->length++] = (unsigned char) (v | 0x80);
+        v >>= 7;
+    }
+    r->chunk[r->length++] = (unsigned char) v;
+}
+
+// Reads a value written by putDelta(), or returns 0 with p set to NULL if the trace ends first.
+
+long long getDelta(const unsigned char **p, const unsigned char *end) {
+    unsigned long long v = 0;
+
+    for(int shift = 0; *p < end && shift < 64; shift += 7) {
+        unsigned char byte = *(*p)++;
+        v |= (unsigned long long) (byte & 0x7f) << shift;
+        if(byte < 0x80) {
+            return (long long) (v >> 1) ^ -(long long) (v & 1);
+        }
+    }
+    *p = NULL;
+    return 0;
+}
+
+// Returns the trace's code for an opcode: its index in TRACEOPCODES, or 0 if it is not there.
+
+int traceOpcode(int opcode) {
+    for(int i = 1; i < TAGEND; i++) {
+        if(TRACEOPCODES[i] == opcode) {
+            return i;
+        }
+    }
+    return 0;
+}
+
+// Records one executed instruction as a tag byte holding the opcode's code and flags for what
+// follows, then as needed: the register written and its value as a delta from its last recorded
+// value; the LDUR/STUR address and the value moved as deltas from the last ones; and where
+// execution went, as a delta from the next instruction. The PC itself is never stored, since
+// each step starts where the last one went.
+
+void recordStep(Machine *m, Recorder *r, StepEvent *event) {
+    int tag = traceOpcode(event->opcode), reg = -1;
+
+    switch(event->opcode) {
+        case ADD : case ADDI : case SUB : case SUBI : case LSL : reg = event->op1; break;
+        case BL :  reg = LR; break;
+    }
+    tag |= (reg >= 0) ? TAG_REGISTER : 0;
+    tag |= (event->opcode == LDUR || event->opcode == STUR) ? TAG_MEMORY : 0;
+    tag |= (event->next != event->pc + WORD) ? TAG_JUMP : 0;
+
+    r->chunk[r->length++] = tag;
+    if(reg >= 0) {
+        r->chunk[r->length++] = reg;
+        putDelta(r, SUBWRAP(m->registers[reg], r->shadow[reg]));
+        r->shadow[reg] = m->registers[reg];
+    }
+    if(tag & TAG_MEMORY) {
+        long long value = m->registers[event->op1];       // loaded into it, or stored from it
+        putDelta(r, SUBWRAP(event->address, r->lastAddress));
+        putDelta(r, SUBWRAP(value, r->lastValue));
+        r->lastAddress = event->address;
+        r->lastValue = value;
+        if(event->opcode == LDUR) {
+            r->shadow[event->op1] = value;
+        }
+    }
+    if(tag & TAG_JUMP) {
+        putDelta(r, SUBWRAP(event->next, event->pc + WORD));
+    }
+    r->steps++;
+    if(r->length > RECORDCHUNK - MAXRECORD) {
+        flushChunk(r);
+    }
+}
+
+// Ends the trace with how the run finished, waits for the writer to drain the ring and closes
+// the file. Returns -1 if any of the trace could not be written.
+
+int closeRecorder(Recorder *r, int exec) {
+    if(r == NULL) {
+        return 0;
+    }
+    r->chunk[r->length++] = TAGEND;
+    putDelta(r, exec);
+    flushChunk(r);
+
+    pthread_mutex_lock(&r->lock);
+    r->closed = 1;
+    pthread_cond_signal(&r->ready);
+    pthread_mutex_unlock(&r->lock);
+    pthread_join(r->writer, NULL);
+
+    int failed = r->failed | ferror(r->file);
+    failed |= (fclose(r->file) != 0);
+    pthread_mutex_destroy(&r->lock);
+    pthread_cond_destroy(&r->ready);
+    pthread_cond_destroy(&r->space);
+    free(r->ring);
+    free(r);
+    return failed ? -1 : 0;
+}
+
+// Rebuilds a recorded run from its trace without executing anything: the machine starts from
+// the snapshot at the head of the trace, and each record's register and memory writes and
+// jump are applied in turn. Output follows runHeadless(), so TRACE_FULL renders the same
+// step-by-step output the run would have printed, and a limit stops the replay at that step
+// to show the state there. A run that failed has its failing instruction executed again at
+// the end, to report the failure as it happened. Returns the exit status for main().
+
+int replayTrace(Machine *m, char *file, const RunOptions *options) {
+    struct stat info;
+    long long shadow[REGISTERSPACE], address = 0, value = 0, executed = 0, limit = options->limit, startingPC;
+    int fd = open(file, O_RDONLY), exec = 1, trace = options->trace;
+    unsigned char *image = MAP_FAILED;
+
+    if(fd >= 0 && fstat(fd, &info) == 0) {
+        image = mmap(NULL, info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    }
+    if(fd >= 0) {
+        close(fd);
+    }
+    if(image == MAP_FAILED) {
+        printf("Could not read %s.\n", file);
+        return -1;
+    }
+    long long used = -1;
+    if(info.st_size < PAGESIZE || memcmp(image, TRACEMAGIC, strlen(TRACEMAGIC)) != 0) {
+        printf("%s is not an execution trace.\n", file);
+    } else if(*(int *) (image + strlen(TRACEMAGIC)) != TRACEVERSION) {
+        printf("%s is a version %i trace; this emulator reads version %i.\n", file,
+            *(int *) (image + strlen(TRACEMAGIC)), TRACEVERSION);
+    } else {
+        used = useSnapshot(m, image + PAGESIZE, info.st_size - PAGESIZE, 1, file);
+    }
+    if(used < 0) {
+        munmap(image, info.st_size);
+        return -1;
+    }
+    m->image = image;
+    m->imageSize = info.st_size;
+    m->name = strdup(file);
+    decodeProgram(m);
+    memcpy(shadow, m->registers, sizeof(shadow));
+
+    const unsigned char *p = image + PAGESIZE + used, *end = image + info.st_size;
+    while(executed < limit) {
+        if(p >= end) {
+            p = NULL;
+            break;
+        }
+        int tag = *p++;
+        if((tag & TAG_OPCODE) == TAGEND) {
+            exec = (int) getDelta(&p, end);
+            break;
+        }
+
+        TextInstr *t = textAt(m, m->registers[PC]);
+        if((tag & TAG_OPCODE) != traceOpcode(t ? t->opcode : 0) || ((tag & TAG_REGISTER) && p >= end)) {
+            p = NULL;
+            break;
+        }
+        startingPC = m->registers[PC];
+        if(tag & TAG_REGISTER) {
+            int reg = *p++ & (REGISTERSPACE - 1);
+            shadow[reg] = ADDWRAP(shadow[reg], getDelta(&p, end));
+            m->registers[reg] = shadow[reg];
+        }
+        if(p != NULL && (tag & TAG_MEMORY)) {
+            int op1, op2, op3;
+            unpackInstr(t, &op1, &op2, &op3);
+            address = ADDWRAP(address, getDelta(&p, end));
+            value = ADDWRAP(value, getDelta(&p, end));
+            if(t->opcode == LDUR) {
+                m->registers[op1] = shadow[op1] = value;
+            } else {
+                storeDouble(m, address, value);
+            }
+        }
+        m->registers[PC] = ADDWRAP(startingPC + WORD, (p != NULL && (tag & TAG_JUMP)) ? getDelta(&p, end) : 0);
+        if(p == NULL) {
+            break;
+        }
+        executed++;
+        if(trace == TRACE_FULL) {
+            outPrintf(&m->out, "\n");
+            outputResult(m, startingPC);
+        }
+    }
+
+    if(p == NULL) {
+        outPrintf(&m->out, "%s is damaged or does not match its program after %lli instructions.\n", file, executed);
+        outFlush(&m->out);
+        return -1;
+    }
+    if(exec < 0) {
+        executeInstruction(m, m->registers[PC]);
+    }
+    reportEnd(m, trace, exec, m->restoredAt + executed);
+    outFlush(&m->out);
+    return (exec == 0) ? 0 : (exec < 0) ? -1 : 2;
+}
+
+// Returns the register named at p (X0-X31, SP, LR or XZR, in any case) and its length, or -1
+// if p does not start with a register name.
+
+int registerName(const char *p, int *length) {
+    int reg = -1;
+
+    for(*length = 0; isalnum((unsigned char) p[*length]); (*length)++) {
+    }
+    if(*length == 2 && strncasecmp(p, "SP", 2) == 0) {
+        reg = SP;
+    } else if(*length == 2 && strncasecmp(p, "LR", 2) == 0) {
+        reg = LR;
+    } else if(*length == 3 && strncasecmp(p, "XZR", 3) == 0) {
+        reg = XZR;
+    } else if(*length >= 2 && *length <= 3 && toupper((unsigned char) p[0]) == 'X' && isdigit((unsigned char) p[1])
+              && isdigit((unsigned char) p[*length - 1])) {
+        reg = atoi(p + 1);
+    }
+    return (reg < REGISTERSPACE) ? reg : -1;
+}
+
+// Reads the starting registers for each lane from path, one lane per line, as NAME=VALUE pairs
+// separated by blanks or commas ("X1=5, X2=0x10, SP=4000"). Registers not named start as in
+// the loaded machine; blank lines and comments are skipped. Returns the number of lanes, or -1
+// after reporting the first mistake.
+
+int parseLanes(Machine *m, char *path, long long (**inputs)[REGISTERSPACE]) {
+    FILE *file = fopen(path, "r");
+    char line[LINESIZE + 1];
+    int lanes = 0, capacity = 0, lineNumber = 0, bad = 0;
+
+    *inputs = NULL;
+    if(file == NULL) {
+        printf("Could not read %s.\n", path);
+        return -1;
+    }
+    while(fgets(line, sizeof(line), file) != NULL) {
+        char *p = line, *end;
+        int named = 0;
+        long long values[REGISTERSPACE];
+
+        lineNumber++;
+        memcpy(values, m->registers, sizeof(values));
+        while(!bad) {
+            while(*p == ' ' || *p == '\t' || *p == ',' || *p == '\r' || *p == '\n') {
+                p++;
+            }
+            if(*p == '\0' || *p == ';' || *p == '#' || (p[0] == '/' && p[1] == '/')) {
+                break;
+            }
+            int length, reg = registerName(p, &length);
+            if(reg < 0 || p[length] != '=') {
+                printf("%s:%i: error: expected a register assignment like X1=5\n", path, lineNumber);
+                bad = 1;
+                break;
+            }
+            values[reg] = strtoll(p + length + 1, &end, 0);
+            if(end == p + length + 1) {
+                printf("%s:%i: error: expected a number after '='\n", path, lineNumber);
+                bad = 1;
+                break;
+            }
+            p = end;
+            named++;
+        }
+        if(bad) {
+            fclose(file);
+            free(*inputs);
+            *inputs = NULL;
+            return -1;
+        }
+        if(named == 0) {
+            continue;
+        }
+        if(lanes == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            *inputs = realloc(*inputs, capacity * sizeof(**inputs));
+        }
+        memcpy((*inputs)[lanes++], values, sizeof(values));
+    }
+    fclose(file);
+    if(lanes == 0) {
+        printf("%s holds no lanes.\n", path);
+        return -1;
+    }
+    return lanes;
+}
+
+// Maps a fused op back to the kind of the instruction it starts with.
+
+int plainKind(int kind) {
+    return (kind == K_PUSH) ? K_SUBSP : (kind == K_POP) ? K_LDUR : (kind == K_LOOP) ? K_B : kind;
+}
+
+// Runs a group of lanes until every one has halted, failed or executed limit instructions.
+// Each step executes the instruction at the lowest PC any running lane has, for the lanes at
+// that PC, with a mask blending the results into the rest. Lanes that branch apart therefore
+// take turns, and come back together where their paths meet again.
+//
+// The masked lanes share one PC, target, until a branch sends them different ways or they
+// reach a PC where other lanes are waiting. Until then the lowest PC is not searched for and
+// the per-lane PCs and counts are left alone: run counts the steps still to be added to every
+// masked lane. Results go through a temporary, so no loop both reads one register row and
+// writes another and the compiler can vectorize them all. LANECLONES builds the function once
+// more for AVX2 and once for AVX-512 where that is possible, picked when the program loads.
+
+#define LANES for(int l = 0; l < LANEWIDTH; l++)
+#define BLEND(to, value) ((to) = ((value) & mask[l]) | ((to) & ~mask[l]))
+#define STOP(l, why) (g->state[l] = (why), g->pc[l] = target, g->count[l] += run, \
+                      g->live[l] = mask[l] = 0, together = 0)
+#define FASTLANE(m, table, a) (((unsigned long long) (a) >> PAGEBITS) == (table)->lastNumber \
+                     && ((a) & (PAGESIZE - 1)) <= PAGESIZE - DOUBLEWORD \
+                     && (unsigned long long) ((a) - (m)->textBase) >= (unsigned long long) (m)->textSlots * WORD)
+
+LANECLONES void runLaneGroup(Machine *m, LaneGroup *g, long long limit) {
+    long long mask[LANEWIDTH], v[LANEWIDTH], address, target = 0, waiting = 0, room = 0, run = 0;
+    long long next, any, all, low = m->stackTop - m->stackSize;
+    int together = 0, split;
+
+    for(;;) {
+        if(!together) {
+            target = waiting = room = LLONG_MAX;
+            LANES {
+                if(g->live[l] && g->count[l] >= limit) {
+                    g->state[l] = LANE_STOPPED;
+                    g->live[l] = 0;
+                }
+                target = (g->live[l] && g->pc[l] < target) ? g->pc[l] : target;
+                room = (g->live[l] && limit - g->count[l] < room) ? limit - g->count[l] : room;
+            }
+            if(target == LLONG_MAX) {
+                return;
+            }
+            LANES {
+                mask[l] = g->live[l] & -(long long) (g->pc[l] == target);
+                waiting = (g->live[l] && g->pc[l] != target && g->pc[l] < waiting) ? g->pc[l] : waiting;
+            }
+            together = 1;
+        }
+
+        DecodedOp *op = pcToOp(m, target);
+        int kind = (op != NULL) ? plainKind(op->kind) : K_HALT;
+        long long *d = g->r[op ? op->rd : 0], *n = g->r[op ? op->rn : 0], *r3 = g->r[op ? op->rm : 0];
+        long long *sp = g->r[SP];
+
+        next = target + WORD;
+        split = 0;
+        switch(kind) {
+            case K_ADD :
+                LANES v[l] = ADDWRAP(n[l], r3[l]);
+                LANES BLEND(d[l], v[l]);
+                break;
+            case K_ADDI :
+                LANES v[l] = ADDWRAP(n[l], op->imm);
+                LANES BLEND(d[l], v[l]);
+                break;
+            case K_ADDSP :
+                LANES v[l] = ADDWRAP(sp[l], op->imm);
+                LANES BLEND(d[l], v[l]);
+                LANES if(mask[l] && v[l] > m->stackTop) STOP(l, LANE_OVERFLOW);
+                break;
+            case K_SUB :
+                LANES v[l] = SUBWRAP(n[l], r3[l]);
+                LANES BLEND(d[l], v[l]);
+                break;
+            case K_SUBI :
+                LANES v[l] = SUBWRAP(n[l], op->imm);
+                LANES BLEND(d[l], v[l]);
+                break;
+            case K_SUBSP :
+                LANES v[l] = SUBWRAP(sp[l], op->imm);
+                LANES BLEND(d[l], v[l]);
+                LANES if(mask[l] && v[l] < low) STOP(l, LANE_OVERFLOW);
+                break;
+            case K_LSL :
+                LANES v[l] = SHLWRAP(n[l], op->imm);
+                LANES BLEND(d[l], v[l]);
+                break;
+            case K_LDUR :                             // gathers, one lane at a time
+                LANES if(mask[l]) {
+                    address = ADDWRAP(n[l], op->imm);
+                    if(FASTLANE(m, &g->pages[l], address)) {
+                        memcpy(&d[l], g->pages[l].lastData + (address & (PAGESIZE - 1)), DOUBLEWORD);
+                    } else {
+                        TextInstr *t = ((unsigned long long) (address - m->textBase) < (unsigned long long) m->textSlots * WORD)
+                                     ? textAt(m, address) : NULL;
+                        d[l] = (t != NULL) ? t->opcode : loadData(&g->pages[l], address);
+                    }
+                }
+                break;
+            case K_STUR :                             // and scatters
+                LANES if(mask[l]) {
+                    address = ADDWRAP(n[l], op->imm);
+                    if(FASTLANE(m, &g->pages[l], address)) {
+                        memcpy(g->pages[l].lastData + (address & (PAGESIZE - 1)), &d[l], DOUBLEWORD);
+                    } else if((unsigned long long) (address - m->textBase) < (unsigned long long) m->textSlots * WORD
+                              && textAt(m, address) != NULL) {
+                        STOP(l, LANE_TEXTSTORE);      // the lanes share one text segment
+                    } else if(storeData(&g->pages[l], address, d[l]) < 0) {
+                        STOP(l, LANE_NOMEMORY);
+                    }
+                }
+                break;
+            case K_CBZ :
+            case K_CBNZ :
+                LANES v[l] = mask[l] & -(long long) ((d[l] - g->r[XZR][l] == 0) == (kind == K_CBZ));
+                any = 0;
+                all = -1;
+                LANES {
+                    any |= v[l];
+                    all &= v[l] | ~mask[l];
+                }
+                if(all) {
+                    next = op->imm;
+                } else if(any) {
+                    LANES v[l] = v[l] ? op->imm : next;
+                    LANES BLEND(g->pc[l], v[l]);
+                    split = 1;
+                }
+                break;
+            case K_BR :
+                if(op->rn == XZR) {
+                    LANES if(mask[l]) STOP(l, LANE_HALTED);
+                    break;
+                }
+                any = 0;
+                LANES next = mask[l] ? n[l] : next;
+                LANES any |= (n[l] ^ next) & mask[l];
+                if(any) {
+                    LANES v[l] = n[l];
+                    LANES BLEND(g->pc[l], v[l]);
+                    split = 1;
+                }
+                break;
+            case K_BL :
+                LANES BLEND(g->r[LR][l], next);
+                next = op->imm;
+                break;
+            case K_B :
+                next = op->imm;
+                break;
+            case K_SLOW :                             // the lanes keep their PCs apart from the registers
+                LANES if(mask[l]) STOP(l, LANE_PCOPERAND);
+                break;
+            default :
+                LANES if(mask[l]) STOP(l, LANE_HALTED);
+                break;
+        }
+        if(together && !split && next < waiting && --room > 0) {
+            target = next;
+            run++;
+            continue;
+        }
+        if(!split) {
+            LANES BLEND(g->pc[l], next);
+        }
+        LANES g->count[l] += (run + 1) & mask[l];
+        together = 0;
+        run = 0;
+    }
+}
+
+#undef LANES
+#undef BLEND
+#undef STOP
+#undef FASTLANE
+
+// Runs the loaded program once for every lane in the lanes file, in groups of LANEWIDTH, and
+// prints how each lane ended and its registers, then the total rate. With compareRuns, each
+// lane is also run on its own with runMachine() that many times, to time the two and check
+// they agree. Returns 0 if every lane completed (and agreed).
+
+int runLanes(Machine *m, const RunOptions *options, int compareRuns) {
+    static const char *states[NUMLANESTATES] = { "running", "complete", "stopped", "failed (stack overflow)",
+        "failed (out of guest memory)", "failed (store into the shared text)", "failed (PC used as an operand)" };
+    long long (*inputs)[REGISTERSPACE], instructions = 0;
+    struct timespec start, end;
+    int lanes = parseLanes(m, options->lanesPath, &inputs), status = 0;
+
+    if(lanes < 0) {
+        return -1;
+    }
+    LaneResult *results = calloc(lanes, sizeof(LaneResult));
+    LaneGroup *g = malloc(sizeof(LaneGroup));
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(int first = 0; first < lanes; first += LANEWIDTH) {
+        memset(g, 0, sizeof(LaneGroup));
+        for(int l = 0; l < LANEWIDTH; l++) {
+            g->pages[l].lastNumber = NOPAGE;
+            if(first + l < lanes) {
+                for(int i = 0; i < REGISTERSPACE; i++) {
+                    g->r[i][l] = inputs[first + l][i];
+                }
+                g->pc[l] = inputs[first + l][PC];
+                g->live[l] = -1;
+                copyPages(&g->pages[l], &m->pages);
+            }
+        }
+        runLaneGroup(m, g, options->limit);
+        for(int l = 0; l < LANEWIDTH && first + l < lanes; l++) {
+            LaneResult *result = &results[first + l];
+            for(int i = 0; i < REGISTERSPACE; i++) {
+                result->registers[i] = g->r[i][l];
+            }
+            result->registers[PC] = g->pc[l];
+            result->count = g->count[l];
+            result->state = g->state[l];
+            instructions += g->count[l];
+            freePages(&g->pages[l]);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    for(int lane = 0; lane < lanes; lane++) {
+        status = (results[lane].state != LANE_HALTED) ? -1 : status;
+        if(options->trace != TRACE_NONE) {
+            outPrintf(&m->out, "lane %i: %s after %lli instructions", lane, states[results[lane].state], results[lane].count);
+            outPrintf(&m->out, (results[lane].state == LANE_HALTED) ? ".\n" : ", PC = %lli.\n", results[lane].registers[PC]);
+            memcpy(m->registers, results[lane].registers, sizeof(m->registers));
+            printRegisters(m);
+        }
+    }
+    outPrintf(&m->out, "%i lanes in groups of %i: %lli instructions in %.6f seconds, %.0f instructions/s\n",
+        lanes, LANEWIDTH, instructions, seconds, instructions / seconds);
+
+    if(compareRuns > 0) {
+        Machine *lone = calloc(1, sizeof(Machine));
+        long long executed, total = 0;
+        double alone = 0;
+        int agree = 1;
+
+        lone->fuse = m->fuse;
+        lone->engine = m->engine;
+        for(int run = 0; run < compareRuns; run++) {
+            for(int lane = 0; lane < lanes; lane++) {
+                copyMachine(lone, m);
+                memcpy(lone->registers, inputs[lane], sizeof(lone->registers));
+                lone->out.length = 0;
+
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                int exec = runMachine(lone, options->limit, &executed);
+                clock_gettime(CLOCK_MONOTONIC, &end);
+
+                int state = results[lane].state;
+                alone += (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+                total += executed;
+                if(state != LANE_TEXTSTORE && state != LANE_PCOPERAND) {
+                    agree = agree && executed == results[lane].count
+                         && memcmp(lone->registers, results[lane].registers, sizeof(lone->registers)) == 0
+                         && exec == ((state == LANE_HALTED) ? 0 : (state == LANE_STOPPED) ? 1 : -1);
+                }
+            }
+        }
+
+        outPrintf(&m->out, "one at a time: %lli instructions in %.6f seconds, %.0f instructions/s (lanes %.2fx)\n",
+            total, alone, total / alone, (instructions / seconds) / (total / alone));
+        if(!agree) {
+            outPrintf(&m->out, "WARNING: lanes disagree with running each input on its own.\n");
+            status = -1;
+        }
+        freeMachine(lone);
+    }
+    free(g);
+    free(results);
+    free(inputs);
+    return status;
+}
+
+// Fills the empty data memory to with copies of every page in from.
+
+void copyPages(PageTable *to, PageTable *from) {
+    to->capacity = from->capacity;
+    to->count = from->count;
+    to->entries = calloc(from->capacity, sizeof(PageEntry));
+    for(int i = 0; i < from->capacity; i++) {
+        if(from->entries[i].data != NULL) {
+            to->entries[i].number = from->entries[i].number;
+            to->entries[i].data = malloc(PAGESIZE);
+            memcpy(to->entries[i].data, from->entries[i].data, PAGESIZE);
+        }
+    }
+}
+
+// Makes to an independent copy of the registers, memory and program of from, replacing
+// whatever to held. Output settings are left alone.
+
+void copyMachine(Machine *to, Machine *from) {
+    freePages(&to->pages);
+    memcpy(to->registers, from->registers, sizeof(from->registers));
+    to->stackTop = from->stackTop;
+    to->stackSize = from->stackSize;
+    copyPages(&to->pages, &from->pages);
+
+    releaseText(to);
+    to->textBase = from->textBase;
+    to->textSlots = from->textSlots;
+    to->text = malloc(from->textSlots * sizeof(TextInstr));
+    memcpy(to->text, from->text, from->textSlots * sizeof(TextInstr));
+    decodeProgram(to);
+}
+
+// Returns 1 if both machines hold the same registers, text and memory contents. A page one
+// machine never allocated matches a page of zeros in the other.
+
+int sameState(Machine *a, Machine *b) {
+    static const unsigned char zeros[PAGESIZE];
+
+    if(memcmp(a->registers, b->registers, sizeof(a->registers)) || a->textBase != b->textBase
+    || a->textSlots != b->textSlots || memcmp(a->text, b->text, a->textSlots * sizeof(TextInstr))) {
+        return 0;
+    }
+    for(int pass = 0; pass < 2; pass++) {
+        Machine *x = pass ? b : a, *y = pass ? a : b;
+        for(int i = 0; i < x->pages.capacity; i++) {
+            if(x->pages.entries[i].data != NULL) {
+                unsigned char *other = findPage(&y->pages, x->pages.entries[i].number);
+                if(memcmp(x->pages.entries[i].data, other ? other : zeros, PAGESIZE)) {
+                    return 0;
+                }
+            }
+        }
+    }
+    return 1;
+}
+
+// Returns the first slot at or after the given one whose instruction has not been removed,
+// or textSlots if there is none.
+
+int optNext(Optimizer *o, int slot) {
+    while(slot < o->m->textSlots && o->dead[slot]) {
+        slot++;
+    }
+    return slot;
+}
+
+// Returns the slot a branch to the given address goes on to, or -1 if it leaves the program.
+
+int optTarget(Optimizer *o, long long address) {
+    long long offset = address - o->m->textBase;
+
+    if(offset < 0 || offset % WORD || offset / WORD >= o->m->textSlots) {
+        return -1;
+    }
+    int slot = optNext(o, offset / WORD);
+    return (slot < o->m->textSlots) ? slot : -1;
+}
+
+// Registers an instruction reads. Halting reads them all, since they are printed.
+
+unsigned optUses(const TextInstr *t) {
+    switch(t->opcode) {
+        case ADD :
+        case SUB :  return REGBIT(t->rn) | REGBIT(t->imm);
+        case ADDI :
+        case SUBI :
+        case LSL :
+        case LDUR : return REGBIT(t->rn);
+        case STUR : return REGBIT(t->rd) | REGBIT(t->rn);
+        case CBZ :
+        case CBNZ : return REGBIT(t->rd) | REGBIT(XZR);
+        case BR :   return (t->rd == XZR) ? ALLREGS : REGBIT(t->rd);
+        case BL :
+        case B :    return 0;
+        default :   return ALLREGS;
+    }
+}
+
+// The register an instruction writes, or -1.
+
+int optDefines(const TextInstr *t) {
+    switch(t->opcode) {
+        case ADD :
+        case SUB :
+        case ADDI :
+        case SUBI :
+        case LSL :
+        case LDUR : return t->rd;
+        case BL :   return LR;
+        default :   return -1;
+    }
+}
+
+// Returns why the program cannot be optimized from its text alone, or NULL if it can. Every
+// branch target has to be visible: the PC is never an operand, BR only returns through LR or
+// halts, and LR only holds return addresses, which may be saved to memory and loaded back.
+
+const char *optCheck(Optimizer *o) {
+    Machine *m = o->m;
+
+    if(m->registers[PC] != STARTMEM) {
+        return "it is not at the start of the program";
+    }
+    if(m->textBase == 0 && m->text[0].opcode != 0) {
+        return "it has an instruction at address 0, where BR LR goes before any BL";
+    }
+    for(int s = 0; s < m->textSlots; s++) {
+        const TextInstr *t = &m->text[s];
+        int d = optDefines(t);
+        unsigned reads = (t->opcode == BR) ? 0 : (t->opcode == STUR) ? REGBIT(t->rn) : optUses(t);
+
+        if(t->opcode == 0) {
+            continue;
+        }
+        if(((t->opcode == BR) ? REGBIT(t->rd) : (reads | ((d >= 0) ? REGBIT(d) : 0) | optUses(t))) & REGBIT(PC)) {
+            return "it uses the PC (X29) as an operand";
+        }
+        if(t->opcode == BR && t->rd != LR && t->rd != XZR) {
+            return "it branches through a register other than LR";
+        }
+        if(reads & REGBIT(LR)) {
+            return "it reads LR as data";
+        }
+        if(d == LR && t->opcode != BL && t->opcode != LDUR) {
+            return "it sets LR other than with BL";
+        }
+    }
+    return NULL;
+}
+
+// Splits the remaining instructions into basic blocks, links each to the blocks it can go on
+// to and marks the ones execution can reach. BR LR goes back to the instruction after any
+// reachable BL.
+
+void optBlocks(Optimizer *o) {
+    int slots = o->m->textSlots, start = optNext(o, (STARTMEM - o->m->textBase) / WORD);
+    unsigned char *leader = calloc(slots + 1, 1);
+    int *stack = malloc(slots * sizeof(int)), depth = 0, returnReached = 0;
+
+    leader[start] = 1;
+    for(int s = optNext(o, 0); s < slots; s = optNext(o, s + 1)) {
+        const TextInstr *t = &o->text[s];
+        if(t->opcode == CBZ || t->opcode == CBNZ || t->opcode == B || t->opcode == BL) {
+            int target = optTarget(o, t->imm);
+            leader[(target < 0) ? slots : target] = 1;
+        }
+        if(ENDSBLOCK(t)) {
+            leader[optNext(o, s + 1)] = 1;
+        }
+    }
+
+    memset(o->blockOf, -1, slots * sizeof(int));
+    o->blockCount = 0;
+    for(int s = optNext(o, 0); s < slots; s = optNext(o, s + 1)) {
+        if(leader[s] || o->blockCount == 0) {
+            memset(&o->blocks[o->blockCount], 0, sizeof(OptBlock));
+            o->blocks[o->blockCount++].first = s;
+        }
+        o->blocks[o->blockCount - 1].last = s;
+        o->blockOf[s] = o->blockCount - 1;
+    }
+
+    for(int i = 0; i < o->blockCount; i++) {
+        OptBlock *b = &o->blocks[i];
+        const TextInstr *t = &o->text[b->last];
+        int next = optNext(o, b->last + 1), to[2] = { -1, -1 }, count = 1;
+
+        switch(t->opcode) {
+            case CBZ :
+            case CBNZ : to[0] = optTarget(o, t->imm); to[1] = (next < slots) ? next : -1; count = 2; break;
+            case B :
+            case BL :   to[0] = optTarget(o, t->imm); break;
+            case BR :   b->returns = (t->rd == LR); b->exits = (t->rd != LR); count = 0; break;
+            case 0 :    b->exits = 1; count = 0; break;
+            default :   to[0] = (next < slots) ? next : -1; break;
+        }
+        for(int j = 0; j < count; j++) {
+            if(to[j] < 0) {
+                b->exits = 1;
+            } else {
+                b->succ[b->succCount++] = o->blockOf[to[j]];
+            }
+        }
+    }
+
+    // everything execution can get to from the entry, following BR LR once one is reached
+    o->returnCount = 0;
+    o->entry = o->blockOf[start];
+    o->blocks[o->entry].reachable = 1;
+    stack[depth++] = o->entry;
+    while(depth > 0) {
+        OptBlock *b = &o->blocks[stack[--depth]];
+        int reach[2 + 1], count = 0;
+
+        for(int j = 0; j < b->succCount; j++) {
+            reach[count++] = b->succ[j];
+        }
+        if(o->text[b->last].opcode == BL && optNext(o, b->last + 1) < slots) {
+            int back = o->blockOf[optNext(o, b->last + 1)];
+            o->returnPoints[o->returnCount++] = back;
+            if(returnReached) {
+                reach[count++] = back;
+            }
+        }
+        if(b->returns && !returnReached) {
+            returnReached = 1;
+            for(int j = 0; j < o->returnCount; j++) {
+                if(!o->blocks[o->returnPoints[j]].reachable) {
+                    o->blocks[o->returnPoints[j]].reachable = 1;
+                    stack[depth++] = o->returnPoints[j];
+                }
+            }
+        }
+        for(int j = 0; j < count; j++) {
+            if(!o->blocks[reach[j]].reachable) {
+                o->blocks[reach[j]].reachable = 1;
+                stack[depth++] = reach[j];
+            }
+        }
+    }
+    free(leader);
+    free(stack);
+}
+
+// Applies an instruction to what is known about the registers.
+
+void optValues(const TextInstr *t, KnownValue *v) {
+    int d = optDefines(t);
+    KnownValue result = { VALUE_VARIES, 0 };
+    const KnownValue *n = &v[t->rn & (REGISTERSPACE - 1)], *k = &v[t->imm & (REGISTERSPACE - 1)];
+
+    if(d < 0) {
+        return;
+    }
+    switch(t->opcode) {
+        case ADD :
+        case SUB :
+            if(n->kind == VALUE_CONSTANT && k->kind == VALUE_CONSTANT) {
+                result.kind = VALUE_CONSTANT;
+                result.value = (t->opcode == ADD) ? ADDWRAP(n->value, k->value) : SUBWRAP(n->value, k->value);
+            }
+            break;
+        case ADDI :
+        case SUBI :
+        case LSL :
+            if(n->kind == VALUE_CONSTANT) {
+                result.kind = VALUE_CONSTANT;
+                result.value = (t->opcode == ADDI) ? ADDWRAP(n->value, t->imm)
+                             : (t->opcode == SUBI) ? SUBWRAP(n->value, t->imm) : SHLWRAP(n->value, t->imm);
+            }
+            break;
+        case BL :
+            result.kind = VALUE_RETURN;
+            break;
+    }
+    v[d] = result;
+}
+
+// Works out what is known about the registers on entry to each reachable block. The program
+// may start with any values in them except XZR, which is taken to be zero.
+
+void optConstants(Optimizer *o) {
+    int *queue = malloc(o->blockCount * sizeof(int)), head = 0, count = 0;
+    unsigned char *queued = calloc(o->blockCount, 1);
+    KnownValue v[REGISTERSPACE];
+
+    for(int r = 0; r < REGISTERSPACE; r++) {
+        o->blocks[o->entry].in[r].kind = (r == XZR) ? VALUE_CONSTANT : VALUE_VARIES;
+    }
+    queue[count++] = o->entry;
+    queued[o->entry] = 1;
+
+    while(count > 0) {
+        OptBlock *b = &o->blocks[queue[head]];
+        queued[queue[head]] = 0;
+        head = (head + 1) % o->blockCount;
+        count--;
+
+        memcpy(v, b->in, sizeof(v));
+        for(int s = b->first; s <= b->last; s++) {
+            if(!o->dead[s]) {
+                optValues(&o->text[s], v);
+            }
+        }
+
+        int targets = b->succCount + (b->returns ? o->returnCount : 0);
+        for(int j = 0; j < targets; j++) {
+            int to = (j < b->succCount) ? b->succ[j] : o->returnPoints[j - b->succCount], changed = 0;
+            for(int r = 0; r < REGISTERSPACE; r++) {
+                KnownValue *in = &o->blocks[to].in[r];
+                if(in->kind == VALUE_UNSEEN) {
+                    *in = v[r];
+                    changed = 1;
+                } else if(in->kind != VALUE_VARIES && (in->kind != v[r].kind || in->value != v[r].value)) {
+                    in->kind = VALUE_VARIES;
+                    changed = 1;
+                }
+            }
+            if(changed && !queued[to]) {
+                queued[to] = 1;
+                queue[(head + count++) % o->blockCount] = to;
+            }
+        }
+    }
+    free(queue);
+    free(queued);
+}
+
+// Simplifies one block using what is known about the registers: folds constants, turns ADD and
+// SUB of a known register into ADDI and SUBI, rewrites doublings and chains of shifts or offsets
+// from one register as a single LSL or ADDI of it, drops instructions that change nothing and
+// settles branches on known values. ADDI and SUBI of SP are left alone for their stack checks.
+
+void optRewrite(Optimizer *o, OptBlock *b) {
+    Machine *m = o->m;
+    KnownValue v[REGISTERSPACE];
+    int shiftBase[REGISTERSPACE], offsetBase[REGISTERSPACE];   // a register is base << by or base + by,
+    long long shiftBy[REGISTERSPACE], offsetBy[REGISTERSPACE]; // a base of -1 if neither is known
+
+    memcpy(v, b->in, sizeof(v));
+    for(int r = 0; r < REGISTERSPACE; r++) {
+        shiftBase[r] = offsetBase[r] = -1;
+    }
+
+    for(int s = b->first; s <= b->last; s++) {
+        TextInstr *t = &o->text[s];
+        int changed = 1;
+
+        // each rewrite may open the way for another
+        for(int pass = 0; changed && !o->dead[s] && pass < 4; pass++) {
+            int d = t->rd, n = t->rn & (REGISTERSPACE - 1), k = t->imm & (REGISTERSPACE - 1);
+            int known = (v[n].kind == VALUE_CONSTANT), zero = (v[XZR].kind == VALUE_CONSTANT && v[XZR].value == 0);
+            long long value, delta;
+
+            changed = 0;
+            switch(t->opcode) {
+                case ADD :
+                case SUB :
+                    value = (t->opcode == ADD) ? ADDWRAP(v[n].value, v[k].value) : SUBWRAP(v[n].value, v[k].value);
+                    if(known && v[k].kind == VALUE_CONSTANT && zero && value == (int) value) {
+                        packInstr(t, ADDI, d, XZR, value);
+                        o->folded++;
+                    } else if(v[k].kind == VALUE_CONSTANT && v[k].value == (int) v[k].value && n != SP) {
+                        packInstr(t, (t->opcode == ADD) ? ADDI : SUBI, d, n, v[k].value);
+                        o->folded++;
+                    } else if(t->opcode == ADD && known && v[n].value == (int) v[n].value && k != SP) {
+                        packInstr(t, ADDI, d, k, v[n].value);
+                        o->folded++;
+                    } else if(t->opcode == SUB && n == k && zero) {
+                        packInstr(t, ADDI, d, XZR, 0);
+                        o->folded++;
+                    } else if(t->opcode == ADD && ((shiftBase[n] < 0) ? n : shiftBase[n]) == ((shiftBase[k] < 0) ? k : shiftBase[k])
+                              && ((shiftBase[n] < 0) ? 0 : shiftBy[n]) == ((shiftBase[k] < 0) ? 0 : shiftBy[k])
+                              && ((shiftBase[n] < 0) ? 0 : shiftBy[n]) < 63) {
+                        packInstr(t, LSL, d, (shiftBase[n] < 0) ? n : shiftBase[n], ((shiftBase[n] < 0) ? 0 : shiftBy[n]) + 1);
+                        o->reduced++;
+                    } else {
+                        break;
+                    }
+                    changed = 1;
+                    break;
+                case ADDI :
+                case SUBI :
+                    delta = (t->opcode == ADDI) ? t->imm : -(long long) t->imm;
+                    value = ADDWRAP(v[n].value, delta);
+                    if(n == SP) {
+                        break;
+                    } else if(known && zero && value == (int) value && !(n == XZR && t->opcode == ADDI)) {
+                        packInstr(t, ADDI, d, XZR, value);
+                        o->folded++;
+                        changed = 1;
+                    } else if(delta == 0 && d == n) {
+                        o->dead[s] = 1;
+                        o->reduced++;
+                    } else if(offsetBase[n] >= 0 && offsetBy[n] + delta == (int) (offsetBy[n] + delta)) {
+                        packInstr(t, ADDI, d, offsetBase[n], offsetBy[n] + delta);
+                        o->reduced++;
+                        changed = 1;
+                    }
+                    break;
+                case LSL :
+                    if(t->imm < 0 || t->imm >= 64) {
+                        break;
+                    }
+                    value = SHLWRAP(v[n].value, t->imm);
+                    if(known && zero && value == (int) value) {
+                        packInstr(t, ADDI, d, XZR, value);
+                        o->folded++;
+                        changed = 1;
+                    } else if(t->imm == 0 && d == n) {
+                        o->dead[s] = 1;
+                        o->reduced++;
+                    } else if(shiftBase[n] >= 0 && shiftBy[n] + t->imm < 64) {
+                        packInstr(t, LSL, d, shiftBase[n], shiftBy[n] + t->imm);
+                        o->reduced++;
+                        changed = 1;
+                    }
+                    break;
+                case LDUR :
+                case STUR :
+                    value = ADDWRAP(v[n].value, t->imm);
+                    if(known && value > m->textBase - DOUBLEWORD && value < m->textBase + (long long) m->textSlots * WORD) {
+                        o->unsafe = "it reads or writes its own instructions";
+                    }
+                    break;
+                case CBZ :
+                case CBNZ :
+                    if(d == XZR || (v[d].kind == VALUE_CONSTANT && v[XZR].kind == VALUE_CONSTANT)) {
+                        int taken = (d == XZR || v[d].value == v[XZR].value) == (t->opcode == CBZ);
+                        if(taken) {
+                            packInstr(t, B, t->imm, 0, 0);
+                        } else {
+                            o->dead[s] = 1;
+                        }
+                        o->resolved++;
+                    }
+                    break;
+            }
+        }
+        if(o->dead[s]) {
+            continue;
+        }
+
+        int d = optDefines(t);
+        if(t->opcode == BR && t->rd == LR && v[LR].kind != VALUE_RETURN) {
+            b->exits = 1;         // LR may still hold its starting value, which goes nowhere
+        }
+        optValues(t, v);
+        if(d >= 0) {
+            for(int r = 0; r < REGISTERSPACE; r++) {
+                shiftBase[r] = (shiftBase[r] == d) ? -1 : shiftBase[r];
+                offsetBase[r] = (offsetBase[r] == d) ? -1 : offsetBase[r];
+            }
+            shiftBase[d] = offsetBase[d] = -1;
+            if(t->rn != d && t->rn != SP && v[d].kind != VALUE_CONSTANT) {
+                if(t->opcode == LSL && t->imm >= 0 && t->imm < 64) {
+                    shiftBase[d] = t->rn;
+                    shiftBy[d] = t->imm;
+                } else if(t->opcode == ADDI || t->opcode == SUBI) {
+                    offsetBase[d] = t->rn;
+                    offsetBy[d] = (t->opcode == ADDI) ? t->imm : -(long long) t->imm;
+                }
+            }
+        }
+    }
+}
+
+// Removes branches to where execution would have gone anyway.
+
+void optJumps(Optimizer *o) {
+    int again = 1;
+
+    while(again) {
+        again = 0;
+        for(int s = optNext(o, 0); s < o->m->textSlots; s = optNext(o, s + 1)) {
+            const TextInstr *t = &o->text[s];
+            int target = optTarget(o, t->imm);
+            if((t->opcode == B || t->opcode == CBZ || t->opcode == CBNZ) && target >= 0 && target == optNext(o, s + 1)) {
+                o->dead[s] = 1;
+                o->resolved++;
+                again = 1;
+            }
+        }
+    }
+}
+
+// Registers a block's successors may read.
+
+unsigned optLiveOut(Optimizer *o, OptBlock *b) {
+    unsigned live = b->exits ? ALLREGS : 0;
+
+    for(int j = 0; j < b->succCount; j++) {
+        live |= o->blocks[b->succ[j]].liveIn;
+    }
+    for(int j = 0; b->returns && j < o->returnCount; j++) {
+        live |= o->blocks[o->returnPoints[j]].liveIn;
+    }
+    return live;
+}
+
+// Works out which registers each reachable block reads before writing, then removes every
+// write that nothing reads afterwards. ADDI and SUBI of SP stay for their stack checks.
+
+void optLiveness(Optimizer *o) {
+    int changed = 1;
+
+    for(int i = 0; i < o->blockCount; i++) {
+        o->blocks[i].liveIn = 0;
+    }
+    while(changed) {
+        changed = 0;
+        for(int i = o->blockCount - 1; i >= 0; i--) {
+            OptBlock *b = &o->blocks[i];
+            unsigned live = optLiveOut(o, b);
+            for(int s = b->last; b->reachable && s >= b->first; s--) {
+                int d = optDefines(&o->text[s]);
+                if(!o->dead[s]) {
+                    live = (live & ~((d >= 0) ? REGBIT(d) : 0)) | optUses(&o->text[s]);
+                }
+            }
+            if(b->reachable && live != b->liveIn) {
+                b->liveIn = live;
+                changed = 1;
+            }
+        }
+    }
+
+    for(int i = 0; i < o->blockCount; i++) {
+        OptBlock *b = &o->blocks[i];
+        unsigned live = optLiveOut(o, b);
+        for(int s = b->last; b->reachable && s >= b->first; s--) {
+            const TextInstr *t = &o->text[s];
+            int d = optDefines(t);
+            if(o->dead[s]) {
+                continue;
+            }
+            if(d >= 0 && t->opcode != BL && !(live & REGBIT(d)) && !((t->opcode == ADDI || t->opcode == SUBI) && t->rn == SP)) {
+                o->dead[s] = 1;
+                o->deadWrites++;
+                continue;
+            }
+            live = (live & ~((d >= 0) ? REGBIT(d) : 0)) | optUses(t);
+        }
+    }
+}
+
+// Removes STURs that a later STUR in the same block overwrites before anything loads.
+
+void optDeadStores(Optimizer *o, OptBlock *b) {
+    for(int s = b->first; s <= b->last; s++) {
+        const TextInstr *t = &o->text[s];
+        if(o->dead[s] || t->opcode != STUR) {
+            continue;
+        }
+        for(int later = s + 1; later <= b->last; later++) {
+            const TextInstr *u = &o->text[later];
+            if(o->dead[later]) {
+                continue;
+            }
+            if(u->opcode == STUR && u->rn == t->rn && u->imm == t->imm) {
+                o->dead[s] = 1;
+                o->deadStores++;
+                break;
+            }
+            if(u->opcode == LDUR || optDefines(u) == t->rn) {
+                break;
+            }
+        }
+    }
+}
+
+// Where a code address of the program in a ended up after optimizing. Other values are left
+// as they are.
+
+long long movedAddress(Machine *a, long long address, long long *newAddress) {
+    long long offset = address - a->textBase;
+
+    if(offset < 0 || offset % WORD || offset / WORD >= a->textSlots) {
+        return address;
+    }
+    return newAddress[offset / WORD];
+}
+
+// Returns 1 if b, which ran the optimized program, ended in the same state as a, which ran the
+// original: the same registers apart from the PC and the same data memory, except that code
+// addresses in a (return addresses) are at their new places in b.
+
+int sameAfterOptimizing(Machine *a, Machine *b, long long *newAddress) {
+    static const unsigned char zeros[PAGESIZE];
+
+    for(int r = 0; r < REGISTERSPACE; r++) {
+        if(r != PC && a->registers[r] != b->registers[r]
+           && movedAddress(a, a->registers[r], newAddress) != b->registers[r]) {
+            return 0;
+        }
+    }
+    for(int pass = 0; pass < 2; pass++) {
+        Machine *x = pass ? b : a;
+        for(int i = 0; i < x->pages.capacity; i++) {
+            if(x->pages.entries[i].data == NULL) {
+                continue;
+            }
+            unsigned char *pa = findPage(&a->pages, x->pages.entries[i].number);
+            unsigned char *pb = findPage(&b->pages, x->pages.entries[i].number);
+            pa = pa ? pa : (unsigned char *) zeros;
+            pb = pb ? pb : (unsigned char *) zeros;
+
+            // a byte may only differ inside a doubleword holding a moved code address
+            for(int j = 0; j < PAGESIZE; j++) {
+                int explained = (pa[j] == pb[j]);
+                for(int at = (j < DOUBLEWORD) ? 0 : j - DOUBLEWORD + 1; !explained && at <= j && at <= PAGESIZE - DOUBLEWORD; at++) {
+                    long long old, now;
+                    memcpy(&old, pa + at, DOUBLEWORD);
+                    memcpy(&now, pb + at, DOUBLEWORD);
+                    explained = (old != now && movedAddress(a, old, newAddress) == now);
+                }
+                if(!explained) {
+                    return 0;
+                }
+            }
+        }
+    }
+    return 1;
+}
+
+// Writes an optimized version of the loaded program to outPath, in the program file format,
+// then runs both from the start to check they end in the same state and reports the static and
+// dynamic instructions saved. A program whose branches cannot all be seen in its text is
+// written out as it is. Returns 0, or -1 if the file cannot be written or the runs disagree.
+
+int optimizeProgram(Machine *m, char *outPath, const RunOptions *options) {
+    int slots = m->textSlots, kept = 0, original = 0, status = 0;
+    long long *newAddress = malloc(slots * sizeof(long long));
+    Optimizer o = { .m = m };
+    char text[64];
+
+    o.text = malloc(slots * sizeof(TextInstr));
+    memcpy(o.text, m->text, slots * sizeof(TextInstr));
+    o.dead = calloc(slots, 1);
+    o.blockOf = malloc(slots * sizeof(int));
+    o.blocks = malloc(slots * sizeof(OptBlock));
+    o.returnPoints = malloc(slots * sizeof(int));
+    o.unsafe = optCheck(&o);
+
+    for(int round = 0; o.unsafe == NULL && round < MAXOPTROUNDS; round++) {
+        long long changes = o.folded + o.reduced + o.resolved + o.deadWrites + o.deadStores + o.unreachable;
+
+        optBlocks(&o);
+        for(int i = 0; i < o.blockCount; i++) {
+            for(int s = o.blocks[i].first; !o.blocks[i].reachable && s <= o.blocks[i].last; s++) {
+                o.unreachable += (!o.dead[s] && o.text[s].opcode != 0);
+                o.dead[s] = 1;
+            }
+        }
+        optConstants(&o);
+        for(int i = 0; i < o.blockCount; i++) {
+            if(o.blocks[i].reachable) {
+                optRewrite(&o, &o.blocks[i]);
+            }
+        }
+        optJumps(&o);
+        optLiveness(&o);
+        for(int i = 0; i < o.blockCount; i++) {
+            if(o.blocks[i].reachable) {
+                optDeadStores(&o, &o.blocks[i]);
+            }
+        }
+        if(changes == o.folded + o.reduced + o.resolved + o.deadWrites + o.deadStores + o.unreachable) {
+            break;
+        }
+    }
+
+    // instructions keep their order, closed up around the one execution starts at, which stays
+    // at STARTMEM; reachable empty slots become BR XZR
+    long long address = STARTMEM, end = 0;
+    if(o.unsafe != NULL) {
+        memcpy(o.text, m->text, slots * sizeof(TextInstr));
+        for(int s = 0; s < slots; s++) {
+            o.dead[s] = (o.text[s].opcode == 0);
+            newAddress[s] = m->textBase + (long long) s * WORD;
+        }
+    } else {
+        int start = optNext(&o, (STARTMEM - m->textBase) / WORD), last = slots - 1;
+        while(last > start && o.dead[last]) {
+            last--;
+        }
+        o.dead[last] |= (last > start && o.text[last].opcode == 0);   // the new layout ends in an empty slot too
+        for(int s = 0; s < start; s++) {
+            address -= o.dead[s] ? 0 : WORD;
+        }
+        for(int s = 0; s < slots; s++) {
+            newAddress[s] = address;
+            address += o.dead[s] ? 0 : WORD;
+        }
+        end = address;
+        for(int s = slots - 1; s >= 0; s--) {
+            newAddress[s] = !o.dead[s] ? newAddress[s] : (s + 1 < slots) ? newAddress[s + 1] : end;
+        }
+    }
+
+    FILE *file = fopen(outPath, "w");
+    if(file != NULL) {
+        for(int s = 0; s < slots; s++) {
+            TextInstr t = o.text[s];
+            original += (m->text[s].opcode != 0);
+            if(o.dead[s]) {
+                continue;
+            }
+            if(t.opcode == 0) {
+                packInstr(&t, BR, XZR, 0, 0);
+            } else if(o.unsafe == NULL && (t.opcode == CBZ || t.opcode == CBNZ || t.opcode == B || t.opcode == BL)) {
+                int target = optTarget(&o, t.imm);
+                t.imm = (target < 0) ? end : newAddress[target];
+            }
+            formatInstr(&t, text);
+            fprintf(file, "%lli %s\n", newAddress[s], text);
+            kept++;
+        }
+        status = (ferror(file) | fclose(file)) ? -1 : 0;
+    }
+    if(file == NULL || status < 0) {
+        printf("Could not write %s.\n", outPath);
+        status = -1;
+    } else if(o.unsafe != NULL) {
+        printf("Wrote %s unchanged to %s: %s.\n", m->name, outPath, o.unsafe);
+    } else {
+        printf("Optimized %s into %s: %i instructions, from %i.\n", m->name, outPath, kept, original);
+        printf("%lli constants folded, %lli strength reduced, %lli branches settled, %lli dead writes and %lli dead "
+               "stores removed, %lli unreachable.\n", o.folded, o.reduced, o.resolved, o.deadWrites, o.deadStores,
+               o.unreachable);
+    }
+
+    // a reference run of both from the start
+    Machine *before = newMachine(options), *after = newMachine(options);
+    long long ran[2] = { 0, 0 };
+    int exec[2] = { 0, 0 };
+    copyMachine(before, m);
+    before->out.sink = NULL;
+    if(status == 0 && loadProgram(after, outPath) < 0) {
+        printf("Could not read back %s.\n", outPath);
+        status = -1;
+    }
+    if(status == 0) {
+        after->out.sink = NULL;
+        exec[0] = runMachine(before, options->limit, &ran[0]);
+        exec[1] = runMachine(after, options->limit, &ran[1]);
+        printf("Reference run: %lli instructions, from %lli (%lli saved, %.1f%%).\n", ran[1], ran[0],
+            ran[0] - ran[1], ran[0] ? 100.0 * (ran[0] - ran[1]) / ran[0] : 0.0);
+        if(exec[0] != 0 || exec[1] != 0) {
+            printf("The reference run %s, so the final states were not compared.\n",
+                (exec[0] == 1 || exec[1] == 1) ? "stopped at the instruction limit" : "ended in an error");
+        } else if(!sameAfterOptimizing(before, after, newAddress)) {
+            printf("WARNING: the optimized program does not end in the same state as the original.\n");
+            status = -1;
+        }
+    }
+
+    freeMachine(before);
+    freeMachine(after);
+    free(newAddress);
+    free(o.text);
+    free(o.dead);
+    free(o.blockOf);
+    free(o.blocks);
+    free(o.returnPoints);
+    return status;
+}
+
+// Formats output based on given instruction
+
+void outputResult(Machine *m, long long inst) {
+
+    TextInstr *t = textAt(m, inst);
+    int opcode = (t != NULL) ? t->opcode : 0, op1, op2, op3;
+    char opStr1[32], opStr2[32], opStr3[32];
+
+    if(t == NULL) {
+        return;
+    }
+    unpackInstr(t, &op1, &op2, &op3);
+    long long differenceForPrintingStack = m->stackTop - m->stackSize;
+    ungetOperand(op1, opStr1); 
+    ungetOperand(op2, opStr2);                          // Variables for readability
+    ungetOperand(op3, opStr3);                          // "op" for operand
+
+    if(opcode == ADD) {
+        outPrintf(&m->out, "PC = %lli, Instruction: ADD ", inst); 
+        outPrintf(&m->out, "%s, %s, %s\n", opStr1, opStr2, opStr3);
+        outPrintf(&m->out, "Registers: %s: %lli | %s: %lli | %s: %lli\n", opStr1, m->registers[op1], opStr2, m->registers[op2], opStr3, m->registers[op3]);
+    } else if(opcode == ADDI) {
+        outPrintf(&m->out, "PC = %lli, Instruction: ADDI ", inst); 
+        outPrintf(&m->out, "%s, %s, #%i\n", opStr1, opStr2, op3);
+        outPrintf(&m->out, "Registers: %s: %lli | %s: %lli | immediate: #%i\n", opStr1, m->registers[op1], opStr2, m->registers[op2], op3);
+    } else if(opcode == SUB) {
+        outPrintf(&m->out, "PC = %lli, Instruction: SUB ", inst); 
+        outPrintf(&m->out, "%s, %s, %s\n", opStr1, opStr2, opStr3);
+        outPrintf(&m->out, "Registers: %s: %lli | %s: %lli | %s: %lli\n", opStr1, m->registers[op1], opStr2, m->registers[op2], opStr3, m->registers[op3]);
+    } else if(opcode == SUBI) {
+        outPrintf(&m->out, "PC = %lli, Instruction: SUBI ", inst); 
+        outPrintf(&m->out, "%s, %s, #%i\n", opStr1, opStr2, op3);
+        outPrintf(&m->out, "Registers: %s: %lli | %s: %lli | immediate: #%i\n", opStr1, m->registers[op1], opStr2, m->registers[op2], op3);
+    } else if(opcode == LDUR) {
+        outPrintf(&m->out, "PC = %lli, Instruction: LDUR ", inst); 
+        outPrintf(&m->out, "%s, [%s, #%i]\n", opStr1, opStr2, op3);
+        if(op2 == SP) {
+            outPrintf(&m->out, "Popped %lli from stack memory address %llx into register %s\n", m->registers[op1], 
+            ADDWRAP(m->registers[op2], op3) - differenceForPrintingStack, opStr1);
+        } else {
+            outPrintf(&m->out, "Register %s now contains %lli from memory address %llx\n", opStr1, m->registers[op1], m->registers[op2]);
+        }
+    } else if(opcode == STUR) {
+        outPrintf(&m->out, "PC = %lli, Instruction: STUR ", inst); 
+        outPrintf(&m->out, "%s, [%s, #%i]\n", opStr1, opStr2, op3);
+        if(op2 == SP) {
+            outPrintf(&m->out, "Pushed %lli to the stack at memory address %llx\n", m->registers[op1], 
+            ADDWRAP(m->registers[op2], op3) - differenceForPrintingStack);
+        } else {
+            outPrintf(&m->out, "Memory address %llx now contains %lli\n", ADDWRAP(m->registers[op2], op3), m->registers[op1]);
+        }
+    } else if(opcode == LSL) {
+        outPrintf(&m->out, "PC = %lli, Instruction: LSL ", inst); 
+        outPrintf(&m->out, "%s, %s, #%i\n", opStr1, opStr2, op3);
+        outPrintf(&m->out, "Registers: %s: %lli | %s: %lli | %s: %lli\n", opStr1, m->registers[op1], opStr2, m->registers[op2], opStr3, m->registers[op3 & (REGISTERSPACE - 1)]);
+    } else if(opcode == CBZ) {
+        outPrintf(&m->out, "PC = %lli, Instruction: CBZ X%i, %i\n", inst, op1, op2); 
+        outPrintf(&m->out, "Conditional branch on zero for register %s, containing %lli\n", 
+            opStr1, m->registers[op1]);
+        outPrintf(&m->out, ">>\tPC is now %lli \n", m->registers[PC]);
+    } else if(opcode == CBNZ) {
+        outPrintf(&m->out, "PC = %lli, Instruction: CBNZ X%i, %i\n", inst, op1, op2); 
+        outPrintf(&m->out, "Conditional branch on not zero for register %s, containing %lli\n", 
+            opStr1, m->registers[op1]);
+        outPrintf(&m->out, ">> \tPC is now %lli \n", m->registers[PC]);
+    } else if(opcode == BR) {
+        outPrintf(&m->out, "PC = %lli, Instruction: BR %s\n", inst, opStr1); 
+        outPrintf(&m->out, "Branching to instruction %lli from register %s\n", m->registers[op1],  opStr1);
+        outPrintf(&m->out, ">>\tPC is now %lli \n", m->registers[PC]);
+    } else if(opcode == BL) {
+        outPrintf(&m->out, "PC = %lli, Instruction: BL %i\n", inst, op1); 
+        outPrintf(&m->out, "Branching to function at %i. Storing Instruction at %lli in LR.\n", op1, inst+WORD);
+        outPrintf(&m->out, ">>\tPC is now %lli. LR is %lli \n", m->registers[PC], m->registers[LR]);
+    }else if(opcode == B) {
+        outPrintf(&m->out, "PC = %lli, Instruction: B %i ", inst, op1); 
+        outPrintf(&m->out, "Branching to instruction %i\n", op1);
+        outPrintf(&m->out, ">>\tPC is now %lli \n", m->registers[PC]);
+    }
+
+    printStack(m);
+    outPrintf(&m->out, "\n");
+}
+
+// Converts the given register back into a String and stores it in the String passed to it
+
+void ungetOperand(int reg, char * registerStr) {
+    
+    if(reg == XZR) {
         strcpy(registerStr, "XZR");
     } else if (reg == SP) {
         strcpy(registerStr, "SP");
     } else if (reg == LR) {
         strcpy(registerStr, "LR");
     } else {
-        sprintf(registerStr, "X%i", reg);
-   }
+        sprintf(registerStr, "X%i", reg);
+   }
+}
+
+// Accepts an enter press to advance the program. Returns 1 if the line was "c", asking to
+// run on to the next breakpoint or watchpoint.
+
+int waitForAdvance(Machine *m) {
+    int enter = 0, first = EOF;
+    outFlush(&m->out);
+    while(enter != 0x0A && enter != EOF) {
+        printf("> ");
+        enter = getchar();
+        first = (first == EOF) ? enter : first;
+    }
+    return first == 'c' || first == 'C';
+}
+
+// Formats text into the output buffer. A buffer with a sink is written out when it might not
+// have room for the text; one without a sink grows instead.
+
+void outPrintf(OutBuf *out, const char *format, ...) {
+    va_list args;
+
+    if(out->capacity - out->length < LINESIZE * 2) {
+        if(out->sink != NULL && out->data != NULL) {
+            outFlush(out);
+        } else {
+            out->capacity = (out->capacity) ? out->capacity * 2 : OUTBUFSIZE;
+            out->data = realloc(out->data, out->capacity);
+        }
+    }
+    va_start(args, format);
+    int written = vsnprintf(out->data + out->length, out->capacity - out->length, format, args);
+    va_end(args);
+
+    if(written >= (int) (out->capacity - out->length)) {
+        written = out->capacity - out->length - 1;        // truncated, keep what fit
+    }
+    out->length += (written > 0) ? written : 0;
+}
+
+// Writes out everything buffered so far to the buffer's sink.
+
+void outFlush(OutBuf *out) {
+    if(out->sink == NULL) {
+        return;
+    }
+    if(out->length) {
+        fwrite(out->data, 1, out->length, out->sink);
+        out->length = 0;
+    }
+    fflush(out->sink);
+}
+
+// prints contents of the given memory location, from start to end, to the console
+//      'm' : memory
+//      'r' : registers
+// used for debugging
+
+
+void printMemory(Machine *m, char which, long long start, long long end) {
+
+    if(which == 'm') {
+        for(long long i = start; i <= end; i += DOUBLEWORD) {
+            printf("Memory address %llx : %lli\n", i, loadDouble(m, i));
+        }
+
+    } else if(which == 't') {
+        for(long long i = start; i <= end; i += WORD) {
+            TextInstr *t = textAt(m, i);
+            if(t != NULL) {
+                printf("Instruction address %lli : %i %i %i %i\n", i, t->opcode, t->rd, t->rn, t->imm);
+            }
+        }
+    
+    } else if(which == 'r') {
+        for(long long i = start; i <= end; i++) {
+            printf("Register X%lli : %lli\n", i, m->registers[i]);
+        }
+
+    } else {
+        printf("Argument to printMemory() not recognized.\n");
+    }
+}
+
+// Prints the stack contents of the stack if there are any, from the top of memory
+// to the current position of the stack pointer, inclusive. Formats text to present
+// the stack position as a decrementing number from the maxium size of the stack.
+
+void printStack(Machine *m) {
+    long long differenceForPrintingStack = m->stackTop - m->stackSize; // used as offset so stack prints in descending
+    long long i = m->stackTop;                                        // order from STACKSIZE: i.e., 1024, 1023, ...
+
+    if(i >= m->registers[SP]) {
+        outPrintf(&m->out, "Stack:\t%llx : %lli\n", i -differenceForPrintingStack, loadDouble(m, i)); // prints the first stack doubleword
+    }                                                                                           // with the "Stack:" lead in text
+    i-=DOUBLEWORD;
+    while(i >= m->registers[SP]) {
+        outPrintf(&m->out, "\t%llx : %lli\n", i - differenceForPrintingStack, loadDouble(m, i));
+        i-=DOUBLEWORD;
+    }
+}
+
+// Prints every non-zero register plus SP, PC and LR, four to a line.
+
+void printRegisters(Machine *m) {
+    char name[32];
+    int shown = 0;
+
+    for(int i = 0; i < REGISTERSPACE; i++) {
+        if(m->registers[i] != 0 || i == SP || i == PC || i == LR) {
+            ungetOperand(i, name);
+            outPrintf(&m->out, "%s%s: %lli", (shown % 4) ? "\t" : "", name, m->registers[i]);
+            shown++;
+            outPrintf(&m->out, (shown % 4) ? "" : "\n");
+        }
+    }
+    if(shown % 4) {
+        outPrintf(&m->out, "\n");
+    }
+}
+
+// Writes a snapshot to the checkpoint file, saying so unless tracing is off.
+
+void takeCheckpoint(Machine *m, const RunOptions *options, long long executed) {
+    if(writeSnapshot(m, options->checkpointPath, executed) < 0) {
+        outPrintf(&m->out, "Could not write checkpoint %s.\n", options->checkpointPath);
+    } else if(options->trace != TRACE_NONE) {
+        outPrintf(&m->out, "Checkpoint after %lli instructions written to %s.\n", executed, options->checkpointPath);
+    }
+}
+
+// SIGUSR1 handler: asks the running program for a checkpoint at the next slice boundary.
+
+void requestCheckpoint(int signal) {
+    (void) signal;
+    checkpointRequested = 1;
+}
+
+// Reads a breakpoint from "ADDR" or "ADDR:COND", where COND compares a register with a number
+// or another register ("X9>=100", "X1==X2"). Returns -1 if the text is not one.
+
+int parseBreakpoint(char *text, Breakpoint *b) {
+    static const char *operators[] = { "==", "!=", "<=", ">=", "<", ">" };
+    static const int comparisons[] = { CMP_EQ, CMP_NE, CMP_LE, CMP_GE, CMP_LT, CMP_GT };
+    char *end;
+    int length, i;
+
+    b->pc = strtoll(text, &end, 0);
+    b->reg = b->other = -1;
+    if(end == text || b->pc < 0) {
+        return -1;
+    }
+    if(*end == '\0') {
+        return 0;
+    }
+    if(*end != ':' || (b->reg = registerName(end + 1, &length)) < 0) {
+        return -1;
+    }
+    end += 1 + length;
+    for(i = 0; i < 6 && strncmp(end, operators[i], strlen(operators[i])) != 0; i++) {
+    }
+    if(i == 6) {
+        return -1;
+    }
+    b->comparison = comparisons[i];
+    end += strlen(operators[i]);
+    if((b->other = registerName(end, &length)) >= 0) {
+        return (end[length] == '\0') ? 0 : -1;
+    }
+    b->value = strtoll(end, &text, 0);
+    return (text != end && *text == '\0') ? 0 : -1;
+}
+
+// Reads a watchpoint from "ADDR" or "ADDR:r", "ADDR:w" or "ADDR:rw". Plain addresses watch
+// writes. Returns -1 if the text is not one.
+
+int parseWatchpoint(char *text, Watchpoint *w) {
+    char *end;
+
+    w->address = strtoll(text, &end, 0);
+    w->access = WATCH_WRITE;
+    if(end == text) {
+        return -1;
+    }
+    if(*end == '\0') {
+        return 0;
+    }
+    w->access = (strcmp(end, ":r") == 0) ? WATCH_READ : (strcmp(end, ":w") == 0) ? WATCH_WRITE
+              : (strcmp(end, ":rw") == 0) ? WATCH_READ | WATCH_WRITE : 0;
+    return w->access ? 0 : -1;
+}
+
+// Returns 1 if the breakpoint's condition holds for the machine's registers, or it has none.
+
+int breakHolds(Machine *m, const Breakpoint *b) {
+    if(b->reg < 0) {
+        return 1;
+    }
+    long long left = m->registers[b->reg], right = (b->other >= 0) ? m->registers[b->other] : b->value;
+
+    switch(b->comparison) {
+        case CMP_EQ : return left == right;
+        case CMP_NE : return left != right;
+        case CMP_LT : return left < right;
+        case CMP_LE : return left <= right;
+        case CMP_GT : return left > right;
+        default :     return left >= right;
+    }
+}
+
+// Writes the breakpoint's condition as text, like " if X9 >= 100", or nothing if it has none.
+
+void describeBreakpoint(const Breakpoint *b, char *text) {
+    static const char *operators[] = { "==", "!=", "<", "<=", ">", ">=" };
+    char left[32], right[32];
+
+    text[0] = '\0';
+    if(b->reg < 0) {
+        return;
+    }
+    ungetOperand(b->reg, left);
+    if(b->other >= 0) {
+        ungetOperand(b->other, right);
+    } else {
+        sprintf(right, "%lli", b->value);
+    }
+    sprintf(text, " if %s %s %s", left, operators[b->comparison], right);
 }
 
-// Accepts an enter press to advance the program.
+// Runs the program at full speed until a breakpoint whose condition holds is reached, an
+// access hits a watchpoint, or the program ends, then says which and shows where it stopped.
+// Returns like runMachine(), with the instructions run added to executed.
+//
+// Nothing is checked per instruction. Each breakpoint's op is trapped in the decoded stream
+// for the length of the run, so the engines only stop at those PCs; one whose condition does
+// not hold is stepped over by the switch interpreter, which reads the text segment and never
+// sees the trap, and the run goes on. Watched memory is kept off the page fast path
+// by watchAccess(), so only accesses to the pages holding it are checked.
 
-void waitForAdvance() {
-    char enter;
-    while(enter != 0x0A) {
-        printf("> ");
-        enter = getchar();
+int runToBreak(Machine *m, const RunOptions *options, long long *executed) {
+    char condition[LINESIZE];
+    long long done;
+    int exec = 1, stopped = -1, leaving = (*executed > 0), trapped;
+
+    m->watches = options->watches;
+    m->watchCount = options->watchCount;
+    m->pages.lastNumber = NOPAGE;
+    memset(&m->watchHit, 0, sizeof(WatchHit));
+    for(int i = 0; i < options->breakCount; i++) {
+        trapSlot(m, pcToOp(m, options->breaks[i].pc));
+    }
+
+    for(;;) {
+        trapped = 0;
+        for(int i = 0; i < options->breakCount; i++) {
+            if(options->breaks[i].pc == m->registers[PC]) {
+                trapped = 1;
+                stopped = (stopped < 0 && !leaving && breakHolds(m, &options->breaks[i])) ? i : stopped;
+            }
+        }
+        leaving = 0;                              // the breakpoint a run starts from is passed over
+        if(stopped >= 0) {
+            exec = 1;
+            break;
+        }
+        if(exec == 0 && !trapped) {
+            break;                                // the program's own halt
+        }
+        if(trapped) {                             // step over it, leaving the trap in place
+            exec = executeInstruction(m, m->registers[PC]);
+            *executed += (exec == 1);
+            if(exec != 1) {
+                break;
+            }
+        } else {
+            exec = runMachine(m, LLONG_MAX, &done);
+            *executed += done;
+            if(exec < 0) {
+                break;
+            }
+        }
+        if(m->watchHit.number) {
+            break;
+        }
+    }
+
+    for(int i = 0; i < options->breakCount; i++) {
+        restoreSlot(m, pcToOp(m, options->breaks[i].pc));
+    }
+    if(m->watchHit.number) {
+        const WatchHit *hit = &m->watchHit;
+        outPrintf(&m->out, "\nWatchpoint %i: %lli %s after %lli instructions", hit->number, hit->address,
+            (hit->access == WATCH_WRITE) ? "written" : "read", *executed);
+        outPrintf(&m->out, (hit->access == WATCH_WRITE) ? ", %lli -> %lli.\n" : ", value %lli.\n",
+            (hit->access == WATCH_WRITE) ? hit->old : hit->value, hit->value);
+        outputResult(m, m->registers[PC] - WORD);
+    } else if(stopped >= 0) {
+        describeBreakpoint(&options->breaks[stopped], condition);
+        outPrintf(&m->out, "\nBreakpoint %i at PC = %lli%s, after %lli instructions.\n", stopped + 1,
+            m->registers[PC], condition, *executed);
+        printRegisters(m);
     }
+    m->watchCount = 0;
+    return exec;
 }
 
-// prints contents of the given memory location, from start to end, to the console
-//      'm' : memory
-//      'r' : registers
-// used for debugging
+// Prints how a run ended after executed instructions, then the registers and stack if the
+// trace level asks for them.
+
+void reportEnd(Machine *m, int trace, int exec, long long executed) {
+    if(exec == 1) {
+        outPrintf(&m->out, "Stopped after %lli instructions, PC = %lli.\n", executed, m->registers[PC]);
+    } else if(exec == 0 && trace != TRACE_NONE) {
+        outPrintf(&m->out, "Program complete after %lli instructions.\n", executed);
+    }
+    if(trace == TRACE_DUMP || (trace == TRACE_FULL && exec != 0)) {
+        printRegisters(m);
+        printStack(m);
+    }
+}
 
+// Runs the loaded program to completion without pausing. TRACE_FULL writes the same per-step
+// output as the interactive mode, TRACE_DUMP prints the registers and stack at the end, and
+// TRACE_NONE prints nothing but errors. Stops after limit instructions if the program has not
+// finished by then. Returns the exit status for main().
+//
+// With a checkpoint file, a snapshot is written when the program reaches the checkpoint's
+// instruction count or PC, and whenever SIGUSR1 arrives. The PC is caught by trapping its op in
+// the decoded stream, and the signal is checked between slices of CHECKPOINTSLICE instructions.
+// Counts include the instructions run before the snapshot a machine was restored from.
 
-void printMemory(char which, int start, int end) {
+int runHeadless(Machine *m, const RunOptions *options) {
+    long long executed = 0, limit = options->limit, startingPC, slice, done;
+    long long at = options->checkpointAt;
+    int exec = 1, trace = options->trace;
+    DecodedOp *trap = NULL;
 
-    if(which == 'm') {
-        for(int i = start; i <= end; i++) {
-            printf("Memory address %i : %i %i %i %i\n", i, memory[i][0], memory[i][1],
-            memory[i][2], memory[i][3]);
+    if(options->profile) {
+        m->profile = newProfile(m);
+    }
+    if(options->cacheLevels) {
+        m->cache = newCache(m, options);
+    }
+    if(options->predict) {
+        m->predictor = newPredictor(m, options);
+    }
+    if(options->pipeline != PIPELINE_OFF) {
+        m->pipeline = newPipeline(m, options->pipeline == PIPELINE_FORWARDING);
+    }
+    if(options->recordPath != NULL && (m->recorder = newRecorder(m, options->recordPath)) == NULL) {
+        outPrintf(&m->out, "Could not write trace %s.\n", options->recordPath);
+    }
+
+    if(options->checkpointPath != NULL) {
+        if(options->checkpointPc >= 0 && (trap = pcToOp(m, options->checkpointPc)) == NULL) {
+            outPrintf(&m->out, "No instruction at %lli to checkpoint at.\n", options->checkpointPc);
+        } else if(trap != NULL) {
+            trapSlot(m, trap);
         }
-    
-    } else if(which == 'r') {
-        for(int i = start; i <= end; i++) {
-            printf("Register X%i : %i\n", i, registers[i]);
+        checkpointRequested = 0;
+        signal(SIGUSR1, requestCheckpoint);
+    }
+
+    while(exec == 1 && executed < limit) {
+        slice = limit - executed;
+        if(options->checkpointPath != NULL) {
+            slice = (slice < CHECKPOINTSLICE) ? slice : CHECKPOINTSLICE;
+            slice = (at >= m->restoredAt + executed && at - m->restoredAt - executed < slice)
+                  ? at - m->restoredAt - executed : slice;
         }
 
-    } else {
-        printf("Argument to printMemory() not recognized.\n");
+        done = 0;
+        if(trace == TRACE_FULL) {
+            while(exec == 1 && done < slice) {
+                startingPC = m->registers[PC];
+                exec = isObserved(m) ? stepObserved(m) : stepMachine(m);
+                if(exec == 1) {
+                    done++;
+                    outPrintf(&m->out, "\n");
+                    outputResult(m, startingPC);
+                }
+            }
+        } else if(isObserved(m)) {
+            exec = runObserved(m, slice, &done);
+        } else {
+            exec = runMachine(m, slice, &done);
+        }
+        executed += done;
+
+        if(exec == 0 && trap != NULL && pcToOp(m, m->registers[PC]) == trap) {
+            restoreSlot(m, trap);
+            trap = NULL;
+            exec = 1;
+            takeCheckpoint(m, options, m->restoredAt + executed);
+        }
+        if(exec == 1 && (checkpointRequested || (at >= 0 && at == m->restoredAt + executed))) {
+            checkpointRequested = 0;
+            at = -1;
+            takeCheckpoint(m, options, m->restoredAt + executed);
+        }
+    }
+    if(trap != NULL) {
+        restoreSlot(m, trap);
+    }
+    if(options->checkpointPath != NULL) {
+        signal(SIGUSR1, SIG_DFL);
+    }
+    if(m->recorder != NULL) {
+        long long steps = m->recorder->steps, bytes;
+        Recorder *r = m->recorder;
+
+        m->recorder = NULL;
+        bytes = r->bytes + r->length;
+        if(closeRecorder(r, exec) < 0) {
+            outPrintf(&m->out, "Could not write trace %s.\n", options->recordPath);
+        } else if(trace != TRACE_NONE) {
+            outPrintf(&m->out, "Recorded %lli instructions to %s in %lli bytes (%.2f per instruction).\n",
+                steps, options->recordPath, bytes, steps ? (double) bytes / steps : 0.0);
+        }
+    }
+
+    reportEnd(m, trace, exec, m->restoredAt + executed);
+
+    if(m->profile != NULL) {
+        char *base = strrchr(m->name, '/') ? strrchr(m->name, '/') + 1 : m->name;
+        char *path = malloc(strlen(m->name) + (options->profileDir ? strlen(options->profileDir) : 0) + 16);
+
+        if(options->profileDir != NULL) {
+            sprintf(path, "%s/%s.folded", options->profileDir, base);
+        } else {
+            sprintf(path, "%s.folded", m->name);
+        }
+        reportProfile(m);
+        if(writeFolded(m, path) < 0) {
+            outPrintf(&m->out, "\nCould not write folded stacks to %s.\n", path);
+        } else {
+            outPrintf(&m->out, "\nFolded stacks written to %s.\n", path);
+        }
+        free(path);
+    }
+    if(m->cache != NULL) {
+        reportCache(m);
     }
+    if(m->predictor != NULL) {
+        reportPredictor(m);
+    }
+    if(m->pipeline != NULL) {
+        reportPipeline(m);
+    }
+    outFlush(&m->out);
+    return (exec == 0) ? 0 : (exec < 0) ? -1 : 2;
 }
 
-// Prints the stack contents of the stack if there are any, from the top of memory
-// to the current position of the stack pointer, inclusive. Formats text to present
-// the stack position as a decrementing number from the maxium size of the stack.
+// Allocates a machine with nothing loaded, writing its output to stdout.
 
-void printStack() {
-    int differenceForPrintingStack = STACKUPPERBOUND - STACKSIZE; // used as offset so stack prints in descending
-    int i = STACKUPPERBOUND;                                      // order from STACKSIZE: i.e., 1024, 1023, ...
+Machine *newMachine(const RunOptions *options) {
+    Machine *m = calloc(1, sizeof(Machine));
 
-    if(i >= registers[SP]) {
-        printf("Stack:\t%x : %i\n", i -differenceForPrintingStack, memory[i][0]); // prints the first stack doubleword
-    }                                                                             // with the "Stack:" lead in text
-    i-=DOUBLEWORD;
-    while(i >= registers[SP]) {
-        printf("\t%x : %i\n", i - differenceForPrintingStack, memory[i][0]);
-        i-=DOUBLEWORD;
+    m->stackTop = options->stackTop;
+    m->stackSize = options->stackSize;
+    m->pages.lastNumber = NOPAGE;
+    m->fuse = options->fuse;
+    m->engine = options->engine;
+    m->out.sink = stdout;
+    return m;
+}
+
+// Loads and decodes the program in the given file, leaving the machine ready to run from
+// STARTMEM, or from where it stopped if the file is a snapshot. Returns 0, or -1 if the file
+// cannot be read.
+
+int loadProgram(Machine *m, char *file) {
+    char magic[sizeof(IMAGEMAGIC)];
+    struct stat info;
+    FILE* program = fopen(file, "rb");
+
+    if(program == NULL) {
+        return -1;
+    }
+
+    // program images and snapshots are mapped in whole instead of assembled
+    if(fread(magic, 1, strlen(IMAGEMAGIC), program) == strlen(IMAGEMAGIC)
+       && (memcmp(magic, IMAGEMAGIC, strlen(IMAGEMAGIC)) == 0 || memcmp(magic, SNAPSHOTMAGIC, strlen(SNAPSHOTMAGIC)) == 0)) {
+        int snapshot = (memcmp(magic, SNAPSHOTMAGIC, strlen(SNAPSHOTMAGIC)) == 0);
+        fclose(program);
+        if((snapshot ? loadSnapshot(m, file) : loadImage(m, file)) < 0) {
+            return -1;
+        }
+        decodeProgram(m);
+        m->name = strdup(file);
+        if(!snapshot) {
+            m->registers[SP] = m->stackTop;
+        }
+        return 0;
+    }
+
+    // Takes the input from the given file, all at once
+
+    if(fstat(fileno(program), &info) < 0) {
+        fclose(program);
+        return -1;
+    }
+    char *source = malloc(info.st_size + 1);
+    size_t length = 0;
+    rewind(program);
+    length = fread(source, 1, info.st_size, program);
+    source[length] = '\0';
+    fclose(program);
+
+    int status = assembleProgram(m, file, source, length);
+    free(source);
+    if(status < 0) {
+        outFlush(&m->out);
+        return -1;
+    }
+    layoutText(m);
+    decodeProgram(m);
+    m->name = strdup(file);
+
+    m->registers[PC] = STARTMEM;
+    m->registers[SP]= m->stackTop; 
+    return 0;
+}
+
+// Releases a machine and everything it owns.
+
+void freeMachine(Machine *m) {
+    closeRecorder(m->recorder, 1);
+    freeProfile(m->profile);
+    freeCache(m->cache);
+    freePipeline(m->pipeline);
+    freePredictor(m->predictor);
+    free(m->name);
+    freePages(&m->pages);
+    releaseText(m);
+    flushBlocks(m);
+    free(m->blocks);
+    free(m->ops);
+    free(m->loaded);
+    free(m->out.data);
+    free(m);
+}
+
+// qsort() comparison for file names.
+
+int compareNames(const void *a, const void *b) {
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+// Adds the given file, or every visible regular file in the given directory in name order,
+// to the list of programs. Returns -1 if the path cannot be read.
+
+int collectPrograms(char *path, char ***files, int *count) {
+    struct stat info;
+    struct dirent *entry;
+    DIR *dir;
+    int first = *count;
+
+    if(stat(path, &info) != 0) {
+        return -1;
+    }
+    if(!S_ISDIR(info.st_mode)) {
+        *files = realloc(*files, (*count + 1) * sizeof(char *));
+        (*files)[(*count)++] = strdup(path);
+        return 0;
+    }
+    if((dir = opendir(path)) == NULL) {
+        return -1;
+    }
+    while((entry = readdir(dir)) != NULL) {
+        char *full = malloc(strlen(path) + strlen(entry->d_name) + 2);
+        sprintf(full, "%s/%s", path, entry->d_name);
+
+        if(entry->d_name[0] != '.' && stat(full, &info) == 0 && S_ISREG(info.st_mode)) {
+            *files = realloc(*files, (*count + 1) * sizeof(char *));
+            (*files)[(*count)++] = full;
+        } else {
+            free(full);
+        }
+    }
+    closedir(dir);
+    qsort(*files + first, *count - first, sizeof(char *), compareNames);
+    return 0;
+}
+
+// Returns the next task for the given worker, stealing from the other workers when its own
+// deque is empty, or -1 once every deque is empty. No tasks are added after the start, so
+// an empty sweep means the batch is done.
+
+int takeTask(BatchPool *pool, int id) {
+    TaskDeque *own = &pool->deques[id];
+    int task = -1;
+
+    pthread_mutex_lock(&own->lock);
+    if(own->back > own->front) {
+        task = own->tasks[--own->back];
+    }
+    pthread_mutex_unlock(&own->lock);
+
+    for(int i = 1; task < 0 && i < pool->workers; i++) {
+        TaskDeque *victim = &pool->deques[(id + i) % pool->workers];
+        pthread_mutex_lock(&victim->lock);
+        if(victim->back > victim->front) {
+            task = victim->tasks[victim->front++];
+        }
+        pthread_mutex_unlock(&victim->lock);
+    }
+    return task;
+}
+
+// Worker thread: runs tasks on fresh machines until there are none left.
+
+void *batchWorker(void *arg) {
+    BatchWorker *self = arg;
+    BatchPool *pool = self->pool;
+    int task;
+
+    while((task = takeTask(pool, self->id)) >= 0) {
+        BatchTask *t = &pool->tasks[task];
+        Machine *m = newMachine(pool->options);
+        m->out.sink = NULL;                      // keep the output until the batch is printed
+
+        if(loadProgram(m, t->path) < 0) {
+            outPrintf(&m->out, "Could not load %s.\n", t->path);
+            t->status = -1;
+        } else {
+            t->status = runHeadless(m, pool->options);
+        }
+        t->predictor = m->predictor;
+        m->predictor = NULL;
+        t->out = m->out;
+        m->out.data = NULL;
+        freeMachine(m);
+    }
+    return NULL;
+}
+
+// Runs every program found in the given paths on jobs worker threads, then prints each
+// program's output in the order the programs were given. Returns 0 if all of them completed.
+
+int runBatch(char **paths, int count, int jobs, const RunOptions *options) {
+    char **files = NULL;
+    int total = 0, complete = 0, stopped = 0, failed = 0;
+
+    for(int i = 0; i < count; i++) {
+        if(collectPrograms(paths[i], &files, &total) < 0) {
+            printf("Could not read %s.\n", paths[i]);
+        }
+    }
+    if(total == 0) {
+        printf("No programs to run.\n");
+        return -1;
+    }
+    jobs = (jobs < 1) ? 1 : (jobs > total) ? total : jobs;
+
+    BatchPool pool = { calloc(total, sizeof(BatchTask)), calloc(jobs, sizeof(TaskDeque)), jobs, options };
+    BatchWorker *workers = calloc(jobs, sizeof(BatchWorker));
+    pthread_t *threads = calloc(jobs, sizeof(pthread_t));
+
+    for(int i = 0; i < total; i++) {
+        pool.tasks[i].path = files[i];
+    }
+    for(int w = 0; w < jobs; w++) {               // deal out contiguous runs of tasks
+        TaskDeque *d = &pool.deques[w];
+        d->front = (long long) total * w / jobs;
+        d->back = (long long) total * (w + 1) / jobs;
+        d->tasks = malloc(total * sizeof(int));
+        for(int i = 0; i < total; i++) {
+            d->tasks[i] = i;
+        }
+        pthread_mutex_init(&d->lock, NULL);
+        workers[w].pool = &pool;
+        workers[w].id = w;
+    }
+    for(int w = 1; w < jobs; w++) {
+        pthread_create(&threads[w], NULL, batchWorker, &workers[w]);
+    }
+    batchWorker(&workers[0]);                     // the main thread works too
+    for(int w = 1; w < jobs; w++) {
+        pthread_join(threads[w], NULL);
+    }
+
+    for(int i = 0; i < total; i++) {
+        BatchTask *t = &pool.tasks[i];
+        printf("== %s ==\n", t->path);
+        if(t->out.length > 0) {
+            fwrite(t->out.data, 1, t->out.length, stdout);
+        }
+        complete += (t->status == 0);
+        stopped += (t->status == 2);
+        failed += (t->status != 0 && t->status != 2);
+        free(t->out.data);
+        free(t->path);
+    }
+    printf("\n%i programs on %i threads: %i complete, %i stopped at the limit, %i failed.\n",
+        total, jobs, complete, stopped, failed);
+    if(options->predict) {
+        reportCorpusPrediction(pool.tasks, total);
+    }
+    for(int i = 0; i < total; i++) {
+        freePredictor(pool.tasks[i].predictor);
+    }
+
+    for(int w = 0; w < jobs; w++) {
+        free(pool.deques[w].tasks);
+        pthread_mutex_destroy(&pool.deques[w].lock);
+    }
+    free(pool.deques);
+    free(pool.tasks);
+    free(workers);
+    free(threads);
+    free(files);
+    return (complete == total) ? 0 : -1;
+}
+
+// Prints each predictor's accuracy over every program of a batch.
+
+void reportCorpusPrediction(BatchTask *tasks, int count) {
+    long long branches = 0, conditional = 0, correct[NUMSCHEMES] = {0}, conditionalCorrect[NUMSCHEMES] = {0};
+    int enabled = 0;
+
+    for(int i = 0; i < count; i++) {
+        Predictor *p = tasks[i].predictor;
+        if(p == NULL) {
+            continue;
+        }
+        enabled = p->enabled;
+        branches += p->branches;
+        conditional += p->conditional;
+        for(int s = 0; s < NUMSCHEMES; s++) {
+            correct[s] += p->correct[s];
+            conditionalCorrect[s] += p->conditionalCorrect[s];
+        }
+    }
+    printf("\nBranch prediction over all programs: %lli branches, %lli conditional\n%-10s %10s %12s\n",
+        branches, conditional, "scheme", "overall", "conditional");
+    for(int s = 0; s < NUMSCHEMES; s++) {
+        if(enabled & (1 << s)) {
+            printf("%-10s %9.2f%% %11.2f%%\n", SCHEME_NAMES[s], branches ? 100.0 * correct[s] / branches : 0.0,
+                conditional ? 100.0 * conditionalCorrect[s] / conditional : 0.0);
+        }
+    }
+}
+
+// Loads and runs the program at path the given number of times in this process, and fills in
+// the instructions it retired and the time of its fastest run.
+
+void benchProgram(char *path, int repeats, const RunOptions *options, BenchResult *result) {
+    struct timespec start, end;
+
+    for(int run = 0; run < repeats; run++) {
+        Machine *m = newMachine(options);
+        m->out.sink = NULL;
+        if(loadProgram(m, path) < 0) {
+            result->status = -2;
+            freeMachine(m);
+            return;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        int exec = runMachine(m, options->limit, &result->instructions);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        result->seconds = (run == 0 || seconds < result->seconds) ? seconds : result->seconds;
+        result->status = (exec == 0) ? 0 : (exec < 0) ? -1 : 2;
+        freeMachine(m);
+    }
+}
+
+// Runs every program found in the given paths, one at a time and each in a child process of
+// its own, and prints the instructions it retired, its best wall time over repeats runs, MIPS
+// and the child's peak resident memory, then the totals. Returns 0 if all of them completed.
+
+int runBench(char **paths, int count, int repeats, const RunOptions *options) {
+    const char *results[] = { "complete", "", "stopped at the limit" };
+    char **files = NULL;
+    int total = 0, complete = 0;
+    long long instructions = 0;
+    double seconds = 0;
+
+    for(int i = 0; i < count; i++) {
+        if(collectPrograms(paths[i], &files, &total) < 0) {
+            printf("Could not read %s.\n", paths[i]);
+        }
+    }
+    if(total == 0) {
+        printf("No programs to run.\n");
+        return -1;
+    }
+    repeats = (repeats < 1) ? 1 : repeats;
+
+    printf("%-28s %14s %10s %10s %10s  %s\n", "program", "instructions", "seconds", "MIPS", "peak KB", "result");
+    for(int i = 0; i < total; i++) {
+        BenchResult result = { 0, 0, -3 };
+        struct rusage usage;
+        int fds[2], status;
+        pid_t child = -1;
+
+        fflush(stdout);
+        if(pipe(fds) == 0 && (child = fork()) == 0) {
+            close(fds[0]);
+            benchProgram(files[i], repeats, options, &result);
+            _exit(write(fds[1], &result, sizeof(result)) == sizeof(result) ? 0 : 1);
+        }
+        if(child < 0) {
+            printf("%-28s could not start a process to run it\n", files[i]);
+            free(files[i]);
+            continue;
+        }
+        close(fds[1]);
+        if(read(fds[0], &result, sizeof(result)) != sizeof(result)) {
+            result.status = -3;                   // the child died before it could say
+        }
+        close(fds[0]);
+        memset(&usage, 0, sizeof(usage));
+        wait4(child, &status, 0, &usage);
+
+        if(result.status == -2 || result.status == -3) {
+            printf("%-28s %s\n", files[i], (result.status == -2) ? "could not be loaded" : "crashed the emulator");
+        } else {
+            double mips = result.seconds > 0 ? result.instructions / result.seconds / 1e6 : 0.0;
+            printf("%-28s %14lli %10.4f %10.1f %10li  %s\n", files[i], result.instructions, result.seconds, mips,
+                usage.ru_maxrss, (result.status < 0) ? "failed" : results[result.status]);
+            instructions += result.instructions;
+            seconds += result.seconds;
+        }
+        complete += (result.status == 0);
+        free(files[i]);
     }
+    printf("\n%i of %i programs complete: %lli instructions in %.4f seconds, %.1f MIPS overall.\n",
+        complete, total, instructions, seconds, seconds > 0 ? instructions / seconds / 1e6 : 0.0);
+    free(files);
+    return (complete == total) ? 0 : -1;
 }
 
 // Main method //
 
 int main(int argc, char *argv[]) {
 
-    char buffer[LINESIZE];
-    
-    FILE* program = fopen(argv[1], "r");
+    char **files = malloc(argc * sizeof(char *));
+    int fileCount = 0, compareRuns = 0, headless = 0, batch = 0, replay = 0, bench = 0, repeats = BENCHREPEATS;
+    int stackGiven = 0;
+    int jobs = sysconf(_SC_NPROCESSORS_ONLN), badOption = 0;
+    RunOptions options = { .trace = TRACE_DUMP, .limit = LLONG_MAX, .stackTop = STACKUPPERBOUND, .stackSize = STACKSIZE };
+    char *imagePath = NULL, *optimizePath = NULL;
 
-    if(program == NULL || argc < 2 || argc > 2) {
+    options.predictBits = PREDICTORBITS;
+    options.fuse = 1;
+    options.checkpointAt = options.checkpointPc = -1;
+
+    for(int i = 1; i < argc; i++) {
+        if(strcmp(argv[i], "--compare") == 0 && i + 1 < argc) {
+            compareRuns = atoi(argv[++i]);
+        } else if(strcmp(argv[i], "--run") == 0 || strcmp(argv[i], "-r") == 0) {
+            headless = 1;
+        } else if(strncmp(argv[i], "--trace=", 8) == 0) {
+            headless = 1;
+            options.trace = (strcmp(argv[i] + 8, "none") == 0) ? TRACE_NONE
+                  : (strcmp(argv[i] + 8, "full") == 0) ? TRACE_FULL : TRACE_DUMP;
+        } else if(strncmp(argv[i], "--limit=", 8) == 0) {
+            options.limit = atoll(argv[i] + 8);
+        } else if(strncmp(argv[i], "--stack-top=", 12) == 0) {
+            options.stackTop = strtoll(argv[i] + 12, NULL, 0);
+            stackGiven = 1;
+        } else if(strncmp(argv[i], "--stack-size=", 13) == 0) {
+            options.stackSize = strtoll(argv[i] + 13, NULL, 0);
+            stackGiven = 1;
+        } else if(strcmp(argv[i], "--profile") == 0 || strncmp(argv[i], "--profile=", 10) == 0) {
+            headless = 1;
+            options.profile = 1;
+            options.profileDir = (argv[i][9] == '=') ? argv[i] + 10 : NULL;
+        } else if(strncmp(argv[i], "--cache=", 8) == 0) {
+            headless = 1;
+            if(options.cacheLevels == MAXCACHELEVELS
+               || parseCacheConfig(argv[i] + 8, &options.cache[options.cacheLevels++]) < 0) {
+                badOption = 1;
+            }
+        } else if(strcmp(argv[i], "--pipeline") == 0 || strcmp(argv[i], "--pipeline=noforward") == 0) {
+            headless = 1;
+            options.pipeline = (argv[i][10] == '=') ? PIPELINE_NOFORWARDING : PIPELINE_FORWARDING;
+        } else if(strncmp(argv[i], "--predict=", 10) == 0) {
+            headless = 1;
+            badOption |= (parsePredictors(argv[i] + 10, &options) < 0);
+        } else if(strncmp(argv[i], "--predict-bits=", 15) == 0) {
+            options.predictBits = atoi(argv[i] + 15);
+            badOption |= (options.predictBits < 1 || options.predictBits > 24);
+        } else if(strncmp(argv[i], "--ras-depth=", 12) == 0) {
+            options.rasDepth = atoi(argv[i] + 12);
+            badOption |= (options.rasDepth < 0 || options.rasDepth > 4096);
+        } else if(strncmp(argv[i], "--assemble=", 11) == 0) {
+            imagePath = argv[i] + 11;
+        } else if(strncmp(argv[i], "--optimize=", 11) == 0) {
+            optimizePath = argv[i] + 11;
+        } else if(strcmp(argv[i], "--no-fuse") == 0) {
+            options.fuse = 0;
+        } else if(strcmp(argv[i], "--engine=threaded") == 0 || strcmp(argv[i], "--engine=blocks") == 0) {
+            options.engine = (argv[i][9] == 'b') ? ENGINE_BLOCKS : ENGINE_THREADED;
+        } else if(strncmp(argv[i], "--checkpoint=", 13) == 0) {
+            headless = 1;
+            options.checkpointPath = argv[i] + 13;
+        } else if(strncmp(argv[i], "--checkpoint-at=", 16) == 0) {
+            options.checkpointAt = atoll(argv[i] + 16);
+        } else if(strncmp(argv[i], "--checkpoint-pc=", 16) == 0) {
+            options.checkpointPc = strtoll(argv[i] + 16, NULL, 0);
+        } else if(strncmp(argv[i], "--record=", 9) == 0) {
+            headless = 1;
+            options.recordPath = argv[i] + 9;
+        } else if(strncmp(argv[i], "--lanes=", 8) == 0) {
+            headless = 1;
+            options.lanesPath = argv[i] + 8;
+        } else if(strncmp(argv[i], "--break=", 8) == 0) {
+            badOption |= (options.breakCount == MAXBREAKS
+                          || parseBreakpoint(argv[i] + 8, &options.breaks[options.breakCount++]) < 0);
+        } else if(strncmp(argv[i], "--watch=", 8) == 0) {
+            badOption |= (options.watchCount == MAXWATCHES
+                          || parseWatchpoint(argv[i] + 8, &options.watches[options.watchCount++]) < 0);
+        } else if(strcmp(argv[i], "--replay") == 0) {
+            replay = 1;
+        } else if(strcmp(argv[i], "--batch") == 0) {
+            batch = 1;
+        } else if(strcmp(argv[i], "--bench") == 0) {
+            bench = 1;
+        } else if(strncmp(argv[i], "--repeat=", 9) == 0) {
+            repeats = atoi(argv[i] + 9);
+        } else if(strncmp(argv[i], "--jobs=", 7) == 0) {
+            jobs = atoi(argv[i] + 7);
+        } else if(strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            jobs = atoi(argv[++i]);
+        } else if(argv[i][0] != '-') {
+            files[fileCount++] = argv[i];
+        } else {
+            badOption = 1;
+        }
+    }
+
+    runDecoded(NULL, NULL, 0, NULL);             // exports the threaded handler table
+    runBlocks(NULL, 0, NULL);                    // and the block handler table
+
+    badOption |= (batch && (options.checkpointPath != NULL || options.recordPath != NULL));  // they would all write one file
+    badOption |= (batch && options.lanesPath != NULL);
+    badOption |= (optimizePath != NULL && (batch || replay || imagePath != NULL));
+    badOption |= (bench && (batch || replay || headless || compareRuns > 0 || optimizePath != NULL || imagePath != NULL
+                            || options.breakCount || options.watchCount));
+
+    if(bench && !badOption && fileCount) {
+        if(!stackGiven) {
+            options.stackTop = BENCHSTACKTOP;
+            options.stackSize = BENCHSTACKSIZE;
+        }
+        int status = runBench(files, fileCount, repeats, &options);
+        free(files);
+        return status;
+    }
+    badOption |= ((options.breakCount || options.watchCount) && (headless || batch || replay || compareRuns > 0));
+
+    if(batch && !badOption && fileCount) {
+        int status = runBatch(files, fileCount, jobs, &options);
+        free(files);
+        return status;
+    }
+
+    Machine *m = newMachine(&options);
+
+    if(replay && !badOption && fileCount == 1) {
+        int status = replayTrace(m, files[0], &options);
+        freeMachine(m);
+        free(files);
+        return status;
+    }
+
+    if(badOption || fileCount != 1 || loadProgram(m, files[0]) < 0) {
         printf("Please try again with a valid file.\n");
+        printf("Usage: %s [--run] [--trace=none|dump|full] [--limit=N] [--compare N] program.txt\n", argv[0]);
+        printf("       (any mode) [--stack-top=ADDR] [--stack-size=BYTES] [--profile[=DIR]]\n");
+        printf("       (any mode) [--cache=SIZE:WAYS:LINE[:lru|random]]... one per level, L1 first\n");
+        printf("       (any mode) [--pipeline[=noforward]] [--no-fuse] [--engine=threaded|blocks]\n");
+        printf("       (any mode) [--predict=nottaken,2bit,gshare,ras|all] [--predict-bits=N] [--ras-depth=N]\n");
+        printf("       (any mode) [--checkpoint=FILE [--checkpoint-at=N] [--checkpoint-pc=ADDR]], or SIGUSR1\n");
+        printf("       (any mode) [--record=TRACE]\n");
+        printf("       %s [--break=ADDR[:REG<OP>VALUE]]... [--watch=ADDR[:r|w|rw]]... program.txt\n", argv[0]);
+        printf("       %s --lanes=INPUTS [--compare N] [--trace=none|dump] [--limit=N] program.txt\n", argv[0]);
+        printf("       %s --replay [--trace=none|dump|full] [--limit=N] TRACE\n", argv[0]);
+        printf("       %s --assemble=IMAGE program.txt\n", argv[0]);
+        printf("       %s --optimize=OUT [--limit=N] program.txt\n", argv[0]);
+        printf("       %s --batch [-j N] [--trace=none|dump|full] [--limit=N] programs-or-directories...\n", argv[0]);
+        printf("       %s --bench [--repeat=N] [--limit=N] [--engine=threaded|blocks] [--no-fuse] programs-or-directories...\n", argv[0]);
+        freeMachine(m);
+        free(files);
         return -1;
     }
+    free(files);
 
-    // Takes the input from the given file
+    if(imagePath != NULL) {
+        int status = writeImage(m, imagePath);
+        if(status < 0) {
+            printf("Could not write %s.\n", imagePath);
+        } else {
+            printf("Wrote %i instruction slots to %s.\n", m->textSlots, imagePath);
+        }
+        freeMachine(m);
+        return status;
+    }
 
-    while(fgets(buffer, LINESIZE, program)) {
-        parseBuffer(buffer);
+    if(optimizePath != NULL) {
+        int status = optimizeProgram(m, optimizePath, &options);
+        freeMachine(m);
+        return status;
     }
 
-    fclose(program);
+    if(options.lanesPath != NULL) {
+        int status = runLanes(m, &options, compareRuns);
+        outFlush(&m->out);
+        freeMachine(m);
+        return status;
+    }
+
+    if(compareRuns > 0 || headless) {
+        int status = (compareRuns > 0) ? compareEngines(m, compareRuns) : runHeadless(m, &options);
+        outFlush(&m->out);
+        freeMachine(m);
+        return status;
+    }
         
-    printf("Press ENTER to execute next instruction\n\n");
+    int debugging = (options.breakCount || options.watchCount);
+    for(int i = 0; i < options.breakCount; i++) {
+        if(pcToOp(m, options.breaks[i].pc) == NULL) {
+            printf("No instruction at %lli to break at.\n", options.breaks[i].pc);
+            freeMachine(m);
+            return -1;
+        }
+    }
 
-    registers[PC] = STARTMEM;
-    registers[SP]= STACKUPPERBOUND; 
+    printf("Press ENTER to execute next instruction\n\n");
+    if(debugging) {
+        printf("Running to the first breakpoint or watchpoint. Enter c to run on to the next.\n");
+    }
 
-    int exec = 1, startingPC;
+    long long startingPC, executed = 0;
+    int exec = 1, running = debugging;
     while(exec) { 
-        startingPC = registers[PC];     // saves the original memory location for output
-        exec = executeInstruction(registers[PC]);
+        startingPC = m->registers[PC];     // saves the original memory location for output
+        if(running) {
+            exec = runToBreak(m, &options, &executed);
+        } else {
+            exec = stepMachine(m);
+            executed += (exec == 1);
+        }
         if(exec < 0) {
+            outFlush(&m->out);
+            freeMachine(m);
             return -1;
         }
 
         if(exec) {
-            printf("\n");
-            outputResult(startingPC);
-            waitForAdvance();
+            if(!running) {
+                outPrintf(&m->out, "\n");
+                outputResult(m, startingPC);
+            }
+            running = waitForAdvance(m) && debugging;
         } else {
+            outFlush(&m->out);
             printf("Program complete. Now exiting.\n");
             break;
         }
     }
     
-    // printMemory('m', 0, MEMSIZE -1);
-    // printMemory('r', 0, 31); 
+    // printMemory(m, 'm', m->stackTop - m->stackSize, m->stackTop);
+    // printMemory(m, 'r', 0, 31); 
+    freeMachine(m);
     return 0;
 }
\ No newline at end of file
@@ -3,95 +3,530 @@
 This program prompts the user for input, checks it against a given wordlist to confirm its
 spelling, and offer suggestions if its incorrectly spelled.
 
+The word list file is mapped and used as it is, through an index of each word's offset and length,
+so words are not NUL-terminated. Words are looked up in a case-insensitive hash set, and a miss takes
+its suggestions from a deletion index (the SymSpell method, up to MAX_EDITS edits) and then from the
+closest words of the same length by Hamming distance. --compile writes the list and its indexes into
+a dictionary file that later runs just map (see DictHeader), --dawg uses a DAWG built from the list
+instead, and --check checks whole documents on a pool of threads.
+
 */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <strings.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 // FUNCTION PROTOTYPES
 
 int loadFile(char *file);
-void checkWord(int len);
-int containsWord(char *word, int, int);  
-int getHam(char *str1, char *str2);
+int indexWords();
+int mapCompiled(char *file);
+int checkCompiled();
+int sectionFits(int offset, long long bytes);
+int compileFile(char *source, char *target);
+int writeSection(FILE *out, void *data, int bytes, int *offset);
+void releaseList();
+void checkWord();
+int containsWord(char *word);
+unsigned int hashWord(char *word, int len);
+void buildWordSet(int len);
+void buildBuckets(int len);
+void findSuggestions(char *word, int wordLen);
+int getHam(const char *query, const char *row, int stride);
+void buildDeleteIndex(int len);
+int wordDeletes(char *word, int len, unsigned int *hashes);
+int addDelete(unsigned int *hashes, int count, char *prefix, int len, int skip1, int skip2);
+void findEditSuggestions(char *word, int wordLen);
+int editDistance(char *word, int wordLen, char *test, int testLen, int max);
 void clearSuggestions();
 void updateLittleHams(int ham, int hamdex);
 void printSuggestions(char *word);
 void offerSuggestions(char *word);
+void sortSuggestions();
+int compareWords(int first, int second);
 void cleanInput(char *word);
+int buildDawg(int len);
+int compareOrder(const void *first, const void *second);
+int freezeNode(unsigned int *edges, int count);
+int dawgContains(char *word);
+void dawgSuggestions(char *word, int wordLen);
+void findDawgSuggestions(char *word, int wordLen);
+void dawgSearch(int node, int depth);
+void addDawgSuggestion(int edits, int len);
+void printDawg(int node, int depth);
+int checkDocuments(char *list, char **paths, int count, int threads);
+int addDocument(char *name);
+void tokenize(int document);
+long flushBatch(int threads);
+void *checkWorker(void *unused);
+void checkTokens(int start, int end);
+int tokenListed(char *word, int *len);
+char *suggestionList(char *word, int wordLen);
 
 // MACROS
 
 #define MAX_WORD_LEN 40
-#define MAX_WORDS 110000
+#define MAX_PATH_LEN 1024
 #define SUGGESTIONS 5
-#define ALPHABET 26
+#define MAX_EDITS 2
+#define PREFIX_LEN 7
+#define MAX_DELETES 29  // 1 + 7 + 21 ways to delete up to MAX_EDITS letters from PREFIX_LEN
+#define DICT_MAGIC "SPELLDIC"
+#define DICT_VERSION 1
+#define WORD(i) (words + wordStart[i])  // the first letter of word i, which is not NUL-terminated
+#define DAWG_FINAL 0x100                 // DAWG edge bits: a word ends after this edge
+#define DAWG_LAST 0x200                  //  this is the last edge of its node
+#define DAWG_CHILD(edge) ((edge) >> 10)  //  the first edge of the node it leads to, 0 for none
+#define DAWG_MAX_EDGES (1 << 22)
+#define TOKEN_CHUNK 256        // words a thread claims at a time when checking documents
+#define BATCH_TOKENS (1 << 20) // words, or
+#define BATCH_DOCUMENTS 256    //  documents, read before checking and printing them
+#define ROW_STRIDE(len) (((len) + 15) & ~15)  // bytes per bucket row, padded for 16-byte compares
+
+// TYPES
+
+// The header of a compiled dictionary. Each section it points to starts on a 16-byte boundary
+// and holds the matching global's contents, so a loaded list can use the file as it is.
+
+typedef struct {
+    char magic[8];                    //  DICT_MAGIC
+    int version;                      //  DICT_VERSION
+    int maxWordLen;                   //  MAX_WORD_LEN, PREFIX_LEN and MAX_EDITS the indexes were
+    int prefixLen;                    //   built with
+    int maxEdits;
+    int wordCount;
+    int wordSetSize;
+    int deleteTableSize;
+    int deleteCount;                  //  number of entries in deleteWords
+    int bucketCount[MAX_WORD_LEN];
+    int bucketRows[MAX_WORD_LEN];     //  the rest are offsets of sections from the start of the file
+    int bucketWords[MAX_WORD_LEN];
+    int words;
+    int wordStart;
+    int wordLength;
+    int wordSet;
+    int deleteStart;
+    int deleteWords;
+    int size;                         //  size of the whole file
+} DictHeader;
+
+// A document being checked, mapped from its file or read from stdin.
+
+typedef struct {
+    char *name;                       //  its path, or - for stdin
+    char *text;
+    size_t size;
+    int mapped;                       //  1 if text is mapped, 0 if it was read into memory
+} Document;
+
+// A word found in a document, and what checking it found.
+
+typedef struct {
+    int document;                     //  index into documents
+    int line;                         //  line and byte column of its first letter, from 1
+    int column;
+    char *text;                       //  its letters in the document, not NUL-terminated
+    int length;
+    char *suggestions;                //  if misspelled: its suggestions separated by commas, else NULL
+} Token;
 
 // GLOBALS
 
-char wordList[MAX_WORDS][MAX_WORD_LEN];
-char currentFile[MAX_WORD_LEN];
-int firstLetter[ALPHABET][2];     //  [0] = starting index for each letter [1] = number of words per letter
-                                  //  used for checking if word is in list before hamming.
-int suggestions[SUGGESTIONS][2];  //  [0] = index of suggestion [1] = hamming distance
-                                  //   used for storing suggestions
+char *mapping;                    //  the mapped word list or compiled dictionary file
+size_t mappingSize;               //  its size in bytes
+int compiledList;                 //  1 if the indexes below point into a compiled dictionary
+char *words;                      //  the words: the word list file itself, or a section of a compiled one
+size_t wordsSize;                 //  its size in bytes
+int *wordStart;                   //  per word: its offset into words
+unsigned char *wordLength;        //  per word: its length
+int *wordSet;                     //  open-addressing hash set of word indexes + 1, 0 for an empty slot
+int wordSetSize;                  //  a power of two, at least twice the number of words
+char *bucketRows[MAX_WORD_LEN];   //  per word length: lowercase rows of ROW_STRIDE(length) bytes
+int *bucketWords[MAX_WORD_LEN];   //  per word length: the word list index of each row
+int bucketCount[MAX_WORD_LEN];    //  per word length: number of rows
+int *deleteStart;                 //  deletion index: bucket b lists deleteWords[deleteStart[b]] up to
+                                  //   deleteWords[deleteStart[b+1]], for deletes hashing to b
+int *deleteWords;                 //  word list indexes, grouped by bucket
+int deleteTableSize;              //  number of buckets, a power of two
+_Thread_local int *candidateSeen; //  per word: the last lookup that checked it, so it is checked once
+_Thread_local int lookupCount;    //  number of deletion index lookups so far
+_Thread_local int suggestions[SUGGESTIONS][2]; //  [0] = index of suggestion [1] = hamming distance
+                                  //   kept as a max-heap on distance while searching
+_Thread_local int suggestionCount; //  number of suggestions found so far
+int useDawg;                      //  1 to check and suggest with the DAWG instead of the flat list
+unsigned int *dawg;               //  DAWG edges, each node a run ending in DAWG_LAST; dawg[0] is unused
+int dawgSize;                     //  number of edges
+int dawgCapacity;                 //  number of edges allocated
+int dawgRoot;                     //  first edge of the root node
+int *dawgRegister;                //  while building: hash set of the first edges of finished nodes
+int dawgRegisterSize;             //   a power of two, at least twice the number of nodes
+int dawgNodes;                    //   number of finished nodes
+_Thread_local char dawgQuery[MAX_WORD_LEN]; //  while searching: the lowercase input word
+_Thread_local int dawgQueryLen;
+_Thread_local char dawgPrefix[MAX_WORD_LEN]; //   the letters of the path being walked
+_Thread_local int dawgRows[MAX_WORD_LEN + 1][MAX_WORD_LEN + 1]; //   edit distance rows per prefix letter
+_Thread_local int dawgMax;        //   most edits a suggestion may need
+_Thread_local char dawgFound[SUGGESTIONS][MAX_WORD_LEN]; //  the closest words found, closest first
+_Thread_local int dawgFoundEdits[SUGGESTIONS];
+_Thread_local int dawgFoundCount;
+FILE *messages;                   //  where loading reports go: stdout, or stderr when checking documents
+Document documents[BATCH_DOCUMENTS];  //  the documents being checked in this batch
+int documentCount;
+Token *tokens;                    //  their words, in order
+int tokenCount;
+int tokenCapacity;
+int nextToken;                    //  the first word no thread has claimed yet
+int listWords;                    //  number of words in the list, for each thread's candidateSeen
+pthread_mutex_t poolLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t poolWork = PTHREAD_COND_INITIALIZER;   //  a batch is ready, or the pool is stopping
+pthread_cond_t poolDone = PTHREAD_COND_INITIALIZER;   //  every thread is done with the batch
+int poolBatch;                    //  number of batches handed to the pool
+int poolBusy;                     //  threads not yet done with this batch
+int poolStop;                     //  1 when the threads should exit
 
 
-// Given a valid file, loads it into the wordlist and returns the number of words in the list.
+// Given a valid file, maps it in and returns the number of words in the list. A compiled dictionary
+// is used as it is; anything else is indexed as a word list.
 
 int loadFile(char *file) {
-    char word[MAX_WORD_LEN];
-    int idx = 0;
-    
-    FILE* wordFile = fopen(file, "r");
+    struct stat info;
+    char *mapped = NULL;
+    int len;
 
-    if(wordFile == NULL) {
-        printf("\nInvalid file :: now exiting Spell Check. \n\n");
+    int wordFile = open(file, O_RDONLY);
+
+    if(wordFile < 0 || fstat(wordFile, &info) < 0 || info.st_size > 0x7fffffff ||
+            (info.st_size > 0 && (mapped = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, wordFile, 0)) == MAP_FAILED)) {
+        fprintf(messages, "\nInvalid file :: now exiting Spell Check. \n\n");
+        if(wordFile >= 0) {
+            close(wordFile);
+        }
         return 0;
     }
+    close(wordFile);
 
-    printf("\nPreparing word list from %s...\n", file);
-    int i = 0, num = 0; //iterates through word list and counts how many words of each letter there are.
+    fprintf(messages, "\nPreparing word list from %s...\n", file);
 
-    // Takes the input from the given file and stores it in the world list.
+    releaseList();
+    mapping = mapped;
+    mappingSize = info.st_size;
 
-    while(fgets(word, MAX_WORD_LEN, wordFile)) {    
-        
-        char startingChar = tolower(word[0]);
-        if(startingChar != ('a' + idx)) {
+    if(mappingSize >= sizeof(DictHeader) && !memcmp(mapping, DICT_MAGIC, 8)) {
+        len = mapCompiled(file);
+    } else {
+        len = indexWords();
+    }
+
+    if(useDawg && len) {
+        len = buildDawg(len);
+        releaseList();    // only the DAWG is kept.
+    } else {
+        candidateSeen = calloc(len + 1, sizeof(int));
+        lookupCount = 0;
+    }
+
+    if(len) {
+        fprintf(messages, "\n>> %i words loaded.\n\n", len);
+    }
+    return len;
+}
+
+// Indexes each line of the mapped file up to a newline or carriage return as a word, builds the
+// lookup and suggestion indexes, and returns the number of words. Blank lines are skipped, and so
+// are lines too long for MAX_WORD_LEN.
+
+int indexWords() {
+    char *line, *end;
+    int i = 0, lines = 1, tooLong = 0, length;
+
+    words = mapping;
+    wordsSize = mappingSize;
+
+    // Sizes the index by the number of lines, then records where each word starts and its length.
+
+    for(line = words; wordsSize > 0 && (line = memchr(line, '\n', words + wordsSize - line)) != NULL; line++) {
+        lines++;
+    }
+    wordStart = malloc(lines * sizeof(int));
+    wordLength = malloc(lines);
 
-            idx = (int) startingChar - 'a';
-            firstLetter[idx][0] = i;
-            num = 0;
-            
+    for(line = words; line < words + wordsSize; line = end + 1) {
+        end = memchr(line, '\n', words + wordsSize - line);
+        if(end == NULL) {
+            end = words + wordsSize;
         }
-        int len = 0;
+        for(length = 0; line + length < end && line[length] != '\r'; length++);
 
-        cleanInput(word);
-        strcpy(wordList[i], word);
-    
-        i++;
-        num++;
-        firstLetter[idx][1] = num;  // stores how many letters start with that character
+        if(length >= MAX_WORD_LEN) {
+            tooLong++;
+        } else if(length > 0) {
+            wordStart[i] = line - words;
+            wordLength[i] = length;
+            i++;
+        }
     }
 
-    fclose(wordFile);
-    printf("\n>> %i words loaded.\n\n", i);
+    if(tooLong) {
+        fprintf(messages, "\n>> Skipped %i words longer than %i letters.\n", tooLong, MAX_WORD_LEN - 1);
+    }
+    if(!useDawg) {
+        buildWordSet(i);
+        buildBuckets(i);
+        buildDeleteIndex(i);
+    }
     return i;
 }
 
-// Takes the length of the word list and handles the logical flow of the spell check operation.
+// Checks the header of the mapped compiled dictionary and points the word list and its indexes
+// into it. Returns the number of words, or 0 if it was compiled by another version, with other
+// settings, or is cut short or damaged.
+
+int mapCompiled(char *file) {
+    DictHeader *header = (DictHeader *) mapping;
+
+    if(header->version != DICT_VERSION || header->maxWordLen != MAX_WORD_LEN ||
+            header->prefixLen != PREFIX_LEN || header->maxEdits != MAX_EDITS ||
+            header->size < 0 || (size_t) header->size != mappingSize || !checkCompiled()) {
+        fprintf(messages, "\n%s was compiled by another version of Spell Check, or is damaged. Please compile it again.\n\n", file);
+        return 0;
+    }
+
+    compiledList = 1;
+    words = mapping + header->words;
+    wordsSize = header->wordStart - header->words;
+    wordStart = (int *) (mapping + header->wordStart);
+    wordLength = (unsigned char *) (mapping + header->wordLength);
+    wordSet = (int *) (mapping + header->wordSet);
+    wordSetSize = header->wordSetSize;
+    deleteStart = (int *) (mapping + header->deleteStart);
+    deleteWords = (int *) (mapping + header->deleteWords);
+    deleteTableSize = header->deleteTableSize;
+
+    for(int length = 0; length < MAX_WORD_LEN; length++) {
+        bucketCount[length] = header->bucketCount[length];
+        bucketRows[length] = mapping + header->bucketRows[length];
+        bucketWords[length] = (int *) (mapping + header->bucketWords[length]);
+    }
+
+    fprintf(messages, "\n>> Mapped compiled dictionary (version %i, %.1f MB).\n", header->version, mappingSize / 1048576.0);
+    return header->wordCount;
+}
+
+// Checks that every section of the mapped compiled dictionary lies within the file at the size its
+// counts call for, that the tables are powers of two, and that every offset and word index stored
+// in them points inside the section it refers to, so a damaged file is refused rather than read
+// out of bounds. Returns 1 if it can be used.
+
+int checkCompiled() {
+    DictHeader *header = (DictHeader *) mapping;
+    int count = header->wordCount, *starts, *set, *deletes, *deleteWordList, used = 0;
+    unsigned char *lengths;
+    long long wordsBytes = (long long) header->wordStart - header->words;
+
+    if(count < 1 || header->wordSetSize <= count || (header->wordSetSize & (header->wordSetSize - 1)) ||
+            header->deleteTableSize < 1 || (header->deleteTableSize & (header->deleteTableSize - 1)) ||
+            header->deleteCount < 0 || header->words < (int) sizeof(DictHeader) || wordsBytes < 0 ||
+            !sectionFits(header->words, wordsBytes) ||
+            !sectionFits(header->wordStart, (long long) count * sizeof(int)) ||
+            !sectionFits(header->wordLength, count) ||
+            !sectionFits(header->wordSet, (long long) header->wordSetSize * sizeof(int)) ||
+            !sectionFits(header->deleteStart, ((long long) header->deleteTableSize + 1) * sizeof(int)) ||
+            !sectionFits(header->deleteWords, (long long) header->deleteCount * sizeof(int))) {
+        return 0;
+    }
+    for(int length = 0; length < MAX_WORD_LEN; length++) {
+        if(header->bucketCount[length] < 0 ||
+                !sectionFits(header->bucketRows[length], (long long) header->bucketCount[length] * ROW_STRIDE(length)) ||
+                !sectionFits(header->bucketWords[length], (long long) header->bucketCount[length] * sizeof(int))) {
+            return 0;
+        }
+        for(int row = 0; row < header->bucketCount[length]; row++) {
+            int index = ((int *) (mapping + header->bucketWords[length]))[row];
+            if(index < 0 || index >= count) {
+                return 0;
+            }
+        }
+    }
+
+    starts = (int *) (mapping + header->wordStart);
+    lengths = (unsigned char *) (mapping + header->wordLength);
+    for(int i = 0; i < count; i++) {
+        if(starts[i] < 0 || lengths[i] < 1 || lengths[i] >= MAX_WORD_LEN || starts[i] + lengths[i] > wordsBytes) {
+            return 0;
+        }
+    }
+
+    // The set needs an empty slot to end every probe, and each bucket of the deletion index must
+    // be a range of deleteWords.
+
+    set = (int *) (mapping + header->wordSet);
+    for(int slot = 0; slot < header->wordSetSize; slot++) {
+        if(set[slot] < 0 || set[slot] > count) {
+            return 0;
+        }
+        used += set[slot] != 0;
+    }
+    deletes = (int *) (mapping + header->deleteStart);
+    deleteWordList = (int *) (mapping + header->deleteWords);
+    if(used > count || deletes[0] != 0 || deletes[header->deleteTableSize] != header->deleteCount) {
+        return 0;
+    }
+    for(int bucket = 0; bucket < header->deleteTableSize; bucket++) {
+        if(deletes[bucket + 1] < deletes[bucket]) {
+            return 0;
+        }
+    }
+    for(int i = 0; i < header->deleteCount; i++) {
+        if(deleteWordList[i] < 0 || deleteWordList[i] >= count) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Returns 1 if a section of bytes at offset, padded to a 16-byte boundary, lies within the mapped
+// compiled dictionary.
+
+int sectionFits(int offset, long long bytes) {
+    return offset >= 0 && offset % 16 == 0 && bytes >= 0 && offset + ROW_STRIDE(bytes) <= (long long) mappingSize;
+}
+
+// Loads the source word list, then writes it and all of its indexes to target as a compiled
+// dictionary. Returns 1 on success.
+
+int compileFile(char *source, char *target) {
+    DictHeader header;
+    int len = loadFile(source), offset = 0, *starts;
+    FILE *out;
+
+    if(!len) {
+        return 0;
+    }
+    if((out = fopen(target, "wb")) == NULL) {
+        printf("\nCould not write %s.\n\n", target);
+        return 0;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, DICT_MAGIC, 8);
+    header.version = DICT_VERSION;
+    header.maxWordLen = MAX_WORD_LEN;
+    header.prefixLen = PREFIX_LEN;
+    header.maxEdits = MAX_EDITS;
+    header.wordCount = len;
+    header.wordSetSize = wordSetSize;
+    header.deleteTableSize = deleteTableSize;
+    header.deleteCount = deleteStart[deleteTableSize];
+
+    // Writes a placeholder header, then the sections, then the header again with their offsets.
+    // The words are packed end to end, so their offsets are worked out again as they are written.
+
+    writeSection(out, &header, sizeof(header), &offset);
+
+    starts = malloc(len * sizeof(int));
+    header.words = offset;
+    for(int i = 0, start = 0; i < len; start += wordLength[i], i++) {
+        starts[i] = start;
+        fwrite(WORD(i), 1, wordLength[i], out);
+    }
+    writeSection(out, NULL, starts[len - 1] + wordLength[len - 1], &offset);
+
+    header.wordStart = writeSection(out, starts, len * sizeof(int), &offset);
+    header.wordLength = writeSection(out, wordLength, len, &offset);
+    header.wordSet = writeSection(out, wordSet, wordSetSize * sizeof(int), &offset);
+    header.deleteStart = writeSection(out, deleteStart, (deleteTableSize + 1) * sizeof(int), &offset);
+    header.deleteWords = writeSection(out, deleteWords, header.deleteCount * sizeof(int), &offset);
+
+    for(int length = 0; length < MAX_WORD_LEN; length++) {
+        header.bucketCount[length] = bucketCount[length];
+        header.bucketRows[length] = writeSection(out, bucketRows[length], bucketCount[length] * ROW_STRIDE(length), &offset);
+        header.bucketWords[length] = writeSection(out, bucketWords[length], bucketCount[length] * sizeof(int), &offset);
+    }
+    header.size = offset;
+    free(starts);
+
+    fseek(out, 0, SEEK_SET);
+    fwrite(&header, sizeof(header), 1, out);
+    if(fclose(out) != 0) {
+        printf("\nCould not write %s.\n\n", target);
+        return 0;
+    }
+    printf(">> Compiled %i words into %s (%.1f MB).\n", len, target, header.size / 1048576.0);
+    return 1;
+}
+
+// Writes bytes of data to a compiled dictionary at offset, which is moved past it and the padding
+// up to the next 16-byte boundary. With no data, only pads what was already written. Returns where
+// the data starts.
+
+int writeSection(FILE *out, void *data, int bytes, int *offset) {
+    static const char padding[16];
+    int start = *offset;
+
+    if(data != NULL) {
+        fwrite(data, 1, bytes, out);
+    }
+    *offset = start + ROW_STRIDE(bytes);
+    fwrite(padding, 1, *offset - start - bytes, out);
+    return start;
+}
+
+// Frees the current word list's indexes, unless they point into a compiled dictionary, and unmaps
+// its file.
+
+void releaseList() {
+    if(!compiledList) {
+        free(wordStart);
+        free(wordLength);
+        free(wordSet);
+        free(deleteStart);
+        free(deleteWords);
+        for(int length = 0; length < MAX_WORD_LEN; length++) {
+            free(bucketRows[length]);
+            free(bucketWords[length]);
+        }
+    }
+    free(candidateSeen);
 
-void checkWord(int len) {
+    wordStart = NULL;
+    wordLength = NULL;
+    wordSet = NULL;
+    deleteStart = NULL;
+    deleteWords = NULL;
+    candidateSeen = NULL;
+    for(int length = 0; length < MAX_WORD_LEN; length++) {
+        bucketRows[length] = NULL;
+        bucketWords[length] = NULL;
+        bucketCount[length] = 0;
+    }
+
+    if(mapping != NULL) {
+        munmap(mapping, mappingSize);
+    }
+    mapping = NULL;
+    compiledList = 0;
+}
+
+// Handles the logical flow of the spell check operation.
+
+void checkWord() {
     char word[MAX_WORD_LEN];     
-    int ham, smallestHam, listIterator, checkedStart, checkedEnd;
     size_t wordLen;                
 
     while(1) {
         clearSuggestions();
-        listIterator = 0;
 
         printf("\n----------------------------------------------------------------------------");
         printf("\nPlease enter the spelling you wish checked (Enter nothing to return to menu) ");
@@ -108,106 +543,988 @@ void checkWord(int len) {
         }
     
         wordLen -= 1;
-        smallestHam = wordLen;
-        checkedStart = firstLetter[tolower(word[0]) - 'a'][0];
-        checkedEnd = checkedStart + firstLetter[word[0] - 'a'][1]; // to skip words already checked by containsWord()
 
-        if(!containsWord(word, checkedStart, checkedEnd)) {      
+        if(useDawg ? dawgContains(word) : containsWord(word)) {      
             printf("\nExcellent job! %s is spelled correctly!\n", word);
+        } else if(useDawg) {
+            dawgSuggestions(word, wordLen);
         } else {
-
-            while(listIterator < len && smallestHam) {   //iterate through word list. 
-
-                if(wordLen == strlen(wordList[listIterator]) 
-                              // does not recheck words checked by containsWord()
-                && (listIterator < checkedStart || listIterator >= checkedEnd)) {  
-                    ham = getHam(word, wordList[listIterator]);             // sets the hamming distance
-                    smallestHam = (smallestHam < ham) ? smallestHam : ham;  // assignes new smallestHam if applicable
-                    updateLittleHams(ham, listIterator);                    // checks the current word against the suggestions array
-                } 
-                listIterator++;
+            findEditSuggestions(word, wordLen);   // look up the deletion index, only on a miss.
+            if(suggestionCount < SUGGESTIONS) {
+                findSuggestions(word, wordLen);   // fill up from the bucket for this length.
             }
             offerSuggestions(word);
         } 
     }
 }
 
-// Updates the suggestions array based on the given hamming distance and index.
+// Offers a word to the suggestions heap. The worst suggestion kept sits at the root, and is
+// replaced if the new word is closer; on equal distance the earlier word in the list wins.
 
-void updateLittleHams (int ham, int hamdex) {
-    
-    for(int i=0; i <5; i++) {
+void updateLittleHams(int ham, int hamdex) {
+    int i, child, temp[2];
+
+    for(i = 0; i < suggestionCount; i++) {
         // checks if word is a duplicate suggestion
-        if(!strcmp(wordList[suggestions[i][0]], wordList[hamdex])) {
+        if(!compareWords(suggestions[i][0], hamdex)) {
             return;
         }
     }
-    
-    for(int i=0; i < 5; i++) {
-        // Checks to fill any empty suggestions
-        if(suggestions[i][0] == 0 && suggestions[i][1] == MAX_WORD_LEN) {
-            suggestions[i][0] = hamdex;                                    
-            suggestions[i][1] = ham;
-            i = 5; // exit loop.
-            return;
+
+    if(suggestionCount < SUGGESTIONS) {
+        // fills an empty suggestion and sifts it up
+        i = suggestionCount++;
+        suggestions[i][0] = hamdex;
+        suggestions[i][1] = ham;
+
+        while(i > 0 && (suggestions[(i-1)/2][1] < suggestions[i][1] ||
+                (suggestions[(i-1)/2][1] == suggestions[i][1] && suggestions[(i-1)/2][0] < suggestions[i][0]))) {
+            temp[0] = suggestions[i][0];
+            temp[1] = suggestions[i][1];
+            suggestions[i][0] = suggestions[(i-1)/2][0];
+            suggestions[i][1] = suggestions[(i-1)/2][1];
+            suggestions[(i-1)/2][0] = temp[0];
+            suggestions[(i-1)/2][1] = temp[1];
+            i = (i-1)/2;
         }
+        return;
+    }
+
+    if(ham > suggestions[0][1] || (ham == suggestions[0][1] && hamdex > suggestions[0][0])) {
+        return;
     }
 
-    for(int i=0; i < 5; i++) {
-        // Replaces suggestion with current ham if lower
-        if(suggestions[i][1] > ham) {
-            suggestions[i][0] = hamdex;
-            suggestions[i][1] = ham;
-            i = 5; // exit loop.
+    // replaces the root and sifts it down
+    i = 0;
+    while(1) {
+        child = 2*i + 1;
+        if(child >= SUGGESTIONS) {
+            break;
+        }
+        if(child + 1 < SUGGESTIONS && (suggestions[child+1][1] > suggestions[child][1] ||
+                (suggestions[child+1][1] == suggestions[child][1] && suggestions[child+1][0] > suggestions[child][0]))) {
+            child++;
+        }
+        if(suggestions[child][1] < ham || (suggestions[child][1] == ham && suggestions[child][0] < hamdex)) {
+            break;
         }
+        suggestions[i][0] = suggestions[child][0];
+        suggestions[i][1] = suggestions[child][1];
+        i = child;
     }
+    suggestions[i][0] = hamdex;
+    suggestions[i][1] = ham;
 }
 
-// Checks if word exists using the first character index array to speed up search. Returns 0
-// if found.
+// Checks if word is in the word list, in any case, with one probe of the hash set in the
+// usual case. Returns 1 if found.
 
-int containsWord(char *word, int current, int end) {
-    int found = 1;
+int containsWord(char *word) {
+    int len = strlen(word), index;
+    unsigned int slot = hashWord(word, len) & (wordSetSize - 1);
 
-    while(found && current < end) {
-        if(strlen(word) == strlen(wordList[current])) {
-            found = getHam(word, wordList[current]); 
-            updateLittleHams(found, current);
+    while(wordSet[slot]) {
+        index = wordSet[slot] - 1;
+        if(wordLength[index] == len && !strncasecmp(word, WORD(index), len)) {
+            return 1;
         }
-        current++;   
+        slot = (slot + 1) & (wordSetSize - 1);
     }
-    return found;
+    return 0;
 }
 
-// Calculates hamming distance of the input word and the current test word. Returns as an integer.
+// Hashes a word with FNV-1a, ignoring case so that any capitalization finds the same slot.
+
+unsigned int hashWord(char *word, int len) {
+    unsigned int hash = 2166136261u;
 
-int getHam(char *word, char *test) {
-    int ham = 0, i = 0;
-    while(tolower(word[i]) != '\0' ) {
-        if(tolower(word[i]) != tolower(test[i])) {
-            ham++;
+    for(int i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char) tolower(word[i])) * 16777619u;
+    }
+    return hash;
+}
+
+// Rebuilds the hash set over the first len words of the word list, keeping it at most half full.
+
+void buildWordSet(int len) {
+    wordSetSize = 1;
+    while(wordSetSize < 2 * len + 2) {
+        wordSetSize *= 2;
+    }
+    wordSet = calloc(wordSetSize, sizeof(int));
+
+    for(int i = 0; i < len; i++) {
+        unsigned int slot = hashWord(WORD(i), wordLength[i]) & (wordSetSize - 1);
+        while(wordSet[slot]) {
+            slot = (slot + 1) & (wordSetSize - 1);
+        }
+        wordSet[slot] = i + 1;
+    }
+}
+
+// Sorts the first len words of the word list into one bucket per length, each a contiguous block
+// of lowercase rows zero padded to ROW_STRIDE(length) bytes.
+
+void buildBuckets(int len) {
+    int length, stride, filled[MAX_WORD_LEN] = {0};
+
+    for(int i = 0; i < len; i++) {
+        bucketCount[wordLength[i]]++;
+    }
+
+    for(length = 1; length < MAX_WORD_LEN; length++) {
+        if(bucketCount[length]) {
+            bucketRows[length] = calloc(bucketCount[length], ROW_STRIDE(length));
+            bucketWords[length] = malloc(bucketCount[length] * sizeof(int));
+        }
+    }
+
+    for(int i = 0; i < len; i++) {
+        length = wordLength[i];
+        if(length == 0) {
+            continue;
+        }
+        stride = ROW_STRIDE(length);
+        char *row = bucketRows[length] + filled[length] * stride;
+        for(int j = 0; j < length; j++) {
+            row[j] = tolower(WORD(i)[j]);
+        }
+        bucketWords[length][filled[length]++] = i;
+    }
+}
+
+// Fills the suggestions with the closest words of the same length as the input word, in one pass
+// over that length's bucket.
+
+void findSuggestions(char *word, int wordLen) {
+    char query[ROW_STRIDE(MAX_WORD_LEN)] = {0};
+    int stride = ROW_STRIDE(wordLen);
+    char *row = bucketRows[wordLen];
+    int ham;
+
+    for(int i = 0; i < wordLen; i++) {
+        query[i] = tolower(word[i]);
+    }
+
+    for(int i = 0; i < bucketCount[wordLen]; i++, row += stride) {
+        ham = getHam(query, row, stride);
+        if(suggestionCount < SUGGESTIONS || ham <= suggestions[0][1]) {
+            updateLittleHams(ham, bucketWords[wordLen][i]);
+        }
+    }
+}
+
+// Calculates the hamming distance between two padded rows of stride bytes, by comparing them 16
+// (or 32) bytes at a time and counting the bytes that match. Returns as an integer.
+
+int getHam(const char *query, const char *row, int stride) {
+    int same = 0, i = 0;
+
+#if defined(__AVX2__)
+    for(; i + 32 <= stride; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *) (query + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *) (row + i));
+        same += __builtin_popcount((unsigned int) _mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b)));
+    }
+#endif
+#if defined(__SSE2__)
+    for(; i + 16 <= stride; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *) (query + i));
+        __m128i b = _mm_loadu_si128((const __m128i *) (row + i));
+        same += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(a, b)));
+    }
+#endif
+    for(; i < stride; i++) {
+        same += (query[i] == row[i]);
+    }
+    return stride - same;
+}
+
+// Builds the deletion index over the first len words of the word list, filing each word under the
+// hash of every delete of its prefix, and reports its size and build time.
+
+void buildDeleteIndex(int len) {
+    unsigned int hashes[MAX_DELETES];
+    int count, bucket, total;
+    clock_t start = clock();
+
+    deleteTableSize = 1;
+    while(deleteTableSize < 16 * len) {
+        deleteTableSize *= 2;
+    }
+    deleteStart = calloc(deleteTableSize + 1, sizeof(int));
+
+    // counts the words in each bucket, then turns the counts into starting positions
+
+    for(int i = 0; i < len; i++) {
+        count = wordDeletes(WORD(i), wordLength[i], hashes);
+        for(int j = 0; j < count; j++) {
+            deleteStart[(hashes[j] & (deleteTableSize - 1)) + 1]++;
+        }
+    }
+    for(bucket = 0; bucket < deleteTableSize; bucket++) {
+        deleteStart[bucket + 1] += deleteStart[bucket];
+    }
+    total = deleteStart[deleteTableSize];
+    deleteWords = malloc((total + 1) * sizeof(int));
+
+    // files each word, which moves each start up to the next bucket's, then moves them back
+
+    for(int i = 0; i < len; i++) {
+        count = wordDeletes(WORD(i), wordLength[i], hashes);
+        for(int j = 0; j < count; j++) {
+            deleteWords[deleteStart[hashes[j] & (deleteTableSize - 1)]++] = i;
+        }
+    }
+    for(bucket = deleteTableSize; bucket > 0; bucket--) {
+        deleteStart[bucket] = deleteStart[bucket - 1];
+    }
+    deleteStart[0] = 0;
+
+    fprintf(messages, "\n>> Edit index: %i deletes in %.1f MB, built in %.0f ms.\n", total,
+        ((deleteTableSize + 1) + total) * sizeof(int) / 1048576.0,
+        (clock() - start) * 1000.0 / CLOCKS_PER_SEC);
+}
+
+// Hashes every distinct way of deleting up to MAX_EDITS letters from the lowercase prefix of a word
+// into hashes, including deleting none. Returns the number of hashes.
+
+int wordDeletes(char *word, int len, unsigned int *hashes) {
+    char prefix[PREFIX_LEN];
+    int count = 0;
+
+    if(len > PREFIX_LEN) {
+        len = PREFIX_LEN;
+    }
+    for(int i = 0; i < len; i++) {
+        prefix[i] = tolower(word[i]);
+    }
+
+    count = addDelete(hashes, count, prefix, len, -1, -1);
+    for(int i = 0; i < len; i++) {
+        count = addDelete(hashes, count, prefix, len, i, -1);
+        for(int j = i + 1; j < len; j++) {
+            count = addDelete(hashes, count, prefix, len, i, j);
+        }
+    }
+    return count;
+}
+
+// Hashes the prefix with the letters at skip1 and skip2 left out (-1 for none), the same way
+// hashWord() does, and adds it to hashes unless it is already there. Returns the new count.
+
+int addDelete(unsigned int *hashes, int count, char *prefix, int len, int skip1, int skip2) {
+    unsigned int hash = 2166136261u;
+
+    for(int i = 0; i < len; i++) {
+        if(i != skip1 && i != skip2) {
+            hash = (hash ^ (unsigned char) prefix[i]) * 16777619u;
+        }
+    }
+    for(int i = 0; i < count; i++) {
+        if(hashes[i] == hash) {
+            return count;
+        }
+    }
+    hashes[count] = hash;
+    return count + 1;
+}
+
+// Fills the suggestions with the words within MAX_EDITS edits of the input word, by looking up
+// the deletes of its prefix and checking each word filed under them once.
+
+void findEditSuggestions(char *word, int wordLen) {
+    unsigned int hashes[MAX_DELETES];
+    int count = wordDeletes(word, wordLen, hashes), bucket, index, edits;
+
+    lookupCount++;
+    for(int i = 0; i < count; i++) {
+        bucket = hashes[i] & (deleteTableSize - 1);
+
+        for(int j = deleteStart[bucket]; j < deleteStart[bucket + 1]; j++) {
+            index = deleteWords[j];
+            if(candidateSeen[index] == lookupCount) {
+                continue;
+            }
+            candidateSeen[index] = lookupCount;
+
+            edits = editDistance(word, wordLen, WORD(index), wordLength[index], MAX_EDITS);
+            if(edits <= MAX_EDITS && (suggestionCount < SUGGESTIONS || edits <= suggestions[0][1])) {
+                updateLittleHams(edits, index);
+            }
         }
-        i++;
     }
-    return ham;
 }
 
-// Sorts the suggestions alphabetically by first letter and calls the printSuggestions() function
+// Calculates the edit distance between two words, in any case, counting insertions, deletions,
+// substitutions and swaps of neighbouring letters. Stops early and returns max + 1 once the
+// distance must be more than max.
+
+int editDistance(char *word, int wordLen, char *test, int testLen, int max) {
+    int rows[3][MAX_WORD_LEN + 1];
+    int *before = rows[0], *last = rows[1], *row = rows[2], *temp;
+    int smallest, cost;
+
+    if(wordLen - testLen > max || testLen - wordLen > max) {
+        return max + 1;
+    }
+
+    for(int j = 0; j <= testLen; j++) {
+        last[j] = j;
+    }
+    for(int i = 1; i <= wordLen; i++) {
+        row[0] = smallest = i;
+
+        for(int j = 1; j <= testLen; j++) {
+            cost = tolower(word[i-1]) != tolower(test[j-1]);
+            row[j] = last[j-1] + cost;
+            if(last[j] + 1 < row[j]) {
+                row[j] = last[j] + 1;
+            }
+            if(row[j-1] + 1 < row[j]) {
+                row[j] = row[j-1] + 1;
+            }
+            if(i > 1 && j > 1 && tolower(word[i-1]) == tolower(test[j-2]) &&
+                    tolower(word[i-2]) == tolower(test[j-1]) && before[j-2] + 1 < row[j]) {
+                row[j] = before[j-2] + 1;
+            }
+            if(row[j] < smallest) {
+                smallest = row[j];
+            }
+        }
+        if(smallest > max) {
+            return max + 1;
+        }
+        temp = before;
+        before = last;
+        last = row;
+        row = temp;
+    }
+    return (last[testLen] > max) ? max + 1 : last[testLen];
+}
+
+// Builds the DAWG from the first len words of the word list, and returns the number of distinct
+// words in it, or 0 if it has too many edges. The words are added in sorted order, keeping the
+// edges of the nodes along the last word in path; when the next word leaves that path, the nodes
+// below the point it leaves are finished, from the deepest up, by freezeNode().
+
+int buildDawg(int len) {
+    static unsigned int path[MAX_WORD_LEN][256];
+    int pathCount[MAX_WORD_LEN] = {0};
+    char word[MAX_WORD_LEN], last[MAX_WORD_LEN];
+    int *order = malloc(len * sizeof(int));
+    int wordLen, lastLen = 0, common, depth, count = 0;
+    clock_t start = clock();
+
+    free(dawg);
+    dawgSize = 1;
+    dawgCapacity = 1024;
+    dawg = malloc(dawgCapacity * sizeof(unsigned int));
+    dawgNodes = 0;
+    dawgRegisterSize = 1024;
+    dawgRegister = calloc(dawgRegisterSize, sizeof(int));
+
+    for(int i = 0; i < len; i++) {
+        order[i] = i;
+    }
+    qsort(order, len, sizeof(int), compareOrder);
+
+    for(int i = 0; i < len && dawgSize < DAWG_MAX_EDGES; i++) {
+        wordLen = wordLength[order[i]];
+        for(int j = 0; j < wordLen; j++) {
+            word[j] = tolower(WORD(order[i])[j]);
+        }
+        for(common = 0; common < wordLen && common < lastLen && word[common] == last[common]; common++);
+        if(common == wordLen && common == lastLen) {
+            continue;    // the same word in another case.
+        }
+
+        for(depth = lastLen; depth > common; depth--) {
+            path[depth-1][pathCount[depth-1]-1] |= (unsigned int) freezeNode(path[depth], pathCount[depth]) << 10;
+        }
+        for(depth = common; depth < wordLen; depth++) {
+            path[depth][pathCount[depth]++] = (unsigned char) word[depth] | ((depth == wordLen - 1) ? DAWG_FINAL : 0);
+            if(depth + 1 < MAX_WORD_LEN) {
+                pathCount[depth+1] = 0;
+            }
+        }
+        memcpy(last, word, wordLen);
+        lastLen = wordLen;
+        count++;
+    }
+    for(depth = lastLen; depth > 0; depth--) {
+        path[depth-1][pathCount[depth-1]-1] |= (unsigned int) freezeNode(path[depth], pathCount[depth]) << 10;
+    }
+    dawgRoot = freezeNode(path[0], pathCount[0]);
+
+    free(order);
+    free(dawgRegister);
+    dawgRegister = NULL;
+
+    if(dawgSize >= DAWG_MAX_EDGES) {
+        fprintf(messages, "\n>> The word list is too large for a DAWG.\n\n");
+        return 0;
+    }
+    fprintf(messages, "\n>> DAWG: %i nodes, %i edges in %.0f KB, built in %.0f ms.\n", dawgNodes, dawgSize - 1,
+        dawgSize * sizeof(unsigned int) / 1024.0, (clock() - start) * 1000.0 / CLOCKS_PER_SEC);
+    return count;
+}
+
+// Sorts word list indexes for qsort() by the words they point to, in any case.
+
+int compareOrder(const void *first, const void *second) {
+    return compareWords(*(const int *) first, *(const int *) second);
+}
+
+// Finishes a node given its edges, whose children are all finished: returns the first edge of an
+// identical node if one was finished already, or else adds the edges to the DAWG and returns the
+// first of them. A node without edges is 0.
+
+int freezeNode(unsigned int *edges, int count) {
+    unsigned int hash = 2166136261u;
+    unsigned int slot;
+    int node, *oldRegister = dawgRegister;
+
+    if(count == 0) {
+        return 0;
+    }
+    edges[count-1] |= DAWG_LAST;
+    for(int i = 0; i < count; i++) {
+        hash = (hash ^ edges[i]) * 16777619u;
+    }
+
+    for(slot = hash & (dawgRegisterSize - 1); dawgRegister[slot]; slot = (slot + 1) & (dawgRegisterSize - 1)) {
+        node = dawgRegister[slot];
+        if(node + count <= dawgSize && !memcmp(dawg + node, edges, count * sizeof(unsigned int))) {
+            return node;
+        }
+    }
+
+    // adds the node, growing the edges and the register as needed
+
+    node = dawgSize;
+    if(dawgSize + count > dawgCapacity) {
+        dawgCapacity *= 2;
+        dawg = realloc(dawg, dawgCapacity * sizeof(unsigned int));
+    }
+    memcpy(dawg + node, edges, count * sizeof(unsigned int));
+    dawgSize += count;
+    dawgRegister[slot] = node;
+    dawgNodes++;
+
+    if(2 * dawgNodes >= dawgRegisterSize) {
+        dawgRegisterSize *= 2;
+        dawgRegister = calloc(dawgRegisterSize, sizeof(int));
+        for(int i = 0; i < dawgRegisterSize / 2; i++) {
+            if(oldRegister[i]) {
+                hash = 2166136261u;
+                for(int e = oldRegister[i]; ; e++) {
+                    hash = (hash ^ dawg[e]) * 16777619u;
+                    if(dawg[e] & DAWG_LAST) {
+                        break;
+                    }
+                }
+                for(slot = hash & (dawgRegisterSize - 1); dawgRegister[slot]; slot = (slot + 1) & (dawgRegisterSize - 1));
+                dawgRegister[slot] = oldRegister[i];
+            }
+        }
+        free(oldRegister);
+    }
+    return node;
+}
+
+// Checks if word is in the DAWG, in any case, by walking its letters from the root. Returns 1 if
+// found.
+
+int dawgContains(char *word) {
+    unsigned int edge = 0;
+    int node = dawgRoot;
+    char letter;
+
+    for(int i = 0; word[i] != '\0'; i++) {
+        if(node == 0) {
+            return 0;
+        }
+        letter = tolower(word[i]);
+        for(edge = dawg[node]; (char) (edge & 0xff) != letter; edge = dawg[++node]) {
+            if(edge & DAWG_LAST) {
+                return 0;
+            }
+        }
+        node = DAWG_CHILD(edge);
+    }
+    return (edge & DAWG_FINAL) != 0;
+}
+
+// Finds the closest words in the DAWG to the input word and prints them.
+
+void dawgSuggestions(char *word, int wordLen) {
+    findDawgSuggestions(word, wordLen);
+
+    printf("\nCould not find %s in the current dictionary, did you mean: \n\n", word);
+    for(int i = 0; i < dawgFoundCount; i++) {
+        printf("\t%s", dawgFound[i]);
+    }
+    printf("\n");
+}
+
+// Finds the closest words in the DAWG within MAX_EDITS edits of the input word, or one more if
+// fewer than SUGGESTIONS are that close, and sorts them alphabetically.
+
+void findDawgSuggestions(char *word, int wordLen) {
+    char temp[MAX_WORD_LEN];
+    int lowest, tempEdits;
+
+    dawgQueryLen = wordLen;
+    for(int i = 0; i < wordLen; i++) {
+        dawgQuery[i] = tolower(word[i]);
+    }
+    for(int j = 0; j <= wordLen; j++) {
+        dawgRows[0][j] = j;
+    }
+
+    dawgFoundCount = 0;
+    for(dawgMax = MAX_EDITS; dawgMax <= MAX_EDITS + 1 && dawgFoundCount < SUGGESTIONS; dawgMax++) {
+        dawgFoundCount = 0;
+        dawgSearch(dawgRoot, 0);
+    }
+
+    // sorts the words found
+
+    for(int i = 0; i < dawgFoundCount - 1; i++) {
+        lowest = i;
+        for(int j = i + 1; j < dawgFoundCount; j++) {
+            if(strcmp(dawgFound[j], dawgFound[lowest]) < 0) {
+                lowest = j;
+            }
+        }
+        memcpy(temp, dawgFound[lowest], MAX_WORD_LEN);
+        memcpy(dawgFound[lowest], dawgFound[i], MAX_WORD_LEN);
+        memcpy(dawgFound[i], temp, MAX_WORD_LEN);
+        tempEdits = dawgFoundEdits[lowest];
+        dawgFoundEdits[lowest] = dawgFoundEdits[i];
+        dawgFoundEdits[i] = tempEdits;
+    }
+}
+
+// Walks the edges of a node depth letters below the root, working out the edit distance row for
+// each edge's letter from the rows above it. Only the cells within dawgMax of the diagonal can be
+// within budget, so only those are worked out, with the cells either side of them set just over it.
+// Offers each word that ends within the budget, and only walks on below a letter while some cell
+// of its row is still within it.
+
+void dawgSearch(int node, int depth) {
+    int *row = dawgRows[depth + 1], *last = dawgRows[depth];
+    int low = (depth + 1 - dawgMax > 1) ? depth + 1 - dawgMax : 1;
+    int high = (depth + 1 + dawgMax < dawgQueryLen) ? depth + 1 + dawgMax : dawgQueryLen;
+    int smallest, budget;
+    unsigned int edge;
+    char letter;
+
+    if(node == 0) {
+        return;
+    }
+
+    for(int e = node; ; e++) {
+        edge = dawg[e];
+        letter = edge & 0xff;
+        dawgPrefix[depth] = letter;
+        row[0] = smallest = depth + 1;
+        if(low > 1) {
+            row[low-1] = dawgMax + 1;
+        }
+        if(high < dawgQueryLen) {
+            row[high+1] = dawgMax + 1;
+        }
+
+        for(int j = low; j <= high; j++) {
+            row[j] = last[j-1] + (letter != dawgQuery[j-1]);
+            if(last[j] + 1 < row[j]) {
+                row[j] = last[j] + 1;
+            }
+            if(row[j-1] + 1 < row[j]) {
+                row[j] = row[j-1] + 1;
+            }
+            if(depth > 0 && j > 1 && letter == dawgQuery[j-2] && dawgPrefix[depth-1] == dawgQuery[j-1] &&
+                    dawgRows[depth-1][j-2] + 1 < row[j]) {
+                row[j] = dawgRows[depth-1][j-2] + 1;
+            }
+            if(row[j] < smallest) {
+                smallest = row[j];
+            }
+        }
+
+        budget = (dawgFoundCount < SUGGESTIONS) ? dawgMax : dawgFoundEdits[SUGGESTIONS-1] - 1;
+        if((edge & DAWG_FINAL) && low <= high && high == dawgQueryLen && row[dawgQueryLen] <= budget) {
+            addDawgSuggestion(row[dawgQueryLen], depth + 1);
+            budget = (dawgFoundCount < SUGGESTIONS) ? dawgMax : dawgFoundEdits[SUGGESTIONS-1] - 1;
+        }
+        if(smallest <= budget) {
+            dawgSearch(DAWG_CHILD(edge), depth + 1);
+        }
+        if(edge & DAWG_LAST) {
+            break;
+        }
+    }
+}
+
+// Adds the word spelled by the first len letters of the path to the closest words found, after
+// any as close, dropping the farthest if there are SUGGESTIONS already.
+
+void addDawgSuggestion(int edits, int len) {
+    int i = (dawgFoundCount < SUGGESTIONS) ? dawgFoundCount++ : SUGGESTIONS - 1;
+
+    for(; i > 0 && dawgFoundEdits[i-1] > edits; i--) {
+        memcpy(dawgFound[i], dawgFound[i-1], MAX_WORD_LEN);
+        dawgFoundEdits[i] = dawgFoundEdits[i-1];
+    }
+    memcpy(dawgFound[i], dawgPrefix, len);
+    dawgFound[i][len] = '\0';
+    dawgFoundEdits[i] = edits;
+}
+
+// Prints every word below a node depth letters below the root in alphabetical order.
+
+void printDawg(int node, int depth) {
+    if(node == 0) {
+        return;
+    }
+    for(int e = node; ; e++) {
+        dawgPrefix[depth] = dawg[e] & 0xff;
+        if(dawg[e] & DAWG_FINAL) {
+            printf("%.*s\n", depth + 1, dawgPrefix);
+        }
+        printDawg(DAWG_CHILD(dawg[e]), depth + 1);
+        if(dawg[e] & DAWG_LAST) {
+            break;
+        }
+    }
+}
+
+// Checks every word in the given documents, or stdin if there are none, against the word list on a
+// pool of threads (one per processor if threads is 0), and prints each misspelling as
+// path:line:column: word: suggestion,suggestion,... in document order, with reports on stderr.
+// Returns 1 if anything was misspelled, or 2 if the word list or a document could not be read.
+
+int checkDocuments(char *list, char **paths, int count, int threads) {
+    pthread_t *pool;
+    struct timespec start, end;
+    long checked = 0, misspelled = 0;
+    int status = 0, read = 0;
+
+    messages = stderr;
+    if(!(listWords = loadFile(list))) {
+        return 2;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if(threads <= 0 && (threads = sysconf(_SC_NPROCESSORS_ONLN)) <= 0) {
+        threads = 1;
+    }
+    pool = malloc(threads * sizeof(pthread_t));
+    for(int i = 0; i < threads; i++) {
+        pthread_create(&pool[i], NULL, checkWorker, NULL);
+    }
+
+    for(int i = 0; i < count || (count == 0 && i == 0); i++) {
+        if(addDocument(count ? paths[i] : "-")) {
+            read++;
+        } else {
+            status = 2;
+        }
+        if(tokenCount >= BATCH_TOKENS || documentCount == BATCH_DOCUMENTS) {
+            checked += tokenCount;
+            misspelled += flushBatch(threads);
+        }
+    }
+    checked += tokenCount;
+    misspelled += flushBatch(threads);
+
+    pthread_mutex_lock(&poolLock);
+    poolStop = 1;
+    pthread_cond_broadcast(&poolWork);
+    pthread_mutex_unlock(&poolLock);
+    for(int i = 0; i < threads; i++) {
+        pthread_join(pool[i], NULL);
+    }
+    free(pool);
+    free(tokens);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    fprintf(stderr, ">> Checked %li words in %i document%s on %i thread%s in %.0f ms: %li misspelled.\n",
+        checked, read, (read == 1) ? "" : "s", threads, (threads == 1) ? "" : "s",
+        (end.tv_sec - start.tv_sec) * 1000.0 + (end.tv_nsec - start.tv_nsec) / 1000000.0, misspelled);
+    return status ? status : misspelled > 0;
+}
+
+// Maps a document, or reads stdin for -, into the batch and adds its words to the tokens. Returns 0
+// if it could not be read.
+
+int addDocument(char *name) {
+    Document *document = &documents[documentCount];
+    struct stat info;
+    size_t capacity = 65536, got;
+    int file;
+
+    document->name = name;
+    document->text = NULL;
+    document->size = 0;
+    document->mapped = 0;
+
+    if(!strcmp(name, "-")) {
+        document->text = malloc(capacity);
+        while((got = fread(document->text + document->size, 1, capacity - document->size, stdin)) > 0) {
+            document->size += got;
+            if(document->size == capacity) {
+                capacity *= 2;
+                document->text = realloc(document->text, capacity);
+            }
+        }
+    } else {
+        file = open(name, O_RDONLY);
+        if(file < 0 || fstat(file, &info) < 0 || !S_ISREG(info.st_mode) || (info.st_size > 0 &&
+                (document->text = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, file, 0)) == MAP_FAILED)) {
+            fprintf(stderr, "%s: could not be read.\n", name);
+            if(file >= 0) {
+                close(file);
+            }
+            return 0;
+        }
+        close(file);
+        document->size = info.st_size;
+        document->mapped = info.st_size > 0;
+    }
+
+    tokenize(documentCount++);
+    return 1;
+}
+
+// Splits a document into words: runs of letters, digits, apostrophes, underscores and non-ASCII
+// bytes, less any apostrophes at either end. Runs with anything but letters and apostrophes in them,
+// such as x86 or snake_case, are left alone, as are words too long to be in the list.
+
+void tokenize(int document) {
+    char *text = documents[document].text;
+    size_t size = documents[document].size, i = 0, start, end, lineStart = 0;
+    int line = 1, plain;
+    unsigned char c;
+
+    while(i < size) {
+        c = text[i];
+        if(c == '\n') {
+            line++;
+            lineStart = ++i;
+            continue;
+        }
+        if(!isalnum(c) && c != '\'' && c != '_' && c < 0x80) {
+            i++;
+            continue;
+        }
+
+        plain = 1;
+        for(start = i; i < size; i++) {
+            c = text[i];
+            if(!isalnum(c) && c != '\'' && c != '_' && c < 0x80) {
+                break;
+            }
+            if(!isalpha(c) && c != '\'') {
+                plain = 0;
+            }
+        }
+        for(end = i; end > start && text[end-1] == '\''; end--);
+        while(start < end && text[start] == '\'') {
+            start++;
+        }
+
+        if(plain && end > start && end - start < MAX_WORD_LEN) {
+            if(tokenCount == tokenCapacity) {
+                tokenCapacity = tokenCapacity ? 2 * tokenCapacity : 4096;
+                tokens = realloc(tokens, tokenCapacity * sizeof(Token));
+            }
+            tokens[tokenCount].document = document;
+            tokens[tokenCount].line = line;
+            tokens[tokenCount].column = start - lineStart + 1;
+            tokens[tokenCount].text = text + start;
+            tokens[tokenCount].length = end - start;
+            tokens[tokenCount].suggestions = NULL;
+            tokenCount++;
+        }
+    }
+}
+
+// Hands the words of the batch to the pool and waits for it, prints the misspelled ones in order,
+// and empties the batch. Returns the number misspelled.
+
+long flushBatch(int threads) {
+    long misspelled = 0;
+    Token *token;
+
+    pthread_mutex_lock(&poolLock);
+    nextToken = 0;
+    poolBusy = threads;
+    poolBatch++;
+    pthread_cond_broadcast(&poolWork);
+    while(poolBusy) {
+        pthread_cond_wait(&poolDone, &poolLock);
+    }
+    pthread_mutex_unlock(&poolLock);
+
+    for(int i = 0; i < tokenCount; i++) {
+        token = &tokens[i];
+        if(token->suggestions != NULL) {
+            printf("%s:%i:%i: %.*s: %s\n", documents[token->document].name, token->line, token->column,
+                token->length, token->text, token->suggestions);
+            free(token->suggestions);
+            misspelled++;
+        }
+    }
+
+    for(int i = 0; i < documentCount; i++) {
+        if(documents[i].mapped) {
+            munmap(documents[i].text, documents[i].size);
+        } else {
+            free(documents[i].text);
+        }
+    }
+    documentCount = 0;
+    tokenCount = 0;
+    return misspelled;
+}
+
+// Runs each thread of the pool: waits for a batch, claims TOKEN_CHUNK of its words at a time until
+// none are left, and tells flushBatch() once it is done, until the pool is stopped.
+
+void *checkWorker(void *unused) {
+    int batch = 0, start, end;
+
+    (void) unused;
+    candidateSeen = calloc(listWords + 1, sizeof(int));
+    lookupCount = 0;
+
+    pthread_mutex_lock(&poolLock);
+    while(1) {
+        while(poolBatch == batch && !poolStop) {
+            pthread_cond_wait(&poolWork, &poolLock);
+        }
+        if(poolStop) {
+            break;
+        }
+        batch = poolBatch;
+
+        while(nextToken < tokenCount) {
+            start = nextToken;
+            end = (start + TOKEN_CHUNK < tokenCount) ? start + TOKEN_CHUNK : tokenCount;
+            nextToken = end;
+            pthread_mutex_unlock(&poolLock);
+            checkTokens(start, end);
+            pthread_mutex_lock(&poolLock);
+        }
+        if(--poolBusy == 0) {
+            pthread_cond_signal(&poolDone);
+        }
+    }
+    pthread_mutex_unlock(&poolLock);
+
+    free(candidateSeen);
+    return NULL;
+}
+
+// Checks the words from start up to end, and lists suggestions for each one not in the word list.
+
+void checkTokens(int start, int end) {
+    char word[MAX_WORD_LEN];
+    int len;
+
+    for(int i = start; i < end; i++) {
+        len = tokens[i].length;
+        memcpy(word, tokens[i].text, len);
+        word[len] = '\0';
+
+        if(!tokenListed(word, &len)) {
+            tokens[i].suggestions = suggestionList(word, len);
+        }
+    }
+}
+
+// Looks up a word from a document. One with an apostrophe that is not listed as it is, which most
+// possessives and contractions are not, is looked up again as its stem before a trailing 's, as in
+// dog's or it's, and then with its apostrophes taken out, as in can't. If none of them is listed,
+// the stem is left in word and its length in len, for suggestions. Returns 1 if any is listed.
+
+int tokenListed(char *word, int *len) {
+    char joined[MAX_WORD_LEN];
+    int joinedLen = 0;
+
+    if(useDawg ? dawgContains(word) : containsWord(word)) {
+        return 1;
+    }
+    if(!memchr(word, '\'', *len)) {
+        return 0;
+    }
+    if(*len > 2 && word[*len-2] == '\'' && tolower(word[*len-1]) == 's') {
+        *len -= 2;
+        word[*len] = '\0';
+        if(useDawg ? dawgContains(word) : containsWord(word)) {
+            return 1;
+        }
+    }
+
+    for(int i = 0; i <= *len; i++) {
+        if(word[i] != '\'') {
+            joined[joinedLen++] = word[i];
+        }
+    }
+    return joinedLen - 1 < *len && (useDawg ? dawgContains(joined) : containsWord(joined));
+}
+
+// Finds the suggestions for a word not in the list, the same way checkWord() does, and returns them
+// in alphabetical order separated by commas, in a string for the caller to free.
+
+char *suggestionList(char *word, int wordLen) {
+    char *list = malloc(SUGGESTIONS * MAX_WORD_LEN + 1);
+    int used = 0;
+
+    if(useDawg) {
+        findDawgSuggestions(word, wordLen);
+        for(int i = 0; i < dawgFoundCount; i++) {
+            used += sprintf(list + used, "%s%s", i ? "," : "", dawgFound[i]);
+        }
+    } else {
+        clearSuggestions();
+        findEditSuggestions(word, wordLen);
+        if(suggestionCount < SUGGESTIONS) {
+            findSuggestions(word, wordLen);
+        }
+        sortSuggestions();
+        for(int i = 0; i < suggestionCount; i++) {
+            used += sprintf(list + used, "%s%.*s", i ? "," : "", wordLength[suggestions[i][0]], WORD(suggestions[i][0]));
+        }
+    }
+    list[used] = '\0';
+    return list;
+}
+
+// Sorts the suggestions alphabetically and calls the printSuggestions() function.
 
 void offerSuggestions(char *word) {
+    sortSuggestions();
+    printSuggestions(word);
+}
+
+// Sorts the suggestions alphabetically.
+
+void sortSuggestions() {
     int tempInd;
     int lowest, lowIndex, jIndex;
 
-    // sorts array
-
-    for(int i = 0; i < 4; i++ ) {
+    for(int i = 0; i < suggestionCount - 1; i++ ) {
         lowest = i;
 
-        for(int j = i + 1; j < 5; j++) {
+        for(int j = i + 1; j < suggestionCount; j++) {
             lowIndex = suggestions[lowest][0];
             jIndex = suggestions[j][0];
 
-            if(tolower(wordList[jIndex][0]) < tolower(wordList[lowIndex][0])) {
+            if(compareWords(jIndex, lowIndex) < 0) {
                 lowest = j;  
             }
         }
@@ -215,7 +1532,16 @@ void offerSuggestions(char *word) {
         suggestions[lowest][0] = suggestions[i][0];
         suggestions[i][0] = tempInd;
     }
-    printSuggestions(word);
+}
+
+// Compares two words of the word list alphabetically, in any case. Returns less than, equal to or
+// greater than 0 as the first word sorts before, the same as or after the second.
+
+int compareWords(int first, int second) {
+    int len = (wordLength[first] < wordLength[second]) ? wordLength[first] : wordLength[second];
+    int order = strncasecmp(WORD(first), WORD(second), len);
+
+    return order ? order : wordLength[first] - wordLength[second];
 }
 
 // Removes newline characters from text file/fgets input.
@@ -235,7 +1561,8 @@ void cleanInput(char *input) {
 // in a new spell check.
 
 void clearSuggestions(){
-    for(int i = 0; i < 5; i++) {
+    suggestionCount = 0;
+    for(int i = 0; i < SUGGESTIONS; i++) {
         suggestions[i][0] = 0;
         suggestions[i][1] = MAX_WORD_LEN;
     }
@@ -245,8 +1572,8 @@ void clearSuggestions(){
 
 void printSuggestions(char *word) {
     printf("\nCould not find %s in the current dictionary, did you mean: \n\n", word);
-    for(int i = 0; i < 5; i++) {
-        printf("\t%s", wordList[suggestions[i][0]]);
+    for(int i = 0; i < suggestionCount; i++) {
+        printf("\t%.*s", wordLength[suggestions[i][0]], WORD(suggestions[i][0]));
     }
     printf("\n");
 }
@@ -254,23 +1581,49 @@ void printSuggestions(char *word) {
 // MAIN
 
 int main(int argc, char *argv[]) {
-    int len, exec = 1;
+    int len, exec = 1, arg, check = 0, threads = 0;
+    char currentFile[MAX_PATH_LEN];
+
+    messages = stdout;
+
+    for(arg = 1; arg < argc && !strncmp(argv[arg], "--", 2); arg++) {
+        if(!strcmp(argv[arg], "--dawg")) {
+            useDawg = 1;
+        } else if(!strcmp(argv[arg], "--check")) {
+            check = 1;
+        } else if(!strncmp(argv[arg], "--threads=", 10) && atoi(argv[arg] + 10) > 0) {
+            threads = atoi(argv[arg] + 10);
+        } else if(!strcmp(argv[arg], "--compile") && argc - arg == 3) {
+            if(useDawg) {
+                printf("A compiled dictionary holds the flat word list; --dawg cannot be used with --compile.\n");
+                return -1;
+            }
+            return compileFile(argv[arg+1], argv[arg+2]) ? 0 : -1;
+        } else {
+            break;
+        }
+    }
+    if(check && arg < argc && strncmp(argv[arg], "--", 2)) {
+        return checkDocuments(argv[arg], argv + arg + 1, argc - arg - 1, threads);
+    }
+
     printf("----------------------\n");
     printf("WELCOME TO SPELL CHECK\n");
     printf("----------------------\n");
 
-    char currentFile[MAX_WORD_LEN];
-
-    if(argc == 1 || argc > 2) {
-        printf("Invalid argument. Please run program using a text file-based word list.\n");
+    if(arg != argc - 1 || !strncmp(argv[arg], "--", 2)) {
+        printf("Invalid argument. Please run program using a text file-based word list, or a dictionary\n");
+        printf("compiled from one with: spellcheck --compile <word list> <dictionary>\n");
+        printf("Put --dawg before the list to check against a DAWG built from it instead.\n");
+        printf("To check documents or stdin: spellcheck --check [--threads=N] <word list> [documents...]\n");
         return -1;
     } else {
-        strcpy(currentFile, argv[1]);
+        snprintf(currentFile, MAX_PATH_LEN, "%s", argv[arg]);
     }
     printf("Loading %s...", currentFile);
     len = loadFile(currentFile);
 
-    char select[1];
+    char select[5];
 
     //  MENU
     while(exec && len) {
@@ -286,20 +1639,24 @@ int main(int argc, char *argv[]) {
 
         switch(select[0]) {
             case '1' :
-                checkWord(len);
+                checkWord();
                 break;
             case '2' :
                 printf("\nEnter the relative path of file name for the word list you wish to use: ");
                 
-                fgets(currentFile, MAX_WORD_LEN, stdin);
+                fgets(currentFile, MAX_PATH_LEN, stdin);
                 cleanInput(currentFile);
                 printf("\n----------------------\n");
                 len = loadFile(currentFile); // exits loop if invalid file.
                 break;
             case '3' : 
                 printf("\nPrinting word list from %s... q\n\n", currentFile);
-                for(int i = 0; i < len; i++) {
-                    printf("%s\n", wordList[i]);
+                if(useDawg) {
+                    printDawg(dawgRoot, 0);
+                } else {
+                    for(int i = 0; i < len; i++) {
+                        printf("%.*s\n", wordLength[i], WORD(i));
+                    }
                 }
                 printf("\n%i words\n\n", len);
                 break;